@@ -0,0 +1,60 @@
+#ifndef BITMAP_INLINE_H__
+#define BITMAP_INLINE_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include "bitmap.h"
+
+// Opt-in fast path for trusted callers that sit in the same build as bitmap.c.
+// Exposing the layout lets bit tests and updates compile down to a load and a mask instead of
+// a call through the PLT. The layout is private to this library: code outside it should stick
+// to bitmap.h, which keeps working if the struct changes.
+// Same rules as bitmap.h: no bounds or NULL checks.
+
+struct bitmap
+{
+    unsigned leftover_bits;  // Packing will increase this to an int anyway
+    unsigned flags;          // BITMAP_FLAGS, see bitmap.c
+    uint8_t *data;
+    size_t bit_count, byte_count;
+};
+
+///
+/// Sets requested bit in bitmap, inlined
+/// \param bitmap The bitmap
+/// \param bit The bit to set
+///
+static inline void bitmap_set_inline(bitmap_t *const bitmap, const size_t bit)
+{
+    bitmap->data[bit >> 3] |= (uint8_t) (1u << (bit & 0x07));
+}
+
+///
+/// Clears requested bit in bitmap, inlined
+/// \param bitmap The bitmap
+/// \param bit The bit to clear
+///
+static inline void bitmap_reset_inline(bitmap_t *const bitmap, const size_t bit)
+{
+    bitmap->data[bit >> 3] &= (uint8_t) ~(1u << (bit & 0x07));
+}
+
+///
+/// Returns bit in bitmap, inlined
+/// \param bitmap The bitmap
+/// \param bit The bit to query
+/// \return State of requested bit
+///
+static inline bool bitmap_test_inline(const bitmap_t *const bitmap, const size_t bit)
+{
+    return (bitmap->data[bit >> 3] >> (bit & 0x07)) & 0x01;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef BLOCK_CACHE_H__
+#define BLOCK_CACHE_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Fixed-size buffer cache of chunk frames over a file.
+// Replacement is 2Q: chunks seen once wait in a small FIFO, chunks that come back after
+// falling out of it go to a CLOCK-managed main queue. A one-off scan therefore only ever
+// displaces the FIFO, never the hot set.
+// Dirty frames are written back on eviction, on flush, and once too many are dirty or the
+// oldest has waited too long. Runs of adjacent dirty chunks go out in a single pwritev.
+// Runs of increasing chunk numbers are detected and the chunks ahead of them hinted to the
+// kernel (POSIX_FADV_WILLNEED), with a window that doubles as the run goes on.
+
+typedef struct block_cache block_cache_t;
+
+///
+/// Creates a cache over an open file
+/// \param fd File holding num_chunks chunks back to back, opened for reading and writing
+/// \param chunk_bytes Bytes per chunk
+/// \param num_chunks Chunks in the file
+/// \param num_frames Chunks the cache can hold at once (at least 2)
+/// \return New cache, NULL on error. The cache does not take ownership of fd.
+///
+block_cache_t *block_cache_create(const int fd, const size_t chunk_bytes, const size_t num_chunks, const size_t num_frames);
+
+///
+/// Writes back dirty frames and destroys the cache
+/// \param cache The cache
+/// \return false if some dirty frame couldn't be written back
+///
+bool block_cache_destroy(block_cache_t *cache);
+
+///
+/// Gets a chunk, reading it in (and evicting another) if it isn't cached
+///  The pointer is valid until the next block_cache_get
+/// \param cache The cache
+/// \param chunk The chunk
+/// \param dirty Whether the caller is about to modify the chunk
+/// \return The chunk's bytes, NULL on I/O error (including failing to write back other chunks)
+///
+uint8_t *block_cache_get(block_cache_t *const cache, const size_t chunk, const bool dirty);
+
+///
+/// Writes every dirty frame back to the file
+/// \param cache The cache
+/// \return false on I/O error
+///
+bool block_cache_flush(block_cache_t *const cache);
+
+///
+/// Sets the write-back thresholds, checked on each block_cache_get
+/// \param cache The cache
+/// \param max_dirty Flush once this many frames are dirty, 0 for half the frames
+/// \param max_age_ms Flush once a frame has been dirty this long, 0 for 1000
+///
+void block_cache_set_writeback(block_cache_t *const cache, const size_t max_dirty, const unsigned max_age_ms);
+
+///
+/// Counts cache misses since creation
+/// \param cache The cache
+/// \return Number of chunks read from the file
+///
+size_t block_cache_misses(const block_cache_t *const cache);
+
+///
+/// Counts chunks hinted for read-ahead since creation
+/// \param cache The cache
+/// \return Number of chunks passed to posix_fadvise(WILLNEED)
+///
+size_t block_cache_readahead(const block_cache_t *const cache);
+
+///
+/// Counts write-back calls since creation
+/// \param cache The cache
+/// \return Number of pwritev calls, each covering a run of adjacent chunks
+///
+size_t block_cache_writes(const block_cache_t *const cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -7,6 +7,7 @@ extern "C"
 #endif
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 	// Constants
@@ -18,18 +19,140 @@ extern "C"
 #define BITMAP_START_BLOCK 127
 #define BITMAP_NUM_BLOCKS (BITMAP_SIZE_BYTES / BLOCK_SIZE_BYTES)
 
+	// I/O flags for the _ex serialization routines
+#define BLOCK_STORE_IO_DIRECT 0x01        // Bypass the page cache (O_DIRECT) where the filesystem allows it
+
+	// Feature flags for block_store_create_ex
+#define BLOCK_STORE_OPT_DEDUP 0x01        // Store identical blocks once (no snapshots)
+#define BLOCK_STORE_OPT_NUMA 0x02        // Shard block data across NUMA nodes (no snapshots)
+#define BLOCK_STORE_OPT_HUGE_PAGES 0x04        // Back block data with huge pages where possible (no snapshots)
+#define BLOCK_STORE_OPT_SPARSE 0x08        // Allocate block data a chunk at a time, on first write
+#define BLOCK_STORE_OPT_BUDDY 0x10        // Allocate through a binary buddy system
+#define BLOCK_STORE_OPT_REFCOUNT 0x20        // Count owners of each block (see block_store_ref)
+#define BLOCK_STORE_OPT_REMAP 0x40        // Hand out logical ids, so blocks can be moved (see block_store_compact)
+
+	// Placement for block_store_allocate_extent
+#define BLOCK_STORE_FIT_FIRST 0        // Lowest-addressed free run that is long enough
+#define BLOCK_STORE_FIT_BEST 1        // Shortest free run that is long enough, to keep long runs whole
+
+	// Policies for block_store_allocate, see block_store_set_policy
+#define BLOCK_STORE_POLICY_FIRST_FIT 0        // Lowest free block (the default)
+#define BLOCK_STORE_POLICY_NEXT_FIT 1        // First free block after the last one allocated, wrapping around
+#define BLOCK_STORE_POLICY_BEST_FIT 2        // A block from the shortest free run
+#define BLOCK_STORE_POLICY_NEAR 3        // Free block closest to the last one allocated
+
+	// Page backing reported by block_store_get_page_backing, weakest first
+#define BLOCK_STORE_PAGES_SMALL 0        // Ordinary pages
+#define BLOCK_STORE_PAGES_TRANSPARENT 1        // Ordinary mapping advised for transparent huge pages
+#define BLOCK_STORE_PAGES_HUGETLB 2        // Explicit huge pages from the hugetlb pool
+
+	// Operations timed by block_store_get_stats, indexes into block_store_stats_t.ops
+#define BLOCK_STORE_STAT_ALLOCATE 0        // block_store_allocate, block_store_allocate_near
+#define BLOCK_STORE_STAT_REQUEST 1        // block_store_request
+#define BLOCK_STORE_STAT_RELEASE 2        // block_store_release, block_store_unref
+#define BLOCK_STORE_STAT_READ 3        // block_store_read
+#define BLOCK_STORE_STAT_WRITE 4        // block_store_write
+#define BLOCK_STORE_STAT_SERIALIZE 5        // block_store_serialize* (all formats)
+#define BLOCK_STORE_STAT_DESERIALIZE 6        // block_store_deserialize* (all formats), counted on the store loaded
+#define BLOCK_STORE_STAT_COUNT 7
+#define BLOCK_STORE_STATS_BUCKETS 32        // Latency buckets per operation, see block_store_op_stats_t
+#define BLOCK_STORE_RUN_BUCKETS 64        // Run-length buckets, see block_store_free_space_t
+
 	// Declaring the struct but not implementing in the header allows us to prevent users
 	//  from using the object directly and monkeying with the contents
 	// They can only create pointers to the struct, which must be given out by us
 	// This enforces a black box device, but it can be restricting
 	typedef struct block_store block_store_t;
 
+	// A batch of changes applied to a BS device all at once, see block_store_txn_begin
+	typedef struct block_store_txn block_store_txn_t;
+
+	// Options for block_store_create_ex, zero-initialize for the defaults
+	typedef struct block_store_options 
+	{
+		unsigned flags;        // BLOCK_STORE_OPT_* bits
+		size_t num_blocks;        // Blocks in the device, a multiple of 128; 0 for BLOCK_STORE_NUM_BLOCKS
+		const char *backing_file;        // Keep block data in this file instead of memory, NULL for none
+		size_t cache_chunks;        // Buffer cache size in 128-block chunks for backing_file, 0 for 64
+		size_t dirty_chunks;        // Write back once this many cached chunks are dirty, 0 for half the cache
+		unsigned dirty_ms;        // ... or once a chunk has been dirty this long, 0 for 1000 (both checked on the next access)
+		size_t numa_shards;        // Shards for BLOCK_STORE_OPT_NUMA, 0 for one per NUMA node
+		unsigned policy;        // BLOCK_STORE_POLICY_* for block_store_allocate, 0 for first-fit
+	} block_store_options_t;
+
+	// Counts and latencies of one operation, see block_store_get_stats
+	typedef struct block_store_op_stats
+	{
+		uint64_t count;        // Calls timed
+		uint64_t total_ns;        // Their summed latency, total_ns / count for the mean
+		uint64_t max_ns;        // Slowest call
+		uint64_t buckets[BLOCK_STORE_STATS_BUCKETS];        // [i]: calls taking [2^i, 2^(i+1)) ns; the last also takes longer ones
+	} block_store_op_stats_t;
+
+	typedef struct block_store_stats
+	{
+		block_store_op_stats_t ops[BLOCK_STORE_STAT_COUNT];        // Indexed by BLOCK_STORE_STAT_*
+	} block_store_stats_t;
+
+	// Layout of a device's free blocks, see block_store_get_free_space_info
+	typedef struct block_store_free_space
+	{
+		size_t free_blocks;        // Same as block_store_get_free_blocks
+		size_t largest_run;        // Longest run of consecutive free blocks, the biggest extent that can be allocated
+		size_t runs;        // Runs of free blocks, each as long as it can be
+		size_t runs_by_length[BLOCK_STORE_RUN_BUCKETS];        // [i]: runs of [2^i, 2^(i+1)) blocks
+		double fragmentation;        // 1 - largest_run / free_blocks: 0 when free space is one run (or none), near 1 when it's scattered
+	} block_store_free_space_t;
+
 	///
 	/// This creates a new BS device, ready to go
 	/// \return Pointer to a new block storage device, NULL on error
 	///
 	block_store_t *block_store_create();
 
+	///
+	/// This creates a new BS device with optional features
+	///  BLOCK_STORE_OPT_DEDUP: writes are hashed and identical blocks share one copy,
+	///   all-zero blocks take no memory; such devices can't be snapshotted
+	///  BLOCK_STORE_OPT_NUMA: block data is split into numa_shards contiguous ranges of whole chunks,
+	///   shard i placed on node i (modulo the nodes online) where the kernel allows it. Allocation
+	///   takes the first free block in the shards on the calling thread's node and only looks in
+	///   the others, nearest node first, once those are full. Can't be combined with dedup or
+	///   backing_file and can't be snapshotted
+	///  BLOCK_STORE_OPT_HUGE_PAGES: block data is mapped with 2 MiB MAP_HUGETLB pages, or if that pool
+	///   can't supply it, with ordinary pages advised MADV_HUGEPAGE (see block_store_get_page_backing).
+	///   Combines with BLOCK_STORE_OPT_NUMA; not with dedup or backing_file, and can't be snapshotted
+	///  BLOCK_STORE_OPT_SPARSE: for very large num_blocks. Only a directory of chunk pointers is
+	///   allocated up front; a chunk's data is allocated the first time one of its blocks is
+	///   written, and blocks in chunks never written read as zeros. Can't be combined with dedup,
+	///   NUMA, huge pages or backing_file
+	///  BLOCK_STORE_OPT_BUDDY: free space is also kept as aligned power-of-two blocks, one free list
+	///   per order, for block_store_allocate_order; block_store_allocate takes the smallest free block
+	///   and splits it. Can't be combined with NUMA or backing_file
+	///  BLOCK_STORE_OPT_REFCOUNT: each block keeps a 16-bit count of its owners next to the
+	///   allocation map. block_store_ref adds one, and a block only goes back to the free pool
+	///   when block_store_release or block_store_unref has dropped the last. Counts aren't saved
+	///   by serialization. Can't be combined with backing_file
+	///  BLOCK_STORE_OPT_REMAP: ids handed out are logical, mapped to the block their data sits in,
+	///   so block_store_compact can move the data without the caller noticing. A logical id only
+	///   has somewhere to keep data while it is allocated: until then, reads give zeros and writes
+	///   fail. Images hold blocks by logical id. Costs two size_t per block; can't be combined
+	///   with dedup, NUMA, buddy or backing_file
+	///  num_blocks: larger devices reserve more blocks for the allocation map, starting at BITMAP_START_BLOCK
+	///  backing_file: block data lives in the file and only cache_chunks chunks are held in memory.
+	///   A new or empty file is sized for num_blocks; an existing one is reopened with its contents
+	///   and allocation map (num_blocks 0 takes the size from the file). Can't be combined with dedup
+	///   and can't be snapshotted
+	///   Written chunks stay in the cache until dirty_chunks or dirty_ms is reached, block_store_flush
+	///   is called or the chunk is evicted, and adjacent ones are then written together. There is
+	///   no background thread: both thresholds are only checked on the next read or write that goes
+	///   to the cache, so a device left idle keeps its dirty chunks in memory however old they get.
+	///   Call block_store_flush to get them to the file
+	/// \param options Creation options, NULL for the same device block_store_create makes
+	/// \return Pointer to a new block storage device, NULL on error
+	///
+	block_store_t *block_store_create_ex(const block_store_options_t *const options);
+
 	///
 	/// Destroys the provided block storage device
 	/// This is an idempotent operation, so there is no return value
@@ -44,6 +167,58 @@ extern "C"
 	///
 	size_t block_store_allocate(block_store_t *const bs);
 
+	///
+	/// Allocates the free block closest to hint_id, looking outward on both sides
+	///  Keeps blocks that are used together close together, whatever the device's policy.
+	///  Only distance counts: on BLOCK_STORE_OPT_NUMA devices the block comes from the shard
+	///  nearest the hint, not the caller's, and on BLOCK_STORE_OPT_BUDDY devices it is split
+	///  out of whichever buddy block holds it rather than allocated by order
+	/// \param bs BS device
+	/// \param hint_id Block to allocate near, e.g. the previous block of the same object
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_allocate_near(block_store_t *const bs, const size_t hint_id);
+
+	///
+	/// Changes the policy block_store_allocate uses to pick a block
+	///  Has no effect on NUMA and buddy devices, which have placement rules of their own
+	/// \param bs BS device
+	/// \param policy BLOCK_STORE_POLICY_*
+	/// \return false on error or for an unknown policy
+	///
+	bool block_store_set_policy(block_store_t *const bs, const unsigned policy);
+
+	///
+	/// Allocates count consecutive blocks, never spanning the reserved range
+	///  Free runs are tracked in an index kept next to the allocation map, so finding one is
+	///  O(log n) in the number of runs rather than a scan of the map
+	///  Release the blocks one at a time with block_store_release
+	/// \param bs BS device
+	/// \param count Blocks wanted
+	/// \param fit BLOCK_STORE_FIT_FIRST or BLOCK_STORE_FIT_BEST
+	/// \return Id of the first block, SIZE_MAX on error or if no free run is long enough
+	///
+	size_t block_store_allocate_extent(block_store_t *const bs, const size_t count, const unsigned fit);
+
+	///
+	/// Allocates 2^order consecutive blocks starting at a multiple of 2^order, splitting a larger
+	///  free block if need be; O(log n)
+	/// \param bs BS device, created with BLOCK_STORE_OPT_BUDDY
+	/// \param order log2 of the number of blocks wanted
+	/// \return Id of the first block, SIZE_MAX on error, if there's no room or if bs isn't a buddy device
+	///
+	size_t block_store_allocate_order(block_store_t *const bs, const unsigned order);
+
+	///
+	/// Frees 2^order consecutive blocks starting at block_id, as allocated by block_store_allocate_order
+	///  On a buddy device the run merges with free neighbours in O(log n); elsewhere, or if part of
+	///  the run is already free, this is the same as releasing each block
+	/// \param bs BS device
+	/// \param block_id First block, a multiple of 2^order
+	/// \param order log2 of the number of blocks
+	///
+	void block_store_release_order(block_store_t *const bs, const size_t block_id, const unsigned order);
+
 	///
 	/// Attempts to allocate the requested block id
 	/// \param bs the block store object
@@ -54,11 +229,60 @@ extern "C"
 
 	///
 	/// Frees the specified block
+	///  On a BLOCK_STORE_OPT_REFCOUNT device this drops one owner and frees the block with the last
 	/// \param bs BS device
 	/// \param block_id The block to free
 	///
 	void block_store_release(block_store_t *const bs, const size_t block_id);
 
+	///
+	/// Adds an owner to a block in use, e.g. when a new version of an object shares it
+	///  The block then takes one more block_store_release or block_store_unref to free
+	/// \param bs BS device, created with BLOCK_STORE_OPT_REFCOUNT
+	/// \param block_id The block to share
+	/// \return false on error, if the block is free or if it already has 65536 owners
+	///
+	bool block_store_ref(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Drops an owner of a block, freeing the block with the last one
+	///  Same as block_store_release, but tells the caller whether the block is still in use
+	/// \param bs BS device
+	/// \param block_id The block to let go of
+	/// \return Owners left, 0 once the block is free, SIZE_MAX on error or if it was already free
+	///
+	size_t block_store_unref(block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Counts the owners of a block
+	/// \param bs BS device
+	/// \param block_id The block
+	/// \return Owners, 1 for any block in use on a device without refcounts, 0 if the block is free,
+	///  SIZE_MAX on error
+	///
+	size_t block_store_get_refs(const block_store_t *const bs, const size_t block_id);
+
+	///
+	/// Moves blocks in use towards the start of the device, a bounded number per call, until they
+	///  form a dense prefix and the free space is one long run (apart from the reserved range)
+	///  Logical ids stay the same. Each move takes the highest block in use down to the lowest free
+	///  block; a sparse device also gives back the chunks this empties. Call it between other work
+	///  until it returns 0
+	/// \param bs BS device, created with BLOCK_STORE_OPT_REMAP
+	/// \param max_moves Most blocks to move in this call (the device is locked while it runs)
+	/// \return Blocks moved, 0 once the device is compact or on error
+	///
+	size_t block_store_compact(block_store_t *const bs, const size_t max_moves);
+
+	///
+	/// Finds where a block's data is, e.g. to check how compaction laid a device out
+	/// \param bs BS device
+	/// \param block_id The block, by the id it was allocated as
+	/// \return Position of its data, block_id on a device without BLOCK_STORE_OPT_REMAP,
+	///  SIZE_MAX on error or if a remapped block_id isn't allocated
+	///
+	size_t block_store_locate(const block_store_t *const bs, const size_t block_id);
+
 	///
 	/// Counts the number of blocks marked as in use
 	/// \param bs BS device
@@ -73,6 +297,17 @@ extern "C"
 	///
 	size_t block_store_get_free_blocks(const block_store_t *const bs);
 
+	///
+	/// Describes how the free blocks are laid out: how many runs they form, how long those are,
+	///  and how far the longest falls short of the total. For deciding when to compact and for
+	///  warning before block_store_allocate_extent starts failing. Runs are of blocks, not
+	///  logical ids, on BLOCK_STORE_OPT_REMAP devices; the reserved range breaks runs
+	/// \param bs BS device
+	/// \param out Filled in with the description
+	/// \return false on error
+	///
+	bool block_store_get_free_space_info(const block_store_t *const bs, block_store_free_space_t *const out);
+
 	///
 	/// Returns the total number of user-addressable blocks
 	///  (since this is constant, you don't even need the bs object)
@@ -80,6 +315,44 @@ extern "C"
 	///
 	size_t block_store_get_total_blocks();
 
+	///
+	/// Returns the number of blocks in a particular BS device
+	/// \param bs BS device
+	/// \return Total blocks, which differs from block_store_get_total_blocks only for a
+	///  device created with num_blocks, SIZE_MAX on error
+	///
+	size_t block_store_get_block_count(const block_store_t *const bs);
+
+	///
+	/// Counts the blocks of memory actually holding data
+	/// \param bs BS device
+	/// \return Distinct non-zero blocks for dedup devices, blocks in chunks written so far for
+	///  sparse devices, total blocks otherwise, SIZE_MAX on error
+	///
+	size_t block_store_get_physical_blocks(const block_store_t *const bs);
+
+	///
+	/// Turns timing of the operations listed by BLOCK_STORE_STAT_* on or off, for every device
+	///  Off by default; while off, an operation pays a single relaxed atomic load for it
+	/// \param enabled true to record
+	///
+	void block_store_set_stats_enabled(const bool enabled);
+
+	///
+	/// Copies out the counts and latency histograms recorded for a device since it was created
+	///  or last reset. Safe to call while other threads use the device
+	/// \param bs BS device
+	/// \param out Filled in with one entry per BLOCK_STORE_STAT_*
+	/// \return false on error
+	///
+	bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const out);
+
+	///
+	/// Zeroes the statistics recorded for a device
+	/// \param bs BS device
+	///
+	void block_store_reset_stats(block_store_t *const bs);
+
 	///
 	/// Reads data from the specified block and writes it to the designated buffer
 	/// \param bs BS device
@@ -113,6 +386,152 @@ extern "C"
 	///
 	size_t block_store_serialize(const block_store_t *const bs, const char *const filename);
 
+	///
+	/// Imports BS device from the given file, as block_store_deserialize
+	/// \param filename The file to load
+	/// \param io_flags BLOCK_STORE_IO_* flags, BLOCK_STORE_IO_DIRECT reads through aligned buffers with O_DIRECT
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_ex(const char *const filename, const unsigned io_flags);
+
+	///
+	/// Writes the entirety of the BS device to file, as block_store_serialize
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \param io_flags BLOCK_STORE_IO_* flags, BLOCK_STORE_IO_DIRECT writes through aligned buffers with O_DIRECT
+	/// \return Number of bytes written, 0 on error
+	///
+	size_t block_store_serialize_ex(const block_store_t *const bs, const char *const filename, const unsigned io_flags);
+
+	///
+	/// Writes the BS device to a compressed image, overwriting the file if it exists
+	///  Free and all-zero blocks are run-length encoded, the rest is LZ compressed per chunk
+	///  Contents of free blocks are not preserved
+	/// \param bs BS device
+	/// \param filename The file to write to
+	/// \return Size of the image in bytes, 0 on error
+	///
+	size_t block_store_serialize_compressed(const block_store_t *const bs, const char *const filename);
+
+	///
+	/// Imports BS device from a compressed image, decoding it one chunk at a time
+	/// \param filename The file written by block_store_serialize_compressed
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_compressed(const char *const filename);
+
+	///
+	/// Opens a compressed image lazily: only the header and allocation map are read up front,
+	///  each chunk of blocks is loaded, and its memory allocated, on its first read or write
+	///  The image file is kept open until the BS device is destroyed
+	/// \param filename The file written by block_store_serialize_compressed
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_open_lazy(const char *const filename);
+
+	///
+	/// Reports the pages a BS device's block data actually got
+	///  Only BLOCK_STORE_OPT_HUGE_PAGES devices get anything other than BLOCK_STORE_PAGES_SMALL
+	/// \param bs BS device
+	/// \return The weakest BLOCK_STORE_PAGES_* backing over the device's data
+	///
+	unsigned block_store_get_page_backing(const block_store_t *const bs);
+
+	///
+	/// Writes the BS device as a raw image striped over several files, RAID-0 style
+	///  Stripes of stripe_blocks blocks go to the files in turn: stripe s is in file s % file_count.
+	///  Each file is written by its own thread, so throughput scales with the files' devices
+	/// \param bs BS device
+	/// \param filenames The files to write to, overwritten if they exist
+	/// \param file_count Number of files, at least 1
+	/// \param stripe_blocks Blocks per stripe, a multiple of 128; 0 for 128
+	/// \return Number of bytes written over all files, 0 on error
+	///
+	size_t block_store_serialize_striped(const block_store_t *const bs, const char *const *filenames, const size_t file_count, const size_t stripe_blocks);
+
+	///
+	/// Imports BS device from a striped image, reading every file in parallel
+	/// \param filenames The files written by block_store_serialize_striped, in the same order
+	/// \param file_count Number of files
+	/// \param stripe_blocks The stripe size the image was written with
+	/// \return Pointer to new BS device, NULL on error
+	///
+	block_store_t *block_store_deserialize_striped(const char *const *filenames, const size_t file_count, const size_t stripe_blocks);
+
+	///
+	/// Takes a read-only point-in-time snapshot that shares block storage with the BS device
+	///  Storage is copied a chunk at a time, only when the device writes to it after the snapshot
+	///  The snapshot can be read (and serialized) like any other device; writes, allocations
+	///  and releases on it fail
+	///  Like the other calls on a BS device, this is safe to call while other threads use bs
+	/// \param bs BS device
+	/// \return Pointer to the snapshot, NULL on error
+	///
+	block_store_t *block_store_snapshot(block_store_t *const bs);
+
+	///
+	/// Releases a snapshot, does nothing if given a regular BS device
+	/// \param snapshot The snapshot
+	///
+	void block_store_snapshot_release(block_store_t *const snapshot);
+
+	///
+	/// Writes cached blocks and the allocation map of a file-backed BS device back to its file
+	///  Destroying the device flushes it as well
+	/// \param bs BS device
+	/// \return false on I/O error, true otherwise (always for devices without a backing file)
+	///
+	bool block_store_flush(block_store_t *const bs);
+
+	///
+	/// Starts a transaction: allocations, releases and writes collected and applied together
+	///  Every call on a BS device takes its lock; a transaction's commit takes it once for the
+	///  whole batch, so other threads never see part of it
+	/// \param bs BS device
+	/// \return The transaction, NULL on error
+	///
+	block_store_txn_t *block_store_txn_begin(block_store_t *const bs);
+
+	///
+	/// Claims a free block for the transaction
+	///  The block is marked in use right away so its id can be written to; abort frees it again
+	/// \param txn The transaction
+	/// \return Allocated block's id, SIZE_MAX on error
+	///
+	size_t block_store_txn_allocate(block_store_txn_t *const txn);
+
+	///
+	/// Queues a block to be freed on commit
+	/// \param txn The transaction
+	/// \param block_id The block to free, which must still be in use at commit
+	/// \return false on error, or if the block is already queued
+	///
+	bool block_store_txn_release(block_store_txn_t *const txn, const size_t block_id);
+
+	///
+	/// Queues a write, copying the buffer now
+	/// \param txn The transaction
+	/// \param block_id Destination block id
+	/// \param buffer Data buffer to read from
+	/// \return Number of bytes queued, 0 on error
+	///
+	size_t block_store_txn_write(block_store_txn_t *const txn, const size_t block_id, const void *buffer);
+
+	///
+	/// Checks and applies the transaction: the writes in order, then the releases
+	///  A transaction that fails the checks, or whose writes fail partway (out of memory, I/O
+	///  error), is undone and aborted. The transaction is freed either way
+	/// \param txn The transaction
+	/// \return true if every change was applied
+	///
+	bool block_store_txn_commit(block_store_txn_t *const txn);
+
+	///
+	/// Drops the transaction, freeing the blocks it allocated
+	/// \param txn The transaction, freed by this call
+	///
+	void block_store_txn_abort(block_store_txn_t *const txn);
+
 #ifdef __cplusplus
 }
 #endif
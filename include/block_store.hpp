@@ -0,0 +1,285 @@
+#ifndef BLOCK_STORE_HPP__
+#define BLOCK_STORE_HPP__
+
+// C++20 coroutine front end for the block store.
+// Store::read/write/allocate return awaitables: the calling coroutine is suspended, the
+// synchronous call runs on a ThreadPool worker, and the coroutine resumes on that worker with
+// the call's result. Results are exactly what the C functions return (byte counts, SIZE_MAX
+// on a failed allocation); nothing here throws on a failed operation.
+
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "block_store.h"
+
+namespace blockstore
+{
+
+// Fixed set of threads running posted jobs in FIFO order. The destructor finishes every job
+// already posted, including coroutines they resume, before joining.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(std::size_t threads = std::thread::hardware_concurrency())
+    {
+        if (threads == 0) threads = 1;
+        for (std::size_t i = 0; i < threads; ++i) workers_.emplace_back([this] { run(); });
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            stopping_ = true;
+        }
+        ready_.notify_all();
+        for (std::thread &worker : workers_) worker.join();
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    void post(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            jobs_.push_back(std::move(job));
+        }
+        ready_.notify_one();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        for (;;) {
+            ready_.wait(guard, [this] { return stopping_ || !jobs_.empty(); });
+            if (jobs_.empty()) return;
+            std::function<void()> job = std::move(jobs_.front());
+            jobs_.pop_front();
+            guard.unlock();
+            job();
+            guard.lock();
+        }
+    }
+
+    std::mutex lock_;
+    std::condition_variable ready_;
+    std::deque<std::function<void()>> jobs_;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+};
+
+template <typename T = void>
+class Task;
+
+namespace detail
+{
+
+struct PromiseBase
+{
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+    std::exception_ptr error;
+
+    // A finished task hands the thread straight to whoever awaited it
+    struct FinalAwaiter
+    {
+        bool await_ready() const noexcept { return false; }
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> done) noexcept
+        {
+            return done.promise().continuation;
+        }
+        void await_resume() const noexcept {}
+    };
+
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    FinalAwaiter final_suspend() const noexcept { return {}; }
+    void unhandled_exception() noexcept { error = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase
+{
+    std::optional<T> value;
+
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+    T take()
+    {
+        if (error) std::rethrow_exception(error);
+        return std::move(*value);
+    }
+};
+
+template <>
+struct Promise<void> : PromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() const noexcept {}
+    void take() const
+    {
+        if (error) std::rethrow_exception(error);
+    }
+};
+
+// Runs a synchronous call on the pool, then resumes the awaiting coroutine there
+template <typename F>
+class Offload
+{
+public:
+    Offload(ThreadPool &pool, F call) : pool_(pool), call_(std::move(call)) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> waiting)
+    {
+        pool_.post([this, waiting] {
+            result_ = call_();
+            waiting.resume();
+        });
+    }
+    std::size_t await_resume() const noexcept { return result_; }
+
+private:
+    ThreadPool &pool_;
+    F call_;
+    std::size_t result_ = 0;
+};
+
+// Fire-and-forget coroutine, used to drive a task from sync_wait
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() const noexcept { return {}; }
+        std::suspend_never initial_suspend() const noexcept { return {}; }
+        std::suspend_never final_suspend() const noexcept { return {}; }
+        void return_void() const noexcept {}
+        void unhandled_exception() const noexcept { std::terminate(); }
+    };
+};
+
+}  // namespace detail
+
+// Lazily started coroutine: nothing runs until it is co_awaited (or passed to sync_wait)
+template <typename T>
+class [[nodiscard]] Task
+{
+public:
+    using promise_type = detail::Promise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task &operator=(Task &&other) noexcept
+    {
+        if (this != &other) {
+            if (handle_) handle_.destroy();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        if (handle_) handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiting) noexcept
+    {
+        handle_.promise().continuation = waiting;
+        return handle_;
+    }
+    T await_resume() { return handle_.promise().take(); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// Runs a task to completion, blocking the calling thread (which must not be a pool worker)
+template <typename T>
+T sync_wait(Task<T> task)
+{
+    // Starts the task without taking its result, which stays in the promise for below
+    struct Start
+    {
+        Task<T> &started;
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiting) noexcept { return started.await_suspend(waiting); }
+        void await_resume() const noexcept {}
+    };
+
+    std::mutex lock;
+    std::condition_variable finished;
+    bool done = false;
+    auto drive = [](Task<T> &inner, std::mutex &m, std::condition_variable &cv, bool &flag) -> detail::Detached {
+        co_await Start{inner};
+        std::lock_guard<std::mutex> guard(m);
+        flag = true;
+        cv.notify_one();
+    };
+    drive(task, lock, finished, done);
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        finished.wait(guard, [&done] { return done; });
+    }
+    return task.await_resume();
+}
+
+// Coroutine view of a BS device. Does not own the device; every call on it is thread-safe,
+// so any number of coroutines can have operations in flight at once.
+class Store
+{
+public:
+    Store(block_store_t *bs, ThreadPool &pool) : bs_(bs), pool_(pool) {}
+
+    block_store_t *get() const noexcept { return bs_; }
+
+    /// Awaits block_store_read; buffer must stay valid until the coroutine resumes
+    auto read(std::size_t block_id, void *buffer)
+    {
+        block_store_t *bs = bs_;
+        return detail::Offload(pool_, [bs, block_id, buffer] { return block_store_read(bs, block_id, buffer); });
+    }
+
+    /// Awaits block_store_write; buffer must stay valid until the coroutine resumes
+    auto write(std::size_t block_id, const void *buffer)
+    {
+        block_store_t *bs = bs_;
+        return detail::Offload(pool_, [bs, block_id, buffer] { return block_store_write(bs, block_id, buffer); });
+    }
+
+    /// Awaits block_store_allocate
+    auto allocate()
+    {
+        block_store_t *bs = bs_;
+        return detail::Offload(pool_, [bs] { return block_store_allocate(bs); });
+    }
+
+private:
+    block_store_t *bs_;
+    ThreadPool &pool_;
+};
+
+}  // namespace blockstore
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef BLOCK_STORE_FIXED_HPP__
+#define BLOCK_STORE_FIXED_HPP__
+
+// Header-only block store with its geometry fixed at compile time.
+// Mirrors the C API call for call (same return values, same reserved range, same raw image
+// format) but everything is inline: ids become offsets with a shift, bounds checks compare
+// against constants, and the allocation bitmap is a std::array the compiler can unroll for
+// small stores. Like the C store without its lock, an instance is not thread-safe.
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#include "block_store.h"
+
+namespace blockstore
+{
+
+template <std::size_t NumBlocks = BLOCK_STORE_NUM_BLOCKS, std::size_t BlockSize = BLOCK_SIZE_BYTES>
+class BlockStore
+{
+    static_assert(NumBlocks % 64 == 0, "the bitmap is whole 64-bit words");
+    static_assert(std::has_single_bit(BlockSize), "block ids map to offsets with a shift");
+
+    static constexpr std::size_t kWords = NumBlocks / 64;
+    static constexpr unsigned kShift = std::countr_zero(BlockSize);
+
+    // Blocks set aside for the allocation map, as in the C store
+    static constexpr std::size_t kReservedFirst = BITMAP_START_BLOCK;
+    static constexpr std::size_t kReservedEnd = kReservedFirst + ((NumBlocks + 7) / 8 + BlockSize - 1) / BlockSize;
+    static_assert(NumBlocks > kReservedEnd, "room for the reserved range");
+
+    // Bits of each word that allocate() must skip, worked out once at compile time
+    static constexpr std::array<std::uint64_t, kWords> make_reserved_masks()
+    {
+        std::array<std::uint64_t, kWords> masks{};
+        for (std::size_t id = kReservedFirst; id < kReservedEnd; ++id) masks[id / 64] |= std::uint64_t(1) << (id % 64);
+        return masks;
+    }
+    static constexpr std::array<std::uint64_t, kWords> kReservedMasks = make_reserved_masks();
+
+public:
+    static constexpr std::size_t total_blocks() noexcept { return NumBlocks; }
+    static constexpr std::size_t block_size() noexcept { return BlockSize; }
+    static constexpr std::size_t num_bytes() noexcept { return NumBlocks * BlockSize; }
+
+    /// Searches for a free block, marks it as in use, and returns the block's id
+    /// \return Allocated block's id, SIZE_MAX if the store is full
+    std::size_t allocate() noexcept
+    {
+        for (std::size_t w = 0; w < kWords; ++w) {
+            std::uint64_t taken = bits_[w] | kReservedMasks[w];
+            if (~taken != 0) {
+                unsigned bit = std::countr_zero(~taken);
+                bits_[w] |= std::uint64_t(1) << bit;
+                return w * 64 + bit;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    /// Attempts to allocate the requested block id
+    /// \return false if it is out of range or already in use
+    bool request(std::size_t block_id) noexcept
+    {
+        if (block_id >= NumBlocks || test(block_id)) return false;
+        bits_[block_id / 64] |= bit(block_id);
+        return true;
+    }
+
+    /// Frees the specified block
+    void release(std::size_t block_id) noexcept
+    {
+        if (block_id < NumBlocks) bits_[block_id / 64] &= ~bit(block_id);
+    }
+
+    /// Counts the blocks in use, the reserved range included
+    std::size_t used_blocks() const noexcept
+    {
+        std::size_t used = kReservedEnd - kReservedFirst;
+        for (std::uint64_t word : bits_) used += std::popcount(word);
+        return used;
+    }
+
+    std::size_t free_blocks() const noexcept { return NumBlocks - used_blocks(); }
+
+    /// Copies a block into buffer
+    /// \return Number of bytes read, 0 on error
+    std::size_t read(std::size_t block_id, void *buffer) const noexcept
+    {
+        if (block_id >= NumBlocks || buffer == nullptr) return 0;
+        std::memcpy(buffer, data_.data() + (block_id << kShift), BlockSize);
+        return BlockSize;
+    }
+
+    /// Copies buffer into a block
+    /// \return Number of bytes written, 0 on error
+    std::size_t write(std::size_t block_id, const void *buffer) noexcept
+    {
+        if (block_id >= NumBlocks || buffer == nullptr) return 0;
+        std::memcpy(data_.data() + (block_id << kShift), buffer, BlockSize);
+        return BlockSize;
+    }
+
+    /// Writes the raw image, the same format block_store_serialize writes
+    /// \return Number of bytes written, 0 on error
+    std::size_t serialize(const char *filename) const
+    {
+        std::FILE *file = filename != nullptr ? std::fopen(filename, "wb") : nullptr;
+        if (file == nullptr) return 0;
+        bool ok = std::fwrite(data_.data(), 1, data_.size(), file) == data_.size();
+        ok = std::fclose(file) == 0 && ok;
+        return ok ? data_.size() : 0;
+    }
+
+    /// Loads a raw image, marking non-zero blocks in use as block_store_deserialize does
+    /// \return false if the file couldn't be read in full
+    bool deserialize(const char *filename)
+    {
+        std::FILE *file = filename != nullptr ? std::fopen(filename, "rb") : nullptr;
+        if (file == nullptr) return false;
+        bool ok = std::fread(data_.data(), 1, data_.size(), file) == data_.size();
+        std::fclose(file);
+
+        bits_.fill(0);
+        for (std::size_t id = 0; ok && id < NumBlocks; ++id) {
+            const std::uint8_t *block = data_.data() + (id << kShift);
+            for (std::size_t i = 0; i < BlockSize; ++i) {
+                if (block[i] != 0) {
+                    bits_[id / 64] |= bit(id);
+                    break;
+                }
+            }
+        }
+        return ok;
+    }
+
+private:
+    static constexpr std::uint64_t bit(std::size_t block_id) noexcept { return std::uint64_t(1) << (block_id % 64); }
+    bool test(std::size_t block_id) const noexcept { return (bits_[block_id / 64] & bit(block_id)) != 0; }
+
+    std::array<std::uint64_t, kWords> bits_{};
+    alignas(64) std::array<std::uint8_t, NumBlocks * BlockSize> data_{};
+};
+
+}  // namespace blockstore
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef BLOCK_STORE_QUEUE_H__
+#define BLOCK_STORE_QUEUE_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "block_store.h"
+
+// Asynchronous requests against a block store, in the style of io_uring: requests are pushed
+// onto a submission ring, a pool of worker threads runs them with the normal block_store calls,
+// and results come back on a completion ring, in whatever order they finish.
+// One thread submits and reaps; the queue is not meant to be shared between producers.
+
+typedef enum block_store_op
+{
+    BLOCK_STORE_OP_READ,        // Reads block_id into buffer
+    BLOCK_STORE_OP_WRITE,       // Writes buffer to block_id
+    BLOCK_STORE_OP_ALLOCATE,    // Allocates a block, result is its id
+    BLOCK_STORE_OP_RELEASE,     // Releases block_id
+} block_store_op_t;
+
+// Submission queue entry. buffer must stay valid until the request's completion is reaped.
+typedef struct block_store_sqe
+{
+    block_store_op_t op;
+    size_t block_id;
+    void *buffer;
+    uint64_t user_data;     // Passed through to the completion
+} block_store_sqe_t;
+
+// Completion queue entry. result is what the synchronous call would have returned:
+// bytes for read and write, the block id (SIZE_MAX on error) for allocate, 0 for release.
+typedef struct block_store_cqe
+{
+    uint64_t user_data;
+    size_t result;
+} block_store_cqe_t;
+
+typedef struct block_store_queue block_store_queue_t;
+
+///
+/// Creates a queue and starts its workers
+/// \param bs The block store the requests run against; must outlive the queue
+/// \param entries Requests that can be in flight (submitted but not reaped) at once
+/// \param workers Worker threads, at least 1
+/// \return New queue, NULL on error
+///
+block_store_queue_t *block_store_queue_create(block_store_t *const bs, const size_t entries, const size_t workers);
+
+///
+/// Waits for submitted requests to finish, stops the workers and destroys the queue
+///  Completions that were never reaped are dropped
+/// \param queue The queue
+///
+void block_store_queue_destroy(block_store_queue_t *queue);
+
+///
+/// Submits a batch of requests, waking the workers once for the whole batch
+/// \param queue The queue
+/// \param sqes Requests to submit
+/// \param count Number of requests
+/// \return Number of requests submitted, fewer than count once entries requests are in flight
+///
+size_t block_store_queue_submit(block_store_queue_t *const queue, const block_store_sqe_t *const sqes, const size_t count);
+
+///
+/// Takes completed requests off the completion ring
+/// \param queue The queue
+/// \param cqes Where to store the completions
+/// \param max Room in cqes
+/// \param wait_for Block until at least this many completions are available (capped at the
+///  number in flight), 0 to return straight away
+/// \return Number of completions stored
+///
+size_t block_store_queue_reap(block_store_queue_t *const queue, block_store_cqe_t *const cqes, const size_t max, const size_t wait_for);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef BUDDY_H__
+#define BUDDY_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Binary buddy allocator over ids [0, n_ids): free space is held as blocks of 2^k ids aligned
+// to 2^k, one free list per order. Allocation splits a larger block as needed and freeing
+// merges a block with its buddy for as long as the buddy is free, both in O(log n).
+// Starts with nothing free; ids out of range are the caller's problem.
+
+typedef struct buddy buddy_t;
+
+///
+/// Creates a buddy allocator with every id in use
+/// \param n_ids Number of ids managed
+/// \return New allocator, NULL on error
+///
+buddy_t *buddy_create(const size_t n_ids);
+
+///
+/// Destructs and destroys the allocator
+/// \param buddy The allocator
+///
+void buddy_destroy(buddy_t *buddy);
+
+///
+/// Highest order a block can have
+/// \param buddy The allocator
+/// \return floor(log2(n_ids))
+///
+unsigned buddy_max_order(const buddy_t *const buddy);
+
+///
+/// Takes a free block of 2^order ids
+/// \param buddy The allocator
+/// \param order log2 of the ids wanted
+/// \return First id of the block (a multiple of 2^order), SIZE_MAX if there is no room
+///
+size_t buddy_allocate(buddy_t *const buddy, const unsigned order);
+
+///
+/// Returns a block of 2^order ids, merging it with its buddy where possible
+/// \param buddy The allocator
+/// \param id First id of the block, a multiple of 2^order, all of it in use
+/// \param order log2 of the block's size
+///
+void buddy_free(buddy_t *const buddy, const size_t id, const unsigned order);
+
+///
+/// Marks a range free, split into the largest aligned blocks that fit
+/// \param buddy The allocator
+/// \param start First id of the range, all of it in use
+/// \param count Ids in the range
+///
+void buddy_free_range(buddy_t *const buddy, const size_t start, const size_t count);
+
+///
+/// Takes one particular id out of whatever free block holds it, splitting that block
+/// \param buddy The allocator
+/// \param id The id
+/// \return false if the id wasn't free
+///
+bool buddy_take(buddy_t *const buddy, const size_t id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
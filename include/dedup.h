@@ -0,0 +1,63 @@
+#ifndef DEDUP_H__
+#define DEDUP_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Content-addressed block storage: logical blocks with identical contents share one
+// physical copy. All-zero blocks take no storage at all.
+// Like bitmap, ids out of range are the caller's problem.
+
+typedef struct dedup dedup_t;
+
+///
+/// Creates a dedup store of n_blocks logical blocks, all zero
+/// \param n_blocks Number of logical blocks
+/// \param block_size Bytes per block, a multiple of 8
+/// \return New dedup store, NULL on error
+///
+dedup_t *dedup_create(const size_t n_blocks, const size_t block_size);
+
+///
+/// Destructs and destroys the dedup store
+/// \param dedup The dedup store
+///
+void dedup_destroy(dedup_t *dedup);
+
+///
+/// Gets the contents of a logical block
+///  The pointer is valid until the next dedup_write
+/// \param dedup The dedup store
+/// \param block The logical block
+/// \return Pointer to block_size bytes
+///
+const uint8_t *dedup_read(const dedup_t *const dedup, const size_t block);
+
+///
+/// Replaces the contents of a logical block
+/// \param dedup The dedup store
+/// \param block The logical block
+/// \param data block_size bytes to store
+/// \return false if storage for a new physical block couldn't be allocated
+///
+bool dedup_write(dedup_t *const dedup, const size_t block, const void *const data);
+
+///
+/// Counts the distinct physical blocks currently holding data
+/// \param dedup The dedup store
+/// \return Number of physical blocks in use
+///
+size_t dedup_physical_blocks(const dedup_t *const dedup);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef EXTENT_INDEX_H__
+#define EXTENT_INDEX_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Index of free extents (runs of free ids), kept in two balanced trees: one ordered by start
+// for merging and first-fit, one ordered by length for best-fit. Every operation is O(log n)
+// in the number of extents. Adjacent free ranges are always merged into one extent.
+// The index only knows what it is told: keeping it in step with the real allocation state
+// is the caller's job.
+
+typedef struct extent_index extent_index_t;
+
+///
+/// Creates an empty index (nothing free)
+/// \return New index, NULL on error
+///
+extent_index_t *extent_index_create(void);
+
+///
+/// Destructs and destroys the index
+/// \param index The index
+///
+void extent_index_destroy(extent_index_t *index);
+
+///
+/// Marks a range free, merging it with free neighbours
+///  Ids in the range that are already free are the caller's problem
+/// \param index The index
+/// \param start First id of the range
+/// \param length Ids in the range, at least 1
+/// \return false if memory for a new extent couldn't be allocated (the index is unchanged)
+///
+bool extent_index_insert(extent_index_t *const index, const size_t start, const size_t length);
+
+///
+/// Marks a range in use, splitting the free extent that holds it
+///  A range that isn't wholly inside one free extent is ignored
+/// \param index The index
+/// \param start First id of the range
+/// \param length Ids in the range, at least 1
+/// \return false if memory for a new extent couldn't be allocated (the index is unchanged)
+///
+bool extent_index_remove(extent_index_t *const index, const size_t start, const size_t length);
+
+///
+/// Finds the lowest-addressed free extent at least length long
+/// \param index The index
+/// \param length Ids wanted
+/// \return Start of the extent, SIZE_MAX if there isn't one
+///
+size_t extent_index_first_fit(const extent_index_t *const index, const size_t length);
+
+///
+/// Finds the shortest free extent at least length long, the lowest-addressed of equals
+/// \param index The index
+/// \param length Ids wanted
+/// \return Start of the extent, SIZE_MAX if there isn't one
+///
+size_t extent_index_best_fit(const extent_index_t *const index, const size_t length);
+
+///
+/// Finds the lowest free id at or after from
+/// \param index The index
+/// \param from Where to start looking
+/// \return The id, SIZE_MAX if there isn't one
+///
+size_t extent_index_next_free(const extent_index_t *const index, const size_t from);
+
+///
+/// Finds the highest free id at or before from
+/// \param index The index
+/// \param from Where to start looking
+/// \return The id, SIZE_MAX if there isn't one
+///
+size_t extent_index_prev_free(const extent_index_t *const index, const size_t from);
+
+///
+/// Counts the free extents
+/// \param index The index
+/// \return Number of extents
+///
+size_t extent_index_count(const extent_index_t *const index);
+
+///
+/// Length of the longest free extent
+/// \param index The index
+/// \return Ids in the longest extent, 0 if nothing is free
+///
+size_t extent_index_largest(const extent_index_t *const index);
+
+///
+/// Calls a function on every free extent, lowest-addressed first
+///  func gets the extent's start, its length and arg; it mustn't change the index
+/// \param index The index
+/// \param func Function to call
+/// \param arg Extra argument passed to func
+///
+void extent_index_for_each(const extent_index_t *const index, void (*func)(size_t, size_t, void *), void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef LZ_H__
+#define LZ_H__
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Small LZ77 codec used for block store snapshots.
+// Byte-oriented (LZ4-style sequences), no entropy stage, no external dependencies.
+// Each call is independent: there is no dictionary carried between buffers.
+
+///
+/// Worst case compressed size for an input of n bytes
+/// \param n Input size in bytes
+/// \return Buffer size that is always large enough for lz_compress
+///
+size_t lz_compress_bound(const size_t n);
+
+///
+/// Compresses a buffer
+/// \param src Data to compress
+/// \param src_len Number of bytes in src
+/// \param dst Output buffer
+/// \param dst_cap Capacity of dst in bytes
+/// \return Compressed size, 0 on error or if the output does not fit in dst_cap
+///
+size_t lz_compress(const void *const src, const size_t src_len, void *const dst, const size_t dst_cap);
+
+///
+/// Decompresses a buffer produced by lz_compress
+/// \param src Compressed data
+/// \param src_len Number of compressed bytes
+/// \param dst Output buffer
+/// \param dst_len Exact decompressed size expected
+/// \return dst_len on success, 0 on malformed input
+///
+size_t lz_decompress(const void *const src, const size_t src_len, void *const dst, const size_t dst_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE     // posix_fadvise, pwritev
+#include "block_cache.h"
+#include "bitmap_inline.h"
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define NO_FRAME 0u
+
+// Read-ahead window limits, in bytes of file. The window starts small and doubles with each
+// further chunk of a sequential run.
+#define READAHEAD_MIN_BYTES (8 * 1024)
+#define READAHEAD_MAX_BYTES (1024 * 1024)
+
+// Write-back: adjacent dirty chunks go out in one pwritev of at most this many frames
+#define WRITEBACK_MAX_IOV 64
+#define WRITEBACK_DEFAULT_MS 1000
+
+struct dirty_ref
+{
+    size_t chunk;
+    uint32_t frame;
+};
+
+typedef struct frame
+{
+    size_t chunk;       // Chunk held by this frame
+    bool dirty;         // Modified since it was read in
+    bool referenced;    // CLOCK bit, only meaningful in the main queue
+    bool main;          // In the main queue rather than the probation FIFO
+} frame_t;
+
+struct block_cache
+{
+    int fd;
+    size_t chunk_bytes, num_chunks, num_frames;
+    uint8_t *arena;         // num_frames * chunk_bytes
+    frame_t *frames;
+    uint32_t *chunk_frame;  // Chunk -> frame + 1, NO_FRAME if not cached
+    size_t used_frames;     // Frames handed out so far; the rest have never held a chunk
+    uint32_t *spare;        // Handed out frames holding nothing (a read into them failed)
+    size_t spare_count;
+    size_t misses;
+
+    // Probation FIFO (2Q's A1in): frames whose chunk has only been asked for once
+    uint32_t *fifo;
+    size_t fifo_head, fifo_count, fifo_limit;
+
+    // Main queue (2Q's Am) lives in place in frames[], swept by a CLOCK hand
+    size_t main_count, hand;
+
+    // Ghosts (2Q's A1out): chunks recently evicted from probation, data not kept
+    size_t *ghosts;
+    size_t ghost_head, ghost_count, ghost_limit;
+    bitmap_t *ghost;
+
+    // Write-back thresholds: flush once max_dirty frames are dirty or the first of them has
+    // been dirty for max_age_ns
+    size_t dirty_count, max_dirty;
+    uint64_t dirty_since, max_age_ns;
+    struct dirty_ref *order;    // Flush scratch, num_frames entries
+    size_t writes;
+
+    // Sequential detection: the last chunk asked for, the current window and the first
+    // chunk past what has already been advised
+    size_t last_chunk, ra_window, ra_next;
+    size_t ra_min, ra_max;
+    size_t ra_chunks;
+};
+
+static bool pread_full(int fd, uint8_t *buf, size_t n, off_t offset)
+{
+    while (n > 0)
+    {
+        ssize_t got = pread(fd, buf, n, offset);
+        if (got < 0) return false;
+        // Past the end of the file reads as zeros
+        if (got == 0)
+        {
+            memset(buf, 0, n);
+            return true;
+        }
+        buf += got;
+        n -= (size_t) got;
+        offset += got;
+    }
+    return true;
+}
+
+static bool pwrite_full(int fd, const uint8_t *buf, size_t n, off_t offset)
+{
+    while (n > 0)
+    {
+        ssize_t put = pwrite(fd, buf, n, offset);
+        if (put <= 0) return false;
+        buf += put;
+        n -= (size_t) put;
+        offset += put;
+    }
+    return true;
+}
+
+static inline uint8_t *frame_data(const block_cache_t *const cache, const size_t frame)
+{
+    return cache->arena + frame * cache->chunk_bytes;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static void mark_dirty(block_cache_t *const cache, frame_t *const f)
+{
+    if (f->dirty) return;
+    f->dirty = true;
+    if (cache->dirty_count++ == 0) cache->dirty_since = now_ns();
+}
+
+static void mark_clean(block_cache_t *const cache, frame_t *const f)
+{
+    if (!f->dirty) return;
+    f->dirty = false;
+    --cache->dirty_count;
+}
+
+// Writes count dirty frames holding consecutive chunks with a single pwritev, finishing a
+// short write one frame at a time
+static bool write_run(block_cache_t *const cache, const uint32_t *const frames, const size_t count)
+{
+    struct iovec iov[WRITEBACK_MAX_IOV];
+    for (size_t i = 0; i < count; ++i)
+    {
+        iov[i].iov_base = frame_data(cache, frames[i]);
+        iov[i].iov_len = cache->chunk_bytes;
+    }
+
+    const off_t offset = (off_t) (cache->frames[frames[0]].chunk * cache->chunk_bytes);
+    ssize_t put = pwritev(cache->fd, iov, (int) count, offset);
+    ++cache->writes;
+
+    size_t done = put > 0 ? (size_t) put : 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const size_t start = i * cache->chunk_bytes;
+        if (done < start + cache->chunk_bytes)
+        {
+            const size_t skip = done > start ? done - start : 0;
+            if (!pwrite_full(cache->fd, frame_data(cache, frames[i]) + skip, cache->chunk_bytes - skip, offset + (off_t) (start + skip)))
+            {
+                return false;
+            }
+        }
+        mark_clean(cache, &cache->frames[frames[i]]);
+    }
+    return true;
+}
+
+// Writes a dirty frame back together with any dirty neighbours, so an eviction clears the
+// whole run of adjacent dirty chunks in one call
+static bool write_back(block_cache_t *const cache, const size_t frame)
+{
+    if (!cache->frames[frame].dirty) return true;
+
+    const size_t chunk = cache->frames[frame].chunk;
+    size_t first = chunk, last = chunk;
+    while (first > 0 && last - first + 1 < WRITEBACK_MAX_IOV && cache->chunk_frame[first - 1] != NO_FRAME
+           && cache->frames[cache->chunk_frame[first - 1] - 1].dirty)
+    {
+        --first;
+    }
+    while (last + 1 < cache->num_chunks && last - first + 1 < WRITEBACK_MAX_IOV && cache->chunk_frame[last + 1] != NO_FRAME
+           && cache->frames[cache->chunk_frame[last + 1] - 1].dirty)
+    {
+        ++last;
+    }
+
+    uint32_t frames[WRITEBACK_MAX_IOV];
+    for (size_t c = first; c <= last; ++c)
+    {
+        frames[c - first] = cache->chunk_frame[c] - 1;
+    }
+    return write_run(cache, frames, last - first + 1);
+}
+
+static int compare_dirty(const void *a, const void *b)
+{
+    const size_t x = ((const struct dirty_ref *) a)->chunk, y = ((const struct dirty_ref *) b)->chunk;
+    return (x > y) - (x < y);
+}
+
+static void ghost_push(block_cache_t *const cache, const size_t chunk)
+{
+    if (cache->ghost_limit == 0) return;
+    if (cache->ghost_count == cache->ghost_limit)
+    {
+        bitmap_reset_inline(cache->ghost, cache->ghosts[cache->ghost_head]);
+        cache->ghost_head = (cache->ghost_head + 1) % cache->ghost_limit;
+        --cache->ghost_count;
+    }
+    cache->ghosts[(cache->ghost_head + cache->ghost_count) % cache->ghost_limit] = chunk;
+    ++cache->ghost_count;
+    bitmap_set_inline(cache->ghost, chunk);
+}
+
+// Tells the kernel to start reading the next window when a run of increasing chunks gets
+// within half a window of the advised range. The hint is asynchronous, so by the time the
+// run reaches those chunks their pread is served from the page cache.
+static void read_ahead(block_cache_t *const cache, const size_t chunk)
+{
+    if (chunk != cache->last_chunk + 1)
+    {
+        if (chunk != cache->last_chunk)
+        {
+            cache->ra_window = 0;
+            cache->ra_next = 0;
+        }
+        cache->last_chunk = chunk;
+        return;
+    }
+    cache->last_chunk = chunk;
+
+    cache->ra_window = cache->ra_window ? cache->ra_window * 2 : cache->ra_min;
+    if (cache->ra_window > cache->ra_max) cache->ra_window = cache->ra_max;
+    if (cache->ra_next <= chunk) cache->ra_next = chunk + 1;
+    if (cache->ra_next > chunk + cache->ra_window / 2 || cache->ra_next >= cache->num_chunks) return;
+
+    size_t end = chunk + 1 + cache->ra_window;
+    if (end > cache->num_chunks) end = cache->num_chunks;
+    if (end <= cache->ra_next) return;
+    posix_fadvise(cache->fd, (off_t) (cache->ra_next * cache->chunk_bytes),
+                  (off_t) ((end - cache->ra_next) * cache->chunk_bytes), POSIX_FADV_WILLNEED);
+    cache->ra_chunks += end - cache->ra_next;
+    cache->ra_next = end;
+}
+
+// Picks a frame to reuse, writing its chunk back if needed. SIZE_MAX on I/O error.
+static size_t evict(block_cache_t *const cache)
+{
+    size_t victim;
+    bool from_fifo = cache->fifo_count > cache->fifo_limit || cache->main_count == 0;
+
+    if (from_fifo)
+    {
+        victim = cache->fifo[cache->fifo_head];
+    }
+    else
+    {
+        // Second chance: referenced main frames get their bit cleared and are passed over once
+        for (;;)
+        {
+            frame_t *f = &cache->frames[cache->hand];
+            victim = cache->hand;
+            cache->hand = (cache->hand + 1) % cache->num_frames;
+            if (!f->main) continue;
+            if (f->referenced)
+            {
+                f->referenced = false;
+                continue;
+            }
+            break;
+        }
+    }
+
+    if (!write_back(cache, victim)) return SIZE_MAX;
+
+    if (from_fifo)
+    {
+        cache->fifo_head = (cache->fifo_head + 1) % cache->num_frames;
+        --cache->fifo_count;
+        ghost_push(cache, cache->frames[victim].chunk);
+    }
+    else
+    {
+        --cache->main_count;
+    }
+    cache->chunk_frame[cache->frames[victim].chunk] = NO_FRAME;
+    return victim;
+}
+
+block_cache_t *block_cache_create(const int fd, const size_t chunk_bytes, const size_t num_chunks, const size_t num_frames)
+{
+    if (fd < 0 || !chunk_bytes || !num_chunks || num_frames < 2 || num_frames >= UINT32_MAX) return NULL;
+
+    block_cache_t *cache = (block_cache_t *) calloc(1, sizeof(block_cache_t));
+    if (cache)
+    {
+        cache->fd = fd;
+        cache->chunk_bytes = chunk_bytes;
+        cache->num_chunks = num_chunks;
+        cache->num_frames = num_frames;
+        cache->fifo_limit = num_frames / 4 ? num_frames / 4 : 1;
+        cache->ghost_limit = num_frames / 2;
+        cache->last_chunk = SIZE_MAX - 1;
+        cache->ra_min = READAHEAD_MIN_BYTES / chunk_bytes ? READAHEAD_MIN_BYTES / chunk_bytes : 1;
+        cache->ra_max = READAHEAD_MAX_BYTES / chunk_bytes ? READAHEAD_MAX_BYTES / chunk_bytes : 1;
+
+        cache->arena = (uint8_t *) malloc(num_frames * chunk_bytes);
+        cache->frames = (frame_t *) calloc(num_frames, sizeof(frame_t));
+        cache->chunk_frame = (uint32_t *) calloc(num_chunks, sizeof(uint32_t));
+        cache->fifo = (uint32_t *) malloc(num_frames * sizeof(uint32_t));
+        cache->spare = (uint32_t *) malloc(num_frames * sizeof(uint32_t));
+        cache->ghosts = (size_t *) malloc((cache->ghost_limit ? cache->ghost_limit : 1) * sizeof(size_t));
+        cache->ghost = bitmap_create(num_chunks);
+        cache->order = (struct dirty_ref *) malloc(num_frames * sizeof(struct dirty_ref));
+        cache->max_dirty = num_frames / 2;
+        cache->max_age_ns = WRITEBACK_DEFAULT_MS * 1000000ull;
+        if (cache->arena && cache->frames && cache->chunk_frame && cache->fifo && cache->spare && cache->ghosts && cache->ghost
+            && cache->order)
+        {
+            return cache;
+        }
+        block_cache_destroy(cache);
+    }
+    return NULL;
+}
+
+bool block_cache_destroy(block_cache_t *cache)
+{
+    bool ok = true;
+    if (cache)
+    {
+        if (cache->arena && cache->frames && cache->order) ok = block_cache_flush(cache);
+        free(cache->arena);
+        free(cache->frames);
+        free(cache->chunk_frame);
+        free(cache->fifo);
+        free(cache->spare);
+        free(cache->ghosts);
+        bitmap_destroy(cache->ghost);
+        free(cache->order);
+        free(cache);
+    }
+    return ok;
+}
+
+uint8_t *block_cache_get(block_cache_t *const cache, const size_t chunk, const bool dirty)
+{
+    read_ahead(cache, chunk);
+
+    // Thresholds are checked before this call dirties anything, so the caller's write isn't
+    // flushed out from under it
+    if (cache->dirty_count != 0
+        && (cache->dirty_count >= cache->max_dirty || now_ns() - cache->dirty_since >= cache->max_age_ns)
+        && !block_cache_flush(cache))
+    {
+        return NULL;
+    }
+
+    size_t frame = cache->chunk_frame[chunk];
+    if (frame != NO_FRAME)
+    {
+        frame_t *f = &cache->frames[--frame];
+        // Hits in the probation FIFO don't count; that's what keeps scans out of the main queue
+        if (f->main) f->referenced = true;
+        if (dirty) mark_dirty(cache, f);
+        return frame_data(cache, frame);
+    }
+
+    // Back again soon after being dropped from probation: it's hot. Checked before evicting,
+    // since the eviction may push this chunk's ghost out.
+    const bool hot = bitmap_test_inline(cache->ghost, chunk);
+
+    if (cache->spare_count) frame = cache->spare[--cache->spare_count];
+    else if (cache->used_frames < cache->num_frames) frame = cache->used_frames++;
+    else if ((frame = evict(cache)) == SIZE_MAX) return NULL;
+
+    frame_t *f = &cache->frames[frame];
+    f->dirty = false;
+    f->main = false;
+    if (!pread_full(cache->fd, frame_data(cache, frame), cache->chunk_bytes, (off_t) (chunk * cache->chunk_bytes)))
+    {
+        cache->spare[cache->spare_count++] = (uint32_t) frame;
+        return NULL;
+    }
+    ++cache->misses;
+
+    f->chunk = chunk;
+    f->referenced = false;
+    if (dirty) mark_dirty(cache, f);
+    cache->chunk_frame[chunk] = (uint32_t) frame + 1;
+
+    if (hot)
+    {
+        bitmap_reset_inline(cache->ghost, chunk);
+        f->main = true;
+        ++cache->main_count;
+    }
+    else
+    {
+        f->main = false;
+        cache->fifo[(cache->fifo_head + cache->fifo_count++) % cache->num_frames] = (uint32_t) frame;
+    }
+    return frame_data(cache, frame);
+}
+
+bool block_cache_flush(block_cache_t *const cache)
+{
+    size_t count = 0;
+    for (size_t frame = 0; frame < cache->used_frames; ++frame)
+    {
+        if (cache->frames[frame].dirty)
+        {
+            cache->order[count].chunk = cache->frames[frame].chunk;
+            cache->order[count++].frame = (uint32_t) frame;
+        }
+    }
+    qsort(cache->order, count, sizeof(struct dirty_ref), compare_dirty);
+
+    // One pwritev per run of adjacent chunks
+    bool ok = true;
+    uint32_t frames[WRITEBACK_MAX_IOV];
+    for (size_t i = 0; i < count;)
+    {
+        size_t run = 0;
+        do
+        {
+            frames[run++] = cache->order[i++].frame;
+        } while (i < count && run < WRITEBACK_MAX_IOV && cache->order[i].chunk == cache->order[i - 1].chunk + 1);
+        ok = write_run(cache, frames, run) && ok;
+    }
+    return ok;
+}
+
+void block_cache_set_writeback(block_cache_t *const cache, const size_t max_dirty, const unsigned max_age_ms)
+{
+    cache->max_dirty = max_dirty ? max_dirty : cache->num_frames / 2;
+    cache->max_age_ns = (uint64_t) (max_age_ms ? max_age_ms : WRITEBACK_DEFAULT_MS) * 1000000u;
+}
+
+size_t block_cache_writes(const block_cache_t *const cache)
+{
+    return cache->writes;
+}
+
+size_t block_cache_misses(const block_cache_t *const cache)
+{
+    return cache->misses;
+}
+
+size_t block_cache_readahead(const block_cache_t *const cache)
+{
+    return cache->ra_chunks;
+}
@@ -1,289 +1,2915 @@
+#define _GNU_SOURCE     // O_DIRECT, getcpu
 #include <stdio.h>
 #include <stdint.h>
-#include "bitmap.h"
+#include "bitmap_inline.h"
 #include "block_store.h"
+#include "block_cache.h"
+#include "dedup.h"
+#include "extent_index.h"
+#include "buddy.h"
+#include "lz.h"
 #include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+
+// Blocks are grouped into fixed-size chunks, the unit of sharing, lazy loading and image encoding
+#define BS_CHUNK_BLOCKS 128
+#define BS_CHUNK_BYTES (BS_CHUNK_BLOCKS * BLOCK_SIZE_BYTES)
+
+// Buffer cache size for file-backed stores when the options don't give one
+#define BS_DEFAULT_CACHE_CHUNKS 64
+
+/*
+ * @struct bs_chunk
+ * @brief One chunk of block data, shared between a store and its snapshots.
+ *  A store may only write to a chunk it holds the sole reference to.
+*/
+typedef struct bs_chunk 
+{
+    atomic_uint refs;   // Stores and snapshots using this chunk
+    uint8_t bytes[BS_CHUNK_BYTES];
+} bs_chunk_t;
+
+/*
+ * @struct bs_op_stats
+ * @brief Counters behind one entry of block_store_stats_t. Atomic because readers update
+ *  them concurrently under the shared lock.
+*/
+typedef struct bs_op_stats
+{
+    atomic_uint_fast64_t count, total_ns, max_ns;
+    atomic_uint_fast64_t buckets[BLOCK_STORE_STATS_BUCKETS];
+} bs_op_stats_t;
+
+/*
+ * @struct block_store
+ * @brief Structure representing a block storage system.
+*/
+typedef struct block_store 
+{
+    pthread_rwlock_t lock; // Held shared by readers, exclusively by writers (see store_lock_read)
+    bitmap_t* bitmap;   // Bitmap to track used/free blocks
+    size_t num_blocks;  // Blocks in the store, a multiple of BS_CHUNK_BLOCKS
+    size_t num_chunks;  // num_blocks / BS_CHUNK_BLOCKS
+    bs_chunk_t** chunks; // Storage for blocks, num_chunks chunks (NULL for dedup and file-backed stores)
+    dedup_t* dedup;     // Content-addressed storage for blocks (BLOCK_STORE_OPT_DEDUP only)
+    bool read_only;     // Snapshots can't be modified
+    bitmap_t* resident; // Chunks already loaded from the image (lazy opens only, NULL otherwise)
+    int image_fd;       // Compressed image backing a lazy open, -1 otherwise
+    uint32_t* directory; // Chunk record offsets in the image
+    uint8_t* scratch;   // Decode buffers for faulting chunks in
+    block_cache_t* cache; // Frames over backing_fd (file-backed stores only, NULL otherwise)
+    int backing_fd;     // Block data followed by the allocation bitmap, -1 if not file-backed
+    void** shards;      // Mappings the chunks live in (NUMA and huge-page stores only, NULL otherwise)
+    size_t num_shards;  // Entries in shards
+    size_t* shard_order; // [node * num_shards + i]: shards for callers on node to try, its own first (NUMA stores only)
+    size_t num_nodes;   // Nodes shard_order has rows for
+    unsigned page_backing; // BLOCK_STORE_PAGES_* the shards got
+    size_t slab_align;  // Shard mappings are a multiple of this many bytes
+    bool sparse;        // Chunks are allocated on first write; a NULL chunk reads as zeros
+    size_t materialized; // Chunks allocated so far (sparse stores only)
+    extent_index_t* extents; // Free runs outside the reserved range, in step with bitmap (NULL: scan the bitmap)
+    buddy_t* buddy;     // Free blocks by power-of-two order (BLOCK_STORE_OPT_BUDDY only, NULL otherwise)
+    unsigned policy;    // BLOCK_STORE_POLICY_* used by block_store_allocate
+    size_t cursor;      // One past the block allocated last, where next-fit and near-hint start looking
+    uint16_t* refs;     // Owners of each block beyond the first (BLOCK_STORE_OPT_REFCOUNT only, NULL otherwise)
+    size_t* to_phys;    // Logical id -> block holding its data, SIZE_MAX if not in use (BLOCK_STORE_OPT_REMAP only, NULL otherwise)
+    size_t* to_logical; // Block -> logical id it holds, SIZE_MAX if free (NULL for snapshots and without remapping)
+    extent_index_t* free_ids; // Logical ids not in use (NULL: rebuild from to_phys)
+    size_t compact_top; // No block at or above this is in use (remapped stores only)
+    bs_op_stats_t stats[BLOCK_STORE_STAT_COUNT]; // Per-operation counts and latencies, see block_store_get_stats
+} block_store_t;
+
+// Direct I/O moves data through an aligned bounce buffer of this size
+#define BS_DIRECT_ALIGN 4096
+#define BS_DIRECT_BUFFER (64 * 1024)
+
+static bool block_store_fault_in(const block_store_t *const bs, const size_t block_id);
+static bool slab_create(block_store_t *const bs, size_t shards, const bool numa, const bool huge);
+static void slab_destroy(block_store_t *const bs);
+static const size_t *numa_caller_order(const block_store_t *const bs);
+static size_t allocate_locked(block_store_t *const bs);
+static size_t place_locked(block_store_t *const bs);
+static size_t allocate_order_locked(block_store_t *const bs, const unsigned order);
+static size_t allocate_range(block_store_t *const bs, const size_t first, const size_t end);
+static size_t write_locked(block_store_t *const bs, const size_t block_id, const void *buffer);
+static block_store_t *open_backing(const block_store_options_t *const options);
+static int open_image(const char *const filename, int oflags, const unsigned io_flags, bool *direct);
+static bool direct_pread(int fd, block_store_t *const bs);
+static bool direct_pwrite(int fd, const block_store_t *const bs);
+
+// Reads exactly n bytes, retrying short reads
+static bool read_full(int fd, void *buf, size_t n)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got <= 0) return false;
+        p += got;
+        n -= (size_t)got;
+    }
+    return true;
+}
+
+// Reads exactly n bytes at the given offset, retrying short reads
+static bool pread_full(int fd, void *buf, size_t n, off_t offset)
+{
+    uint8_t *p = (uint8_t *)buf;
+    while (n > 0) {
+        ssize_t got = pread(fd, p, n, offset);
+        if (got <= 0) return false;
+        p += got;
+        n -= (size_t)got;
+        offset += got;
+    }
+    return true;
+}
+
+// Writes exactly n bytes at the given offset, retrying short writes
+static bool pwrite_full(int fd, const void *buf, size_t n, off_t offset)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (n > 0) {
+        ssize_t put = pwrite(fd, p, n, offset);
+        if (put <= 0) return false;
+        p += put;
+        n -= (size_t)put;
+        offset += put;
+    }
+    return true;
+}
+
+// Writes exactly n bytes, retrying short writes
+static bool write_full(int fd, const void *buf, size_t n)
+{
+    const uint8_t *p = (const uint8_t *)buf;
+    while (n > 0) {
+        ssize_t put = write(fd, p, n);
+        if (put <= 0) return false;
+        p += put;
+        n -= (size_t)put;
+    }
+    return true;
+}
+
+// Blocks set aside for the allocation map, from BITMAP_START_BLOCK on (BITMAP_NUM_BLOCKS by default)
+static inline size_t reserved_blocks(const size_t num_blocks)
+{
+    return ((num_blocks + 7) / 8 + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+}
+
+// Whether a store of num_blocks blocks can be built: whole chunks, room for the reserved range
+static inline bool valid_geometry(const size_t num_blocks)
+{
+    return num_blocks % BS_CHUNK_BLOCKS == 0 && num_blocks > BITMAP_START_BLOCK + reserved_blocks(num_blocks)
+        && num_blocks <= SIZE_MAX / BLOCK_SIZE_BYTES;
+}
+
+// What a chunk of a sparse store holds until it is first written
+static const uint8_t zero_chunk[BS_CHUNK_BYTES];
+
+// Address of a block's data, for reading; file-backed stores must have faulted the chunk in
+static inline const uint8_t *block_data(const block_store_t *const bs, const size_t block_id)
+{
+    size_t offset = (block_id % BS_CHUNK_BLOCKS) * BLOCK_SIZE_BYTES;
+    if (bs->dedup != NULL) return dedup_read(bs->dedup, block_id);
+    if (bs->cache != NULL) return block_cache_get(bs->cache, block_id / BS_CHUNK_BLOCKS, false) + offset;
+    const bs_chunk_t *chunk = bs->chunks[block_id / BS_CHUNK_BLOCKS];
+    return (chunk != NULL ? chunk->bytes : zero_chunk) + offset;
+}
+
+/*
+ * @function chunk_data
+ * @brief A whole chunk's data for reading, loading it first if it isn't in memory.
+ *  For file-backed stores the pointer is only good until the next chunk is touched.
+ * @param bs The block store.
+ * @param chunk The chunk index.
+ * @param scratch BS_CHUNK_BYTES where dedup and remapped stores assemble the chunk.
+ * @return The chunk's data, or NULL on an I/O or format error.
+*/
+static const uint8_t *chunk_data(const block_store_t *const bs, const size_t chunk, uint8_t *scratch)
+{
+    if (!block_store_fault_in(bs, chunk * BS_CHUNK_BLOCKS)) return NULL;
+    if (bs->cache != NULL) return block_cache_get(bs->cache, chunk, false);
+
+    // Images of remapped stores hold the blocks by logical id, so they load back with the same ids
+    if (bs->to_phys != NULL) {
+        for (size_t i = 0; i < BS_CHUNK_BLOCKS; ++i) {
+            size_t block = bs->to_phys[chunk * BS_CHUNK_BLOCKS + i];
+            memcpy(scratch + (i * BLOCK_SIZE_BYTES), block != SIZE_MAX ? block_data(bs, block) : zero_chunk, BLOCK_SIZE_BYTES);
+        }
+        return scratch;
+    }
+    if (bs->dedup == NULL) return bs->chunks[chunk] != NULL ? bs->chunks[chunk]->bytes : zero_chunk;
+
+    for (size_t i = 0; i < BS_CHUNK_BLOCKS; ++i) {
+        memcpy(scratch + (i * BLOCK_SIZE_BYTES), dedup_read(bs->dedup, chunk * BS_CHUNK_BLOCKS + i), BLOCK_SIZE_BYTES);
+    }
+    return scratch;
+}
+
+static void chunk_unref(bs_chunk_t *chunk)
+{
+    if (chunk && atomic_fetch_sub_explicit(&chunk->refs, 1, memory_order_acq_rel) == 1) free(chunk);
+}
+
+/*
+ * @function block_data_for_write
+ * @brief Address of a block's data, for writing. Copies the chunk first if a snapshot shares it,
+ *  and allocates it first if it has never been written (sparse stores).
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The block about to be written.
+ * @return The block's data, or NULL if the copy couldn't be allocated.
+*/
+static uint8_t *block_data_for_write(block_store_t *const bs, const size_t block_id)
+{
+    size_t index = block_id / BS_CHUNK_BLOCKS;
+    if (bs->cache != NULL) {
+        uint8_t *frame = block_cache_get(bs->cache, index, true);
+        return frame != NULL ? frame + ((block_id % BS_CHUNK_BLOCKS) * BLOCK_SIZE_BYTES) : NULL;
+    }
+
+    bs_chunk_t *chunk = bs->chunks[index];
+    if (chunk == NULL) {
+        chunk = (bs_chunk_t *)calloc(1, sizeof(bs_chunk_t));
+        if (chunk == NULL) return NULL;
+        atomic_init(&chunk->refs, 1);
+        bs->chunks[index] = chunk;
+        ++bs->materialized;
+    }
+
+    // Only this store can add references, so a count of one can't go back up behind our back
+    if (atomic_load_explicit(&chunk->refs, memory_order_acquire) > 1) {
+        bs_chunk_t *copy = (bs_chunk_t *)malloc(sizeof(bs_chunk_t));
+        if (copy == NULL) return NULL;
+        atomic_init(&copy->refs, 1);
+        memcpy(copy->bytes, chunk->bytes, BS_CHUNK_BYTES);
+        bs->chunks[index] = copy;
+        chunk_unref(chunk);
+        chunk = copy;
+    }
+    return chunk->bytes + ((block_id % BS_CHUNK_BLOCKS) * BLOCK_SIZE_BYTES);
+}
+
+/*
+ * @function store_alloc
+ * @brief Allocates an empty store structure of the given geometry, with its lock ready.
+ *  Everything else (bitmap, data) is left for the caller to set up.
+ * @param num_blocks Blocks in the store, already checked with valid_geometry.
+ * @return The structure, or NULL on failure.
+*/
+static block_store_t *store_alloc(const size_t num_blocks)
+{
+    block_store_t *bs = (block_store_t *)calloc(1, sizeof(block_store_t));
+    if (bs == NULL) return NULL;
+    if (pthread_rwlock_init(&bs->lock, NULL) != 0) {
+        free(bs);
+        return NULL;
+    }
+    bs->image_fd = -1;
+    bs->backing_fd = -1;
+    bs->num_blocks = num_blocks;
+    bs->num_chunks = num_blocks / BS_CHUNK_BLOCKS;
+    return bs;
+}
+
+// Reads of file-backed and lazily opened stores load chunks, so those take the lock exclusively too
+static inline void store_lock_read(const block_store_t *const bs)
+{
+    pthread_rwlock_t *lock = (pthread_rwlock_t *)&bs->lock;
+    if (bs->cache != NULL || bs->resident != NULL) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+static inline void store_lock_write(block_store_t *const bs)
+{
+    pthread_rwlock_wrlock(&bs->lock);
+}
+
+static inline void store_unlock(const block_store_t *const bs)
+{
+    pthread_rwlock_unlock((pthread_rwlock_t *)&bs->lock);
+}
+
+/*
+ * Operation statistics. One switch covers every store, so loads can be timed before the store
+ *  exists; while it's off, an operation costs a relaxed load and a branch.
+*/
+static atomic_bool stats_enabled;
+
+// When an operation started, in ns, or 0 if statistics are off
+static inline uint64_t stats_begin(void)
+{
+    if (!atomic_load_explicit(&stats_enabled, memory_order_relaxed)) return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// Records an operation begun at start (from stats_begin) against bs
+static void stats_end(const block_store_t *const bs, const unsigned op, const uint64_t start)
+{
+    if (start == 0 || bs == NULL) return;
+    uint64_t end = stats_begin();
+    if (end < start) return; // Switched off meanwhile
+
+    // Bucket i holds [2^i, 2^(i+1)) ns, the last one everything longer
+    uint64_t elapsed = end - start;
+    unsigned bucket = 0;
+    while (bucket + 1 < BLOCK_STORE_STATS_BUCKETS && (elapsed >> (bucket + 1)) != 0) ++bucket;
+
+    bs_op_stats_t *stats = (bs_op_stats_t *)&bs->stats[op];
+    atomic_fetch_add_explicit(&stats->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->total_ns, elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats->buckets[bucket], 1, memory_order_relaxed);
+    uint_fast64_t max = atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+    while (elapsed > max && !atomic_compare_exchange_weak_explicit(&stats->max_ns, &max, elapsed,
+                                                                   memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+/*
+ * @function block_store_set_stats_enabled
+ * @brief Turns recording of operation statistics on or off, for every store.
+ * @param enabled Whether to record.
+*/
+void block_store_set_stats_enabled(const bool enabled)
+{
+    atomic_store_explicit(&stats_enabled, enabled, memory_order_relaxed);
+}
+
+/*
+ * @function block_store_get_stats
+ * @brief Copies out a store's operation statistics. Each counter is read atomically, but an
+ *  operation finishing meanwhile may show up in some fields and not yet in others.
+ * @param bs A pointer to the block_store structure.
+ * @param out Where to put them.
+ * @return False if bs or out is NULL.
+*/
+bool block_store_get_stats(const block_store_t *const bs, block_store_stats_t *const out)
+{
+    if (bs == NULL || out == NULL) return false;
+
+    for (unsigned op = 0; op < BLOCK_STORE_STAT_COUNT; ++op) {
+        bs_op_stats_t *stats = (bs_op_stats_t *)&bs->stats[op];
+        block_store_op_stats_t *dest = &out->ops[op];
+        dest->count = atomic_load_explicit(&stats->count, memory_order_relaxed);
+        dest->total_ns = atomic_load_explicit(&stats->total_ns, memory_order_relaxed);
+        dest->max_ns = atomic_load_explicit(&stats->max_ns, memory_order_relaxed);
+        for (unsigned i = 0; i < BLOCK_STORE_STATS_BUCKETS; ++i) {
+            dest->buckets[i] = atomic_load_explicit(&stats->buckets[i], memory_order_relaxed);
+        }
+    }
+    return true;
+}
+
+/*
+ * @function block_store_reset_stats
+ * @brief Zeroes a store's operation statistics.
+ * @param bs A pointer to the block_store structure.
+*/
+void block_store_reset_stats(block_store_t *const bs)
+{
+    if (bs == NULL) return;
+
+    for (unsigned op = 0; op < BLOCK_STORE_STAT_COUNT; ++op) {
+        bs_op_stats_t *stats = &bs->stats[op];
+        atomic_store_explicit(&stats->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&stats->total_ns, 0, memory_order_relaxed);
+        atomic_store_explicit(&stats->max_ns, 0, memory_order_relaxed);
+        for (unsigned i = 0; i < BLOCK_STORE_STATS_BUCKETS; ++i) {
+            atomic_store_explicit(&stats->buckets[i], 0, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * The free-extent index mirrors every change to the bitmap outside the reserved range.
+ *  If an update can't allocate, the index is dropped and allocation goes back to scanning
+ *  the bitmap until extents_rebuild succeeds. Buddy stores mirror the same changes into
+ *  their buddy allocator, which never needs to allocate.
+*/
+
+// Takes [start, start + count) out of the buddy allocator's free blocks, for blocks claimed some other way
+static void buddy_claim(block_store_t *const bs, const size_t start, const size_t count)
+{
+    for (size_t id = start; bs->buddy != NULL && id < start + count; ++id) buddy_take(bs->buddy, id);
+}
+
+// Records that [start, start + count) just went from free to in use
+static void extents_claim(block_store_t *const bs, const size_t start, const size_t count)
+{
+    if (bs->extents != NULL && !extent_index_remove(bs->extents, start, count)) {
+        extent_index_destroy(bs->extents);
+        bs->extents = NULL;
+    }
+}
+
+// Records that block_id just went from in use to free
+static void extents_free(block_store_t *const bs, const size_t block_id)
+{
+    size_t reserved_end = BITMAP_START_BLOCK + reserved_blocks(bs->num_blocks);
+    if (block_id >= BITMAP_START_BLOCK && block_id < reserved_end) return;
+    if (bs->buddy != NULL) buddy_free(bs->buddy, block_id, 0);
+    if (bs->extents != NULL && !extent_index_insert(bs->extents, block_id, 1)) {
+        extent_index_destroy(bs->extents);
+        bs->extents = NULL;
+    }
+}
+
+/*
+ * Logical ids (BLOCK_STORE_OPT_REMAP). Callers hold logical ids, while the bitmap, free-extent
+ *  index, refcounts and data are indexed by the block the data sits in, which compaction moves.
+ *  to_phys and to_logical are inverses over the blocks in use, and free_ids tracks the logical
+ *  ids not handed out the way extents tracks free blocks. The reserved range maps to itself.
+ *  Without remapping a block's logical id is its own id.
+*/
+
+// The block holding a logical id's data, SIZE_MAX if the id isn't in use on a remapped store
+static inline size_t physical_id(const block_store_t *const bs, const size_t block_id)
+{
+    return bs->to_phys != NULL ? bs->to_phys[block_id] : block_id;
+}
+
+// Builds free_ids out of to_phys, after an update to it ran out of memory
+static bool free_ids_rebuild(block_store_t *const bs)
+{
+    bs->free_ids = extent_index_create();
+    for (size_t id = 0; bs->free_ids != NULL && id < bs->num_blocks; ++id) {
+        if (bs->to_phys[id] == SIZE_MAX && !extent_index_insert(bs->free_ids, id, 1)) {
+            extent_index_destroy(bs->free_ids);
+            bs->free_ids = NULL;
+        }
+    }
+    return bs->free_ids != NULL;
+}
+
+/*
+ * @function map_claim
+ * @brief Gives a run of blocks that was just claimed its logical ids: want if given, else the
+ *  blocks' own ids if those are free, else the first free run of ids.
+ * @param bs The block store, locked for writing.
+ * @param start First block of the run, SIZE_MAX if the claim failed.
+ * @param count Blocks in the run.
+ * @param want Logical id the caller asked for and checked is free, SIZE_MAX for any.
+ * @return The first logical id, or SIZE_MAX if no run of free ids was long enough (the blocks
+ *  are freed again).
+*/
+static size_t map_claim(block_store_t *const bs, const size_t start, const size_t count, const size_t want)
+{
+    if (bs->to_phys == NULL || start == SIZE_MAX) return start;
+
+    size_t id = want;
+    if (id == SIZE_MAX) {
+        id = start;
+        for (size_t i = start; id != SIZE_MAX && i < start + count; ++i) {
+            if (bs->to_phys[i] != SIZE_MAX) id = SIZE_MAX;
+        }
+    }
+    if (id == SIZE_MAX && (bs->free_ids != NULL || free_ids_rebuild(bs))) id = extent_index_first_fit(bs->free_ids, count);
+    if (id == SIZE_MAX) {
+        for (size_t block = start; block < start + count; ++block) {
+            bitmap_reset_inline(bs->bitmap, block);
+            extents_free(bs, block);
+        }
+        return SIZE_MAX;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        bs->to_phys[id + i] = start + i;
+        bs->to_logical[start + i] = id + i;
+    }
+    if (bs->free_ids != NULL && !extent_index_remove(bs->free_ids, id, count)) {
+        extent_index_destroy(bs->free_ids);
+        bs->free_ids = NULL;
+    }
+    if (start + count > bs->compact_top) bs->compact_top = start + count;
+    return id;
+}
+
+// Frees the logical id held by a block that was just freed
+static void map_release(block_store_t *const bs, const size_t block)
+{
+    if (bs->to_phys == NULL) return;
+
+    size_t id = bs->to_logical[block];
+    bs->to_phys[id] = bs->to_logical[block] = SIZE_MAX;
+    if (bs->free_ids != NULL && !extent_index_insert(bs->free_ids, id, 1)) {
+        extent_index_destroy(bs->free_ids);
+        bs->free_ids = NULL;
+    }
+}
+
+// Drops one owner of block_id, freeing it once the last is gone; false if it wasn't in use
+static bool release_locked(block_store_t *const bs, const size_t block_id)
+{
+    size_t block = physical_id(bs, block_id);
+    if (block == SIZE_MAX || !bitmap_test_inline(bs->bitmap, block)) return false;
+    if (bs->refs != NULL && bs->refs[block] > 0) {
+        --bs->refs[block];
+    } else {
+        bitmap_reset_inline(bs->bitmap, block);
+        extents_free(bs, block);
+        map_release(bs, block);
+    }
+    return true;
+}
+
+// Owners of block_id, 0 if it's free
+static size_t owners_locked(const block_store_t *const bs, const size_t block_id)
+{
+    size_t block = physical_id(bs, block_id);
+    if (block == SIZE_MAX || !bitmap_test_inline(bs->bitmap, block)) return 0;
+    return (size_t)(bs->refs != NULL ? bs->refs[block] : 0) + 1;
+}
+
+// Bits [offset, offset + count) of a 64-bit word, count at least 1
+static inline uint64_t word_mask(const size_t offset, const size_t count)
+{
+    return (count >= 64 ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1)) << offset;
+}
+
+/*
+ * @function used_word
+ * @brief Gathers the in-use bits of blocks [base, base + 64) into one word, bit i for block
+ *  base + i, with the reserved range counted as in use. Bits past the end of the store are 0.
+ * @param bs The block store.
+ * @param base First block, a multiple of 64.
+ * @return The word.
+*/
+static inline uint64_t used_word(const block_store_t *const bs, const size_t base)
+{
+    const uint8_t *data = bs->bitmap->data;
+    const size_t first = base / 8, last = (bs->num_blocks + 7) / 8;
+    uint64_t word = 0;
+    for (size_t i = 0; i < 8 && first + i < last; ++i) word |= (uint64_t)data[first + i] << (8 * i);
+
+    const size_t reserved_end = BITMAP_START_BLOCK + reserved_blocks(bs->num_blocks);
+    size_t lo = base > BITMAP_START_BLOCK ? base : BITMAP_START_BLOCK;
+    size_t hi = base + 64 < reserved_end ? base + 64 : reserved_end;
+    if (lo < hi) word |= word_mask(lo - base, hi - lo);
+    return word;
+}
+
+/*
+ * @function free_runs_scan
+ * @brief Walks the runs of free blocks in the bitmap, lowest first, a 64-bit word at a time.
+ *  Words that don't end or start a run cost one comparison.
+ * @param bs The block store.
+ * @param visit Called with each run's start, its length and arg; returning false stops the walk.
+ * @param arg Passed to visit.
+ * @return False if visit stopped the walk.
+*/
+static bool free_runs_scan(const block_store_t *const bs, bool (*visit)(size_t, size_t, void *), void *arg)
+{
+    size_t run = SIZE_MAX;  // Start of the free run being scanned, SIZE_MAX outside one
+    for (size_t base = 0; base < bs->num_blocks; base += 64) {
+        const size_t bits = bs->num_blocks - base < 64 ? bs->num_blocks - base : 64;
+        const uint64_t free_bits = ~used_word(bs, base) & word_mask(0, bits);
+        if (free_bits == (run == SIZE_MAX ? 0 : word_mask(0, bits))) continue;
+
+        for (size_t bit = 0; bit < bits; ) {
+            // Look for the next change: a free bit outside a run, a used bit inside one
+            uint64_t rest = (run == SIZE_MAX ? free_bits : ~free_bits) >> bit;
+            if (rest == 0) break;
+            bit += (size_t)__builtin_ctzll(rest);
+            if (bit >= bits) break;
+            if (run == SIZE_MAX) {
+                run = base + bit;
+            } else {
+                if (!visit(run, base + bit - run, arg)) return false;
+                run = SIZE_MAX;
+            }
+        }
+    }
+    return run == SIZE_MAX || visit(run, bs->num_blocks - run, arg);
+}
+
+static bool extents_insert_run(size_t start, size_t length, void *index)
+{
+    return extent_index_insert((extent_index_t *)index, start, length);
+}
+
+/*
+ * @function extents_rebuild
+ * @brief Builds the free-extent index from scratch out of the bitmap.
+ * @param bs The block store.
+ * @return False if the index couldn't be allocated (bs->extents is then NULL).
+*/
+static bool extents_rebuild(block_store_t *const bs)
+{
+    extent_index_destroy(bs->extents);
+    bs->extents = extent_index_create();
+
+    if (bs->extents != NULL && !free_runs_scan(bs, extents_insert_run, bs->extents)) {
+        extent_index_destroy(bs->extents);
+        bs->extents = NULL;
+    }
+    return bs->extents != NULL;
+}
+
+
+/*
+ * @function block_store_create
+ * @brief Creates and initializes a block store structure.
+ * @return A pointer to the newly created block_store structure on sucess, or NULL on failure.
+*/
+block_store_t *block_store_create()
+{
+    return block_store_create_ex(NULL);
+}
+
+/*
+ * @function block_store_create_ex
+ * @brief Creates and initializes a block store structure with optional features enabled.
+ * @param options Creation options, NULL for the defaults.
+ * @return A pointer to the newly created block_store structure on sucess, or NULL on failure.
+*/
+block_store_t *block_store_create_ex(const block_store_options_t *const options)
+{
+    const unsigned flags = options != NULL ? options->flags : 0;
+    size_t num_blocks = options != NULL && options->num_blocks != 0 ? options->num_blocks : BLOCK_STORE_NUM_BLOCKS;
+
+    const unsigned layout_flags = BLOCK_STORE_OPT_DEDUP | BLOCK_STORE_OPT_SPARSE;
+    const unsigned slab_flags = BLOCK_STORE_OPT_NUMA | BLOCK_STORE_OPT_HUGE_PAGES;
+    if ((flags & layout_flags) == layout_flags || ((flags & layout_flags) && (flags & slab_flags))) return NULL;
+    if ((flags & BLOCK_STORE_OPT_BUDDY) && (flags & BLOCK_STORE_OPT_NUMA)) return NULL;
+    if ((flags & BLOCK_STORE_OPT_REMAP) && (flags & (BLOCK_STORE_OPT_DEDUP | BLOCK_STORE_OPT_NUMA | BLOCK_STORE_OPT_BUDDY))) return NULL;
+    const unsigned policy = options != NULL ? options->policy : BLOCK_STORE_POLICY_FIRST_FIT;
+    if (policy > BLOCK_STORE_POLICY_NEAR) return NULL;
+    if (options != NULL && options->backing_file != NULL) {
+        if (flags & (layout_flags | slab_flags | BLOCK_STORE_OPT_BUDDY | BLOCK_STORE_OPT_REFCOUNT | BLOCK_STORE_OPT_REMAP)) return NULL;
+        block_store_t *bs = open_backing(options);
+        if (bs != NULL) bs->policy = policy;
+        return bs;
+    }
+    if (!valid_geometry(num_blocks)) return NULL;
+
+    //Allocate mem for block store struct and initialize all bits to zero
+    block_store_t *block = store_alloc(num_blocks);
+
+    //Error check. Check that allocation worked
+    if (block != NULL) {
+        //Allocate and initilizae num of stored blocks in bitmap 
+        block->bitmap = bitmap_create(num_blocks);
+        if (block->bitmap == NULL) {
+            block_store_destroy(block);
+            return NULL; //null on error
+        }
+        block->policy = policy;
+
+        // Everything but the reserved range starts out free
+        size_t reserved_end = BITMAP_START_BLOCK + reserved_blocks(num_blocks);
+        block->extents = extent_index_create();
+        if (block->extents == NULL || !extent_index_insert(block->extents, 0, BITMAP_START_BLOCK)
+            || !extent_index_insert(block->extents, reserved_end, num_blocks - reserved_end)) {
+            block_store_destroy(block);
+            return NULL;
+        }
+        if (flags & BLOCK_STORE_OPT_BUDDY) {
+            block->buddy = buddy_create(num_blocks);
+            if (block->buddy == NULL) {
+                block_store_destroy(block);
+                return NULL;
+            }
+            buddy_free_range(block->buddy, 0, BITMAP_START_BLOCK);
+            buddy_free_range(block->buddy, reserved_end, num_blocks - reserved_end);
+        }
+        if (flags & BLOCK_STORE_OPT_REFCOUNT) {
+            block->refs = (uint16_t *)calloc(num_blocks, sizeof(uint16_t));
+            if (block->refs == NULL) {
+                block_store_destroy(block);
+                return NULL;
+            }
+        }
+        if (flags & BLOCK_STORE_OPT_REMAP) {
+            block->to_phys = (size_t *)malloc(num_blocks * sizeof(size_t));
+            block->to_logical = (size_t *)malloc(num_blocks * sizeof(size_t));
+            block->free_ids = extent_index_create();
+            if (block->to_phys == NULL || block->to_logical == NULL || block->free_ids == NULL
+                || !extent_index_insert(block->free_ids, 0, BITMAP_START_BLOCK)
+                || !extent_index_insert(block->free_ids, reserved_end, num_blocks - reserved_end)) {
+                block_store_destroy(block);
+                return NULL;
+            }
+            for (size_t id = 0; id < num_blocks; ++id) {
+                bool reserved = id >= BITMAP_START_BLOCK && id < reserved_end;
+                block->to_phys[id] = block->to_logical[id] = reserved ? id : SIZE_MAX;
+            }
+        }
+
+        // Dedup stores keep their data in the content index instead of chunks
+        if (flags & BLOCK_STORE_OPT_DEDUP) {
+            block->dedup = dedup_create(num_blocks, BLOCK_SIZE_BYTES);
+            if (block->dedup == NULL) {
+                block_store_destroy(block);
+                return NULL;
+            }
+            return block;
+        }
+
+        //Error check that data created succesfully by checking if pointer == Null, else continue/skip 
+        block->chunks = (bs_chunk_t **)calloc(block->num_chunks, sizeof(bs_chunk_t *));
+        if (block->chunks == NULL) {
+            block_store_destroy(block);
+            return NULL; //null on error
+        }
+
+        // NUMA and huge-page stores carve their chunks out of larger mappings
+        if (flags & (BLOCK_STORE_OPT_NUMA | BLOCK_STORE_OPT_HUGE_PAGES)) {
+            bool numa = (flags & BLOCK_STORE_OPT_NUMA) != 0;
+            if (!slab_create(block, numa ? options->numa_shards : 1, numa, (flags & BLOCK_STORE_OPT_HUGE_PAGES) != 0)) {
+                block_store_destroy(block);
+                return NULL;
+            }
+            return block;
+        }
+
+        // Sparse stores leave every chunk out until it is written
+        if (flags & BLOCK_STORE_OPT_SPARSE) {
+            block->sparse = true;
+            return block;
+        }
+
+        for (size_t i = 0; i < block->num_chunks; ++i) {
+            block->chunks[i] = (bs_chunk_t *)calloc(1, sizeof(bs_chunk_t));
+            if (block->chunks[i] == NULL) {
+                block_store_destroy(block);
+                return NULL;
+            }
+            atomic_init(&block->chunks[i]->refs, 1);
+        }
+
+        return block;
+    }
+
+    return NULL; //null on error
+}
+
+/*
+ * @function open_backing
+ * @brief Creates a store whose block data lives in a file, read and written through a buffer cache.
+ *  The file holds the raw image (num_blocks * BLOCK_SIZE_BYTES) followed by the allocation bitmap,
+ *  which is only brought up to date by block_store_flush and block_store_destroy.
+ * @param options backing_file, and num_blocks (0 to take it from an existing file), cache_chunks
+ *  and the dirty_* write-back thresholds.
+ * @return A pointer to the new block store, or NULL on failure.
+*/
+static block_store_t *open_backing(const block_store_options_t *const options)
+{
+    size_t num_blocks = options->num_blocks;
+    size_t cache_chunks = options->cache_chunks;
+    int fd = open(options->backing_file, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // Each block takes BLOCK_SIZE_BYTES of data plus one bit of the trailing bitmap
+    bool fresh = st.st_size == 0;
+    if (num_blocks == 0) num_blocks = fresh ? BLOCK_STORE_NUM_BLOCKS : (size_t)st.st_size * 8 / (BLOCK_SIZE_BYTES * 8 + 1);
+    size_t data_bytes = num_blocks * BLOCK_SIZE_BYTES;
+    size_t file_bytes = data_bytes + num_blocks / 8;
+    if (!valid_geometry(num_blocks) || (!fresh && (size_t)st.st_size != file_bytes)
+        || (fresh && ftruncate(fd, (off_t)file_bytes) != 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    block_store_t *bs = store_alloc(num_blocks);
+    if (bs == NULL) {
+        close(fd);
+        return NULL;
+    }
+    bs->backing_fd = fd;
+
+    uint8_t *bitmap_data = malloc(num_blocks / 8);
+    bool ok = bitmap_data != NULL && pread_full(fd, bitmap_data, num_blocks / 8, (off_t)data_bytes);
+    if (ok) bs->bitmap = bitmap_import(num_blocks, bitmap_data);
+    free(bitmap_data);
+
+    if (cache_chunks == 0) cache_chunks = BS_DEFAULT_CACHE_CHUNKS;
+    if (cache_chunks > bs->num_chunks) cache_chunks = bs->num_chunks;
+    bs->cache = block_cache_create(fd, BS_CHUNK_BYTES, bs->num_chunks, cache_chunks);
+    if (bs->bitmap == NULL || bs->cache == NULL) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    extents_rebuild(bs);
+    block_cache_set_writeback(bs->cache, options->dirty_chunks, options->dirty_ms);
+    return bs;
+}
+
+/*
+ * @function block_store_flush
+ * @brief Writes dirty cached chunks and the allocation bitmap of a file-backed store to its file.
+ * @param bs A pointer to the block_store structure.
+ * @return False on I/O error, True otherwise, including for stores without a backing file.
+*/
+bool block_store_flush(block_store_t *const bs)
+{
+    if (bs == NULL || bs->bitmap == NULL) return false;
+    if (bs->cache == NULL) return true;
+
+    store_lock_write(bs);
+    bool ok = block_cache_flush(bs->cache);
+    off_t bitmap_offset = (off_t)(bs->num_blocks * BLOCK_SIZE_BYTES);
+    ok = pwrite_full(bs->backing_fd, bitmap_export(bs->bitmap), bs->num_blocks / 8, bitmap_offset) && ok;
+    store_unlock(bs);
+    return ok;
+}
+
+/*
+ * @function block_store_destroy
+ * @brief Deletes block store structure.
+ * @param BS device.
+*/
+void block_store_destroy(block_store_t *const bs)
+{
+    //Check if block store is not empty
+     if (bs != NULL) {
+        // File-backed stores write out their cached blocks and bitmap first
+        if (bs->cache != NULL) {
+            block_store_flush(bs);
+            block_cache_destroy(bs->cache);
+        }
+        bitmap_destroy(bs->bitmap); //Free the bitmap for the given block
+        bitmap_destroy(bs->resident);
+        if (bs->image_fd != -1) close(bs->image_fd);
+        if (bs->backing_fd != -1) close(bs->backing_fd);
+        free(bs->directory);
+        free(bs->scratch);
+        dedup_destroy(bs->dedup);
+        extent_index_destroy(bs->extents);
+        buddy_destroy(bs->buddy);
+        free(bs->refs);
+        free(bs->to_phys);
+        free(bs->to_logical);
+        extent_index_destroy(bs->free_ids);
+        if (bs->chunks != NULL) {
+            // Chunks still shared with a snapshot live on until it is released
+            for (size_t i = 0; bs->shards == NULL && i < bs->num_chunks; ++i) {
+                chunk_unref(bs->chunks[i]);
+            }
+            free(bs->chunks);
+        }
+        slab_destroy(bs);
+        pthread_rwlock_destroy(&bs->lock);
+        free(bs); //free mem
+    }
+}
+
+/*
+ * @function block_store_allocate
+ * @brief Searches for a free block, marks it as in use, and returns the block's id
+ * @param BS device.
+ * @return Allocated block's id, SIZE_MAX on error
+*/
+size_t block_store_allocate(block_store_t *const bs)
+{
+    // Check if bs NULL
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only) return SIZE_MAX;
+
+    uint64_t start = stats_begin();
+    store_lock_write(bs);
+    size_t id = allocate_locked(bs);
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_ALLOCATE, start);
+    return id;
+}
+
+/*
+ * @function block_store_allocate_extent
+ * @brief Allocates a run of consecutive blocks, found through the free-extent index.
+ * @param bs A pointer to the block_store structure.
+ * @param count The number of blocks wanted.
+ * @param fit BLOCK_STORE_FIT_FIRST or BLOCK_STORE_FIT_BEST.
+ * @return The id of the first block of the run, or SIZE_MAX if no free run is long enough.
+*/
+size_t block_store_allocate_extent(block_store_t *const bs, const size_t count, const unsigned fit)
+{
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only || count == 0) return SIZE_MAX;
+    if (fit != BLOCK_STORE_FIT_FIRST && fit != BLOCK_STORE_FIT_BEST) return SIZE_MAX;
+
+    store_lock_write(bs);
+    size_t start = SIZE_MAX;
+    if (bs->extents != NULL || extents_rebuild(bs)) {
+        start = fit == BLOCK_STORE_FIT_BEST ? extent_index_best_fit(bs->extents, count)
+                                            : extent_index_first_fit(bs->extents, count);
+    }
+    if (start != SIZE_MAX) {
+        for (size_t id = start; id < start + count; ++id) bitmap_set_inline(bs->bitmap, id);
+        extents_claim(bs, start, count);
+        buddy_claim(bs, start, count);
+        start = map_claim(bs, start, count, SIZE_MAX);
+    }
+    store_unlock(bs);
+    return start;
+}
+
+/*
+ * @function block_store_allocate_order
+ * @brief Allocates an aligned run of 2^order blocks from a buddy store.
+ * @param bs A pointer to the block_store structure.
+ * @param order log2 of the number of blocks wanted.
+ * @return The id of the first block (a multiple of 2^order), or SIZE_MAX on failure.
+*/
+size_t block_store_allocate_order(block_store_t *const bs, const unsigned order)
+{
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only || bs->buddy == NULL) return SIZE_MAX;
+
+    store_lock_write(bs);
+    size_t id = allocate_order_locked(bs, order);
+    store_unlock(bs);
+    return id;
+}
+
+// Takes a block from the buddy allocator and marks it in use, with the store locked for writing
+static size_t allocate_order_locked(block_store_t *const bs, const unsigned order)
+{
+    size_t id = buddy_allocate(bs->buddy, order);
+    if (id == SIZE_MAX) return SIZE_MAX;
+    for (size_t i = id; i < id + ((size_t)1 << order); ++i) bitmap_set_inline(bs->bitmap, i);
+    extents_claim(bs, id, (size_t)1 << order);
+    return id;
+}
+
+/*
+ * @function block_store_release_order
+ * @brief Frees an aligned run of 2^order blocks. A run that is wholly in use goes back to the
+ *  buddy allocator in one piece; anything else is released block by block.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The first block of the run, a multiple of 2^order.
+ * @param order log2 of the number of blocks.
+*/
+void block_store_release_order(block_store_t *const bs, const size_t block_id, const unsigned order)
+{
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only || order >= sizeof(size_t) * 8) return;
+    const size_t count = (size_t)1 << order;
+    if (block_id % count != 0 || block_id >= bs->num_blocks || bs->num_blocks - block_id < count) return;
+
+    store_lock_write(bs);
+    size_t reserved_end = BITMAP_START_BLOCK + reserved_blocks(bs->num_blocks);
+    bool whole = bs->buddy != NULL && (block_id + count <= BITMAP_START_BLOCK || block_id >= reserved_end);
+    for (size_t id = block_id; whole && id < block_id + count; ++id) {
+        whole = bitmap_test_inline(bs->bitmap, id) && (bs->refs == NULL || bs->refs[id] == 0);
+    }
+
+    if (whole) {
+        for (size_t id = block_id; id < block_id + count; ++id) bitmap_reset_inline(bs->bitmap, id);
+        buddy_free(bs->buddy, block_id, order);
+        if (bs->extents != NULL && !extent_index_insert(bs->extents, block_id, count)) {
+            extent_index_destroy(bs->extents);
+            bs->extents = NULL;
+        }
+    } else {
+        for (size_t id = block_id; id < block_id + count; ++id) release_locked(bs, id);
+    }
+    store_unlock(bs);
+}
+
+/*
+ * Allocation policies. Each picks a free block through the free-extent index, in O(log n),
+ *  without claiming it; hint is where the caller would like it to be.
+*/
+typedef size_t (*alloc_policy_t)(const block_store_t *const bs, const size_t hint);
+
+// Lowest free block
+static size_t policy_first_fit(const block_store_t *const bs, const size_t hint)
+{
+    (void)hint;
+    return extent_index_next_free(bs->extents, 0);
+}
+
+// First free block at or after the hint, wrapping around to the start
+static size_t policy_next_fit(const block_store_t *const bs, const size_t hint)
+{
+    size_t id = extent_index_next_free(bs->extents, hint);
+    return id != SIZE_MAX ? id : extent_index_next_free(bs->extents, 0);
+}
+
+// First block of the shortest free run, leaving long runs whole for extents
+static size_t policy_best_fit(const block_store_t *const bs, const size_t hint)
+{
+    (void)hint;
+    return extent_index_best_fit(bs->extents, 1);
+}
+
+// Free block closest to the hint on either side, the one after it on a tie
+static size_t policy_near(const block_store_t *const bs, const size_t hint)
+{
+    size_t after = extent_index_next_free(bs->extents, hint);
+    size_t before = hint > 0 ? extent_index_prev_free(bs->extents, hint - 1) : SIZE_MAX;
+    if (before == SIZE_MAX) return after;
+    if (after == SIZE_MAX) return before;
+    return after - hint <= hint - before ? after : before;
+}
+
+// Indexed by BLOCK_STORE_POLICY_*
+static const alloc_policy_t alloc_policies[] = {policy_first_fit, policy_next_fit, policy_best_fit, policy_near};
+
+/*
+ * @function allocate_with
+ * @brief Allocates the block a policy picks, with the store locked for writing.
+ *  Without a free-extent index (after a failed update) this falls back to a first-fit scan;
+ *  either way the block is taken out of the buddy allocator and becomes the new cursor.
+ * @return The block's id, or SIZE_MAX if the store is full.
+*/
+static size_t allocate_with(block_store_t *const bs, const alloc_policy_t policy, const size_t hint)
+{
+    size_t id;
+    if (bs->extents != NULL || extents_rebuild(bs)) {
+        id = policy(bs, hint < bs->num_blocks ? hint : bs->num_blocks - 1);
+        if (id != SIZE_MAX) {
+            bitmap_set_inline(bs->bitmap, id);
+            extents_claim(bs, id, 1);
+        }
+    } else {
+        id = allocate_range(bs, 0, bs->num_blocks);
+    }
+    if (id == SIZE_MAX) return SIZE_MAX;
+    buddy_claim(bs, id, 1);
+    bs->cursor = id + 1;
+    return id;
+}
+
+/*
+ * @function block_store_allocate_near
+ * @brief Allocates the free block closest to a hint, searching outward in both directions.
+ *  Distance from the hint is all that counts: NUMA shards and buddy orders are not consulted.
+ * @param bs A pointer to the block_store structure.
+ * @param hint_id The block the new one should be near, e.g. one it will be read with.
+ * @return The allocated block's id, or SIZE_MAX on failure.
+*/
+size_t block_store_allocate_near(block_store_t *const bs, const size_t hint_id)
+{
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only) return SIZE_MAX;
+
+    uint64_t start = stats_begin();
+    store_lock_write(bs);
+    size_t hint = hint_id < bs->num_blocks && physical_id(bs, hint_id) != SIZE_MAX ? physical_id(bs, hint_id) : hint_id;
+    size_t id = map_claim(bs, allocate_with(bs, policy_near, hint), 1, SIZE_MAX);
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_ALLOCATE, start);
+    return id;
+}
+
+/*
+ * @function block_store_set_policy
+ * @brief Chooses how block_store_allocate picks blocks from now on.
+ * @param bs A pointer to the block_store structure.
+ * @param policy A BLOCK_STORE_POLICY_* value.
+ * @return False if bs is NULL or the policy is unknown.
+*/
+bool block_store_set_policy(block_store_t *const bs, const unsigned policy)
+{
+    if (bs == NULL || policy > BLOCK_STORE_POLICY_NEAR) return false;
+
+    store_lock_write(bs);
+    bs->policy = policy;
+    store_unlock(bs);
+    return true;
+}
+
+// Allocation behind block_store_allocate, with the store locked for writing
+static size_t allocate_locked(block_store_t *const bs)
+{
+    return map_claim(bs, place_locked(bs), 1, SIZE_MAX);
+}
+
+// Picks a free block and marks it in use, following the store's placement rules
+static size_t place_locked(block_store_t *const bs)
+{
+    if (bs->buddy != NULL) return allocate_order_locked(bs, 0);
+    if (bs->num_shards < 2) return allocate_with(bs, alloc_policies[bs->policy], bs->cursor);
+
+    // NUMA stores start in the shards on the caller's node and only then go to the others
+    const size_t *order = numa_caller_order(bs);
+    for (size_t n = 0; n < bs->num_shards; ++n) {
+        size_t shard = order[n];
+        size_t id = allocate_range(bs, shard * bs->num_chunks / bs->num_shards * BS_CHUNK_BLOCKS,
+                                   (shard + 1) * bs->num_chunks / bs->num_shards * BS_CHUNK_BLOCKS);
+        if (id != SIZE_MAX) return id;
+    }
+    return SIZE_MAX;
+}
+
+// First free block in [first, end), outside the reserved range
+static size_t allocate_range(block_store_t *const bs, const size_t first, const size_t end)
+{
+    if (bs->extents != NULL) {
+        size_t id = extent_index_next_free(bs->extents, first);
+        if (id >= end) return SIZE_MAX;
+        bitmap_set_inline(bs->bitmap, id);
+        extents_claim(bs, id, 1);
+        return id;
+    }
+
+    // iterate through block store, with i as the id
+    size_t reserved_end = BITMAP_START_BLOCK + reserved_blocks(bs->num_blocks);
+    for (size_t i = first; i < end; ++i) {
+        // Check if the current block is within the reserved range and skip it if so
+        if (i >= BITMAP_START_BLOCK && i < reserved_end) {
+            i = reserved_end - 1;
+            continue;
+        }
+        // Check if the current block is free        
+        if (bitmap_test_inline(bs->bitmap, i) == false) {
+            // If free, set and return the ID
+            bitmap_set_inline(bs->bitmap, i);
+            return i;
+        }
+    }
+
+    //return SIZE_MAX in no availible/free block
+    return SIZE_MAX;
+}
+
+/*
+ * @function block_store_request
+ * @brief Attempts to allocate a specific block by its ID.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The ID of the block to allocate.
+ * @return True if the block was successfully allocated, False otherwise.
+*/
+bool block_store_request(block_store_t *const bs, const size_t block_id)
+{
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only || block_id >= bs->num_blocks) return false;
+
+    uint64_t start = stats_begin();
+    store_lock_write(bs);
+    bool was_free;
+    if (bs->to_phys != NULL) {
+        // A free logical id can keep its data anywhere, in the block of the same id if that's free
+        was_free = bs->to_phys[block_id] == SIZE_MAX;
+        if (was_free) {
+            size_t block = block_id;
+            if (bitmap_test_inline(bs->bitmap, block)) {
+                block = place_locked(bs);
+            } else {
+                bitmap_set_inline(bs->bitmap, block);
+                extents_claim(bs, block, 1);
+            }
+            was_free = map_claim(bs, block, 1, block_id) != SIZE_MAX;
+        }
+    } else {
+        was_free = !bitmap_test_inline(bs->bitmap, block_id); // Check if the block is free
+        if (was_free) {
+            bitmap_set_inline(bs->bitmap, block_id); // Mark it as used
+            extents_claim(bs, block_id, 1);
+            buddy_claim(bs, block_id, 1);
+        }
+    }
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_REQUEST, start);
+
+    return was_free; // False if the block was already in use
+}
+
+/*
+ * @function block_store_release
+ * @brief Frees a specified block by marking it as available for use.
+ *  On a refcounted store this drops one owner and frees the block with the last.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The ID of the block to be released.
+*/
+void block_store_release(block_store_t *const bs, const size_t block_id) 
+{
+    // Check if bs is valid and the provided block_id is within valid range
+    if (bs != NULL && bs->bitmap != NULL && !bs->read_only && block_id < bs->num_blocks) {
+        uint64_t start = stats_begin();
+        store_lock_write(bs);
+        release_locked(bs, block_id);
+        store_unlock(bs);
+        stats_end(bs, BLOCK_STORE_STAT_RELEASE, start);
+    }
+}
+
+/*
+ * @function block_store_ref
+ * @brief Adds an owner to a block in use, so that it takes one more release to free it.
+ * @param bs A pointer to the block_store structure, created with BLOCK_STORE_OPT_REFCOUNT.
+ * @param block_id The block to share.
+ * @return True if the owner was added, False if the block is free, the count is at
+ *  its limit or the store has no refcounts.
+*/
+bool block_store_ref(block_store_t *const bs, const size_t block_id)
+{
+    if (bs == NULL || bs->refs == NULL || bs->read_only || block_id >= bs->num_blocks) return false;
+
+    store_lock_write(bs);
+    size_t block = physical_id(bs, block_id);
+    bool ok = block != SIZE_MAX && bitmap_test_inline(bs->bitmap, block) && bs->refs[block] < UINT16_MAX;
+    if (ok) ++bs->refs[block];
+    store_unlock(bs);
+    return ok;
+}
+
+/*
+ * @function block_store_unref
+ * @brief Drops an owner of a block, freeing the block when it was the last.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The block to let go of.
+ * @return The owners left (0 once the block is free), or SIZE_MAX if the block was already free.
+*/
+size_t block_store_unref(block_store_t *const bs, const size_t block_id)
+{
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only || block_id >= bs->num_blocks) return SIZE_MAX;
+
+    uint64_t start = stats_begin();
+    store_lock_write(bs);
+    size_t left = release_locked(bs, block_id) ? owners_locked(bs, block_id) : SIZE_MAX;
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_RELEASE, start);
+    return left;
+}
+
+/*
+ * @function block_store_get_refs
+ * @brief Counts a block's owners.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The block.
+ * @return The owners (0 if the block is free), or SIZE_MAX on error.
+*/
+size_t block_store_get_refs(const block_store_t *const bs, const size_t block_id)
+{
+    if (bs == NULL || bs->bitmap == NULL || block_id >= bs->num_blocks) return SIZE_MAX;
+
+    store_lock_read(bs);
+    size_t owners = owners_locked(bs, block_id);
+    store_unlock(bs);
+    return owners;
+}
+
+/*
+ * @function block_store_get_used_blocks
+ * @brief Counts the total number of used blocks in the block store.
+ * @param bs A pointer to the block_store structure.
+ * @return The total number of used blocks or SIZE_MAX on error.
+*/
+size_t block_store_get_used_blocks(const block_store_t *const bs)
+{
+    if (bs == NULL || bs->bitmap == NULL) return SIZE_MAX;
+
+    store_lock_read(bs);
+    size_t used = bitmap_total_set(bs->bitmap) + reserved_blocks(bs->num_blocks);
+    store_unlock(bs);
+    return used;
+}
+
+/*
+ * @function block_store_get_free_blocks
+ * @brief Counts the total number of free blocks in the block store.
+ * @param bs A pointer to the block_store structure.
+ * @return The total number of free blocks or SIZE_MAX on error.
+*/
+size_t block_store_get_free_blocks(const block_store_t *const bs) 
+{
+    // Check if the provided block store pointer is valid
+    if (bs == NULL || bs->bitmap == NULL) {
+        return SIZE_MAX; // Return SIZE_MAX on error
+    }
+
+    // Get the total number of blocks in the bitmap
+    size_t total_blocks = bs->num_blocks;
+
+    // Calculate the number of free blocks by subtracting the used blocks from the total blocks
+    size_t used_blocks = block_store_get_used_blocks(bs);
+    size_t free_blocks = total_blocks - used_blocks;
+
+    return free_blocks;
+}
+
+// Adds one free run to a block_store_free_space_t being filled in
+static void free_space_add(size_t start, size_t length, void *arg)
+{
+    (void)start;
+    block_store_free_space_t *info = (block_store_free_space_t *)arg;
+    unsigned bucket = 0;
+    while (bucket + 1 < BLOCK_STORE_RUN_BUCKETS && (length >> (bucket + 1)) != 0) ++bucket;
+
+    info->free_blocks += length;
+    info->runs += 1;
+    info->runs_by_length[bucket] += 1;
+    if (length > info->largest_run) info->largest_run = length;
+}
+
+static bool free_space_visit(size_t start, size_t length, void *arg)
+{
+    free_space_add(start, length, arg);
+    return true;
+}
+
+/*
+ * @function block_store_get_free_space_info
+ * @brief Describes how free space is laid out. Walks the free-extent index, which is kept up
+ *  to date as blocks come and go, so the cost is in the number of runs rather than blocks;
+ *  falls back to scanning the bitmap if the index couldn't be allocated.
+ * @param bs A pointer to the block_store structure.
+ * @param out Where to put the description.
+ * @return False if bs or out is NULL.
+*/
+bool block_store_get_free_space_info(const block_store_t *const bs, block_store_free_space_t *const out)
+{
+    if (bs == NULL || bs->bitmap == NULL || out == NULL) return false;
+
+    memset(out, 0, sizeof(*out));
+    store_lock_read(bs);
+    if (bs->extents != NULL) {
+        extent_index_for_each(bs->extents, free_space_add, out);
+    } else {
+        free_runs_scan(bs, free_space_visit, out);
+    }
+    store_unlock(bs);
+
+    if (out->free_blocks > 0) out->fragmentation = 1.0 - (double)out->largest_run / (double)out->free_blocks;
+    return true;
+}
+
+/*
+ * @function block_store_get_total_blocks
+ * @return The total number of blocks available in the block store.
+*/
+size_t block_store_get_total_blocks()
+{
+    return BLOCK_STORE_NUM_BLOCKS;
+}
+
+/*
+ * @function block_store_get_block_count
+ * @param bs A pointer to the block_store structure.
+ * @return The number of blocks in this block store, or SIZE_MAX on error.
+*/
+size_t block_store_get_block_count(const block_store_t *const bs)
+{
+    return bs != NULL ? bs->num_blocks : SIZE_MAX;
+}
+
+/*
+ * @function block_store_read
+ * @brief Reads data from a specified block into a buffer.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The ID of the block to read from.
+ * @param buffer The buffer the data should be read into.
+ * @return The number of bytes read or 0 on error.
+*/
+size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer) 
+{
+    if (bs == NULL || buffer == NULL || block_id >= bs->num_blocks) return 0;
+
+    uint64_t start = stats_begin();
+    store_lock_read(bs);
+    // A logical id that isn't in use has no block and reads as zeros
+    size_t block = physical_id(bs, block_id);
+    bool ok = block == SIZE_MAX || block_store_fault_in(bs, block);
+    // Copy data from the specified block into the buffer
+    if (ok) memcpy(buffer, block != SIZE_MAX ? block_data(bs, block) : zero_chunk, BLOCK_SIZE_BYTES);
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_READ, start);
+    return ok ? BLOCK_SIZE_BYTES : 0;
+}
+
+/*
+ * @function block_store_write
+ * @brief Writes data from a buffer to a specified block.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id The ID of the block to write to.
+ * @param buffer The buffer containing the data to be written.
+ * @return The number of bytes written or 0 on error.
+*/
+size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer) 
+{
+    if (bs == NULL || buffer == NULL || bs->read_only || block_id >= bs->num_blocks) return 0;
+
+    uint64_t start = stats_begin();
+    store_lock_write(bs);
+    size_t written = write_locked(bs, block_id, buffer);
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_WRITE, start);
+    return written;
+}
+
+// The body of block_store_write, with the store locked for writing
+static size_t write_locked(block_store_t *const bs, const size_t block_id, const void *buffer)
+{
+    // Remapped stores only have somewhere to put the data of logical ids in use
+    size_t target = physical_id(bs, block_id);
+    if (target == SIZE_MAX) return 0;
+
+    // Load the rest of the chunk first so it isn't clobbered when it's faulted in later
+    if (!block_store_fault_in(bs, target)) return 0;
+
+    if (bs->dedup != NULL) return dedup_write(bs->dedup, target, buffer) ? BLOCK_SIZE_BYTES : 0;
+
+    // Copy data from the buffer to the specified block, unsharing it from any snapshot
+    uint8_t *block = block_data_for_write(bs, target);
+    if (block == NULL) return 0;
+    memcpy(block, buffer, BLOCK_SIZE_BYTES);
+    return BLOCK_SIZE_BYTES;
+}
+
+/*
+ * @struct block_store_txn
+ * @brief Changes collected for one commit. Allocations are claimed in the store right away
+ *  so their ids can be used; releases and writes wait for the commit.
+*/
+typedef struct txn_write 
+{
+    size_t block_id;
+    uint8_t data[BLOCK_SIZE_BYTES];
+} txn_write_t;
+
+struct block_store_txn 
+{
+    block_store_t *bs;
+    size_t *claimed;    // Blocks allocated by this transaction, freed again on abort
+    size_t claimed_count, claimed_cap;
+    size_t *released;   // Blocks to release on commit
+    size_t released_count, released_cap;
+    txn_write_t *writes; // Writes to apply on commit, in call order
+    size_t write_count, write_cap;
+    uint8_t *undo;      // What each write's block held before the commit, to put back if it fails
+};
+
+// Makes room for one more element at the end of a transaction array
+static void *txn_grow(void **array, size_t *count, size_t *cap, size_t elem_size)
+{
+    if (*count == *cap) {
+        size_t new_cap = *cap ? *cap * 2 : 8;
+        void *grown = realloc(*array, new_cap * elem_size);
+        if (grown == NULL) return NULL;
+        *array = grown;
+        *cap = new_cap;
+    }
+    return (uint8_t *)*array + (*count)++ * elem_size;
+}
+
+/*
+ * @function block_store_txn_begin
+ * @brief Starts collecting a batch of allocations, releases and writes.
+ * @param bs A pointer to the block_store structure.
+ * @return The transaction, or NULL on failure.
+*/
+block_store_txn_t *block_store_txn_begin(block_store_t *const bs)
+{
+    if (bs == NULL || bs->bitmap == NULL || bs->read_only) return NULL;
+
+    block_store_txn_t *txn = (block_store_txn_t *)calloc(1, sizeof(block_store_txn_t));
+    if (txn != NULL) txn->bs = bs;
+    return txn;
+}
+
+/*
+ * @function block_store_txn_allocate
+ * @brief Claims a free block for the transaction, as block_store_allocate does.
+ *  The claim is visible immediately; aborting the transaction releases it again.
+ * @param txn The transaction.
+ * @return The claimed block's id, SIZE_MAX on error.
+*/
+size_t block_store_txn_allocate(block_store_txn_t *const txn)
+{
+    if (txn == NULL) return SIZE_MAX;
+
+    size_t *slot = (size_t *)txn_grow((void **)&txn->claimed, &txn->claimed_count, &txn->claimed_cap, sizeof(size_t));
+    if (slot == NULL) return SIZE_MAX;
+
+    store_lock_write(txn->bs);
+    size_t id = allocate_locked(txn->bs);
+    store_unlock(txn->bs);
+
+    if (id == SIZE_MAX) --txn->claimed_count;
+    else *slot = id;
+    return id;
+}
+
+/*
+ * @function block_store_txn_release
+ * @brief Queues a block to be released when the transaction commits.
+ * @param txn The transaction.
+ * @param block_id The block to release.
+ * @return True if the release was queued, False on error or if it already was.
+*/
+bool block_store_txn_release(block_store_txn_t *const txn, const size_t block_id)
+{
+    if (txn == NULL || block_id >= txn->bs->num_blocks) return false;
+    for (size_t i = 0; i < txn->released_count; ++i) {
+        if (txn->released[i] == block_id) return false;
+    }
+
+    size_t *slot = (size_t *)txn_grow((void **)&txn->released, &txn->released_count, &txn->released_cap, sizeof(size_t));
+    if (slot == NULL) return false;
+    *slot = block_id;
+    return true;
+}
+
+/*
+ * @function block_store_txn_write
+ * @brief Queues a block write, copying the data now, to be applied when the transaction commits.
+ * @param txn The transaction.
+ * @param block_id The block to write.
+ * @param buffer BLOCK_SIZE_BYTES of data.
+ * @return The number of bytes queued or 0 on error.
+*/
+size_t block_store_txn_write(block_store_txn_t *const txn, const size_t block_id, const void *buffer)
+{
+    if (txn == NULL || buffer == NULL || block_id >= txn->bs->num_blocks) return 0;
+
+    txn_write_t *write = (txn_write_t *)txn_grow((void **)&txn->writes, &txn->write_count, &txn->write_cap, sizeof(txn_write_t));
+    if (write == NULL) return 0;
+    write->block_id = block_id;
+    memcpy(write->data, buffer, BLOCK_SIZE_BYTES);
+    return BLOCK_SIZE_BYTES;
+}
+
+/*
+ * @function txn_prepare
+ * @brief The validation pass of a commit: everything that can fail before the store changes.
+ *  Released blocks must be in use, and every written chunk is loaded and unshared from
+ *  snapshots up front. Dedup and file-backed stores can still fail while applying (out of
+ *  memory, I/O error), so the current contents of every written block are copied into
+ *  txn->undo for the commit to put back.
+ * @return True if the transaction can be applied.
+*/
+static bool txn_prepare(block_store_txn_t *const txn)
+{
+    block_store_t *bs = txn->bs;
+    for (size_t i = 0; i < txn->released_count; ++i) {
+        if (owners_locked(bs, txn->released[i]) == 0) return false;
+    }
+    if (txn->write_count == 0) return true;
+
+    txn->undo = (uint8_t *)malloc(txn->write_count * BLOCK_SIZE_BYTES);
+    if (txn->undo == NULL) return false;
+    for (size_t i = 0; i < txn->write_count; ++i) {
+        size_t block_id = physical_id(bs, txn->writes[i].block_id);
+        if (block_id == SIZE_MAX || !block_store_fault_in(bs, block_id)) return false;
+        memcpy(txn->undo + (i * BLOCK_SIZE_BYTES), block_data(bs, block_id), BLOCK_SIZE_BYTES);
+        if (bs->chunks != NULL && block_data_for_write(bs, block_id) == NULL) return false;
+    }
+    return true;
+}
+
+/*
+ * @function block_store_txn_commit
+ * @brief Applies a transaction's writes and then its releases under a single lock acquisition,
+ *  so readers see either none or all of them. The transaction is freed either way.
+ * @param txn The transaction.
+ * @return True if the transaction was applied, False if it failed validation or an I/O or
+ *  allocation failure stopped a write. Either way nothing was applied, and it was aborted.
+*/
+bool block_store_txn_commit(block_store_txn_t *const txn)
+{
+    if (txn == NULL) return false;
+    block_store_t *bs = txn->bs;
+
+    store_lock_write(bs);
+    bool ok = txn_prepare(txn);
+    size_t applied = 0;
+    while (ok && applied < txn->write_count) {
+        ok = write_locked(bs, txn->writes[applied].block_id, txn->writes[applied].data) == BLOCK_SIZE_BYTES;
+        if (ok) ++applied;
+    }
+    if (ok) {
+        // Checked by txn_prepare: every release finds its block in use, and none is queued twice
+        for (size_t i = 0; i < txn->released_count; ++i) release_locked(bs, txn->released[i]);
+        txn->claimed_count = 0; // The claimed blocks are the store's now
+    } else {
+        // Newest first, so a block written twice ends up with what it held before the commit.
+        // Their chunks were just written, so they're in memory and unshared (a file-backed
+        // store keeps a frame whose write-back failed); only a dedup store may need memory here.
+        while (applied > 0) {
+            --applied;
+            write_locked(bs, txn->writes[applied].block_id, txn->undo + (applied * BLOCK_SIZE_BYTES));
+        }
+    }
+    store_unlock(bs);
+
+    // Whatever stopped it, the store is back as it was apart from the transaction's claims
+    block_store_txn_abort(txn);
+    return ok;
+}
+
+/*
+ * @function block_store_txn_abort
+ * @brief Drops a transaction, releasing the blocks it claimed. Nothing else was applied.
+ * @param txn The transaction.
+*/
+void block_store_txn_abort(block_store_txn_t *const txn)
+{
+    if (txn == NULL) return;
+
+    if (txn->claimed_count != 0) {
+        store_lock_write(txn->bs);
+        for (size_t i = 0; i < txn->claimed_count; ++i) {
+            size_t block = physical_id(txn->bs, txn->claimed[i]);
+            bitmap_reset_inline(txn->bs->bitmap, block);
+            extents_free(txn->bs, block);
+            if (txn->bs->refs != NULL) txn->bs->refs[block] = 0;
+            map_release(txn->bs, block);
+        }
+        store_unlock(txn->bs);
+    }
+    free(txn->claimed);
+    free(txn->released);
+    free(txn->writes);
+    free(txn->undo);
+    free(txn);
+}
+
+/*
+ * @function mark_written_blocks
+ * @brief Rebuilds the allocation map (and free-extent index) of a freshly loaded raw image:
+ *  a block with any non-zero byte is in use.
+ * @param bs The block store, with its data loaded and its bitmap still clear.
+*/
+static void mark_written_blocks(block_store_t *const bs)
+{
+    for (size_t block_id = 0; block_id < bs->num_blocks; ++block_id) {
+        const uint8_t *data = block_data(bs, block_id);
+        
+        bool is_allocated = false;
+        for (size_t byte_index = 0; byte_index < BLOCK_SIZE_BYTES; ++byte_index) {
+            if (data[byte_index] != 0) {
+                is_allocated = true;    // Mark block as used.
+                break;  // Only need one non-zero byte to mark as used.
+            }
+        }
+
+        // If the block is allocated, set its bit in the bitmap
+        if (is_allocated) bitmap_set_inline(bs->bitmap, block_id);
+    }
+    extents_rebuild(bs);
+}
+
+/*
+ * @function block_store_deserialize
+ * @brief Deserializes a block store from a file into memory.
+ * @param filename The path to the file containing the serialized block store data.
+ * @return A pointer to the deserialized block store structure, or NULL on failure.
+*/
+block_store_t *block_store_deserialize(const char *const filename) 
+{
+    return block_store_deserialize_ex(filename, 0);
+}
+
+/*
+ * @function block_store_deserialize_ex
+ * @brief Deserializes a block store from a file, optionally bypassing the page cache.
+ * @param filename The path to the file containing the serialized block store data.
+ * @param io_flags BLOCK_STORE_IO_* flags.
+ * @return A pointer to the deserialized block store structure, or NULL on failure.
+*/
+block_store_t *block_store_deserialize_ex(const char *const filename, const unsigned io_flags)
+{
+    if (!filename) return NULL;
+    uint64_t start = stats_begin();
+
+    // Open the file in read-only mode.
+    bool direct;
+    int fd = open_image(filename, O_RDONLY, io_flags, &direct);
+    if (fd == -1) return NULL;
+
+    // The image is the raw data, so its size gives the block count (in whole chunks).
+    struct stat st;
+    block_store_options_t options = {0};
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= BLOCK_STORE_NUM_BYTES) {
+        options.num_blocks = (size_t)st.st_size / BS_CHUNK_BYTES * BS_CHUNK_BLOCKS;
+    }
+
+    // Allocate and zero-initialize a block store structure and its bitmap.
+    block_store_t *bs = options.num_blocks != 0 ? block_store_create_ex(&options) : NULL;
+    if (!bs) {
+        close(fd);
+        return NULL;
+    }
+
+    // Read block store data from the file.
+    bool ok = true;
+    if (direct) {
+        ok = direct_pread(fd, bs);
+    } else {
+        for (size_t i = 0; ok && i < bs->num_chunks; ++i) {
+            ok = read_full(fd, bs->chunks[i]->bytes, BS_CHUNK_BYTES);
+        }
+    }
+    if (!ok) {
+        block_store_destroy(bs);
+        close(fd);
+        return NULL;
+    }
+
+    mark_written_blocks(bs);
+    close(fd);
+    stats_end(bs, BLOCK_STORE_STAT_DESERIALIZE, start);
+    return bs;
+}
+
+/*
+ * @function block_store_serialize
+ * @brief Serializes a block store to a file.
+ * @param bs A pointer to the block_store structure to serialize.
+ * @param filename The path to the file where the block store data will be written.
+ * @return The number of bytes written to the file, or 0 on failure.
+*/
+size_t block_store_serialize(const block_store_t *const bs, const char *const filename) 
+{
+    return block_store_serialize_ex(bs, filename, 0);
+}
+
+/*
+ * @function block_store_serialize_ex
+ * @brief Serializes a block store to a file, optionally bypassing the page cache.
+ * @param bs A pointer to the block_store structure to serialize.
+ * @param filename The path to the file where the block store data will be written.
+ * @param io_flags BLOCK_STORE_IO_* flags.
+ * @return The number of bytes written to the file, or 0 on failure.
+*/
+size_t block_store_serialize_ex(const block_store_t *const bs, const char *const filename, const unsigned io_flags)
+{
+    if (!bs || !filename) return 0;
+
+    // Open or create the file for writing, truncating it if it already exists.
+    // File permissions set to read and write for owner.
+    uint64_t start = stats_begin();
+    bool direct;
+    int fd = open_image(filename, O_WRONLY | O_CREAT | O_TRUNC, io_flags, &direct);
+    if (fd == -1) return 0;
+
+    // Attempt to write the entire block store data to file.
+    bool ok = true;
+    store_lock_read(bs);
+    if (direct) {
+        ok = direct_pwrite(fd, bs);
+    } else {
+        // Chunks are loaded one at a time, so lazy and file-backed stores stream through
+        uint8_t scratch[BS_CHUNK_BYTES];
+        for (size_t i = 0; ok && i < bs->num_chunks; ++i) {
+            const uint8_t *data = chunk_data(bs, i, scratch);
+            ok = data != NULL && write_full(fd, data, BS_CHUNK_BYTES);
+        }
+    }
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_SERIALIZE, start);
+    if (!ok) {
+        close(fd);
+        return 0;
+    }
+
+    close(fd);
+    return bs->num_blocks * BLOCK_SIZE_BYTES;
+}
+
+/*
+ * Compressed image layout, all fields in host byte order:
+ *  packed_header_t
+ *  allocation bitmap (num_blocks / 8 bytes)
+ *  chunk directory: one uint32_t file offset per chunk, 0 for a chunk with no data
+ *  chunk records, in chunk order
+ * A chunk record is a packed_chunk_t, then run_count run lengths (one byte each) that
+ *  alternate zero run / data run starting with a zero run, then the data runs
+ *  concatenated and LZ compressed (stored raw when that doesn't shrink them).
+ * Free blocks are written as zeros, so their contents don't survive the round trip.
+*/
+#define PACKED_MAGIC 0x315A5342u  // "BSZ1"
+#define PACKED_VERSION 1
+#define PACKED_RAW 0
+#define PACKED_LZ 1
+#define PACKED_MAX_RUNS (BS_CHUNK_BLOCKS + 1)
+
+typedef struct packed_header 
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_size;
+    uint32_t num_blocks;
+    uint32_t chunk_blocks;
+} packed_header_t;
+
+typedef struct packed_chunk 
+{
+    uint32_t payload_bytes;  // Bytes following the run table
+    uint16_t data_blocks;    // Blocks covered by the data runs
+    uint8_t encoding;        // PACKED_RAW or PACKED_LZ
+    uint8_t run_count;       // Entries in the run table
+} packed_chunk_t;
+
+static inline size_t packed_directory_offset(const size_t num_blocks)
+{
+    return sizeof(packed_header_t) + num_blocks / 8;
+}
+
+static inline size_t packed_records_offset(const size_t num_blocks)
+{
+    return packed_directory_offset(num_blocks) + (num_blocks / BS_CHUNK_BLOCKS) * sizeof(uint32_t);
+}
+
+// Reads the header of a compressed image and checks it describes a store this build can hold
+static bool packed_read_header(int fd, packed_header_t *header)
+{
+    return read_full(fd, header, sizeof(*header))
+        && header->magic == PACKED_MAGIC
+        && header->version == PACKED_VERSION
+        && header->block_size == BLOCK_SIZE_BYTES
+        && header->chunk_blocks == BS_CHUNK_BLOCKS
+        && valid_geometry(header->num_blocks);
+}
+
+static bool block_is_zero(const uint8_t *block)
+{
+    for (size_t i = 0; i < BLOCK_SIZE_BYTES; ++i) {
+        if (block[i] != 0) return false;
+    }
+    return true;
+}
+
+/*
+ * @function packed_encode_chunk
+ * @brief Encodes one chunk into a record: run table plus compressed data runs.
+ * @param bs The block store.
+ * @param chunk The chunk index.
+ * @param gather Scratch buffer of BS_CHUNK_BYTES for the concatenated data runs.
+ * @param out Output buffer, large enough for the worst case record.
+ * @return Size of the record in bytes, 0 if the chunk holds no data.
+*/
+static size_t packed_encode_chunk(const block_store_t *const bs, size_t chunk, uint8_t *gather, uint8_t *out)
+{
+    packed_chunk_t *rec = (packed_chunk_t *)out;
+    uint8_t *runs = out + sizeof(packed_chunk_t);
+    size_t run_count = 0, data_blocks = 0;
+    size_t run_len = 0;
+    bool in_data = false;
+
+    size_t first = chunk * BS_CHUNK_BLOCKS;
+    size_t last = first + BS_CHUNK_BLOCKS;
+    if (last > bs->num_blocks) last = bs->num_blocks;
+
+    for (size_t id = first; id < last; ++id) {
+        size_t where = physical_id(bs, id);
+        const uint8_t *block = where != SIZE_MAX ? block_data(bs, where) : zero_chunk;
+        bool is_data = where != SIZE_MAX && bitmap_test_inline(bs->bitmap, where) && !block_is_zero(block);
+
+        // Close the current run when the block kind changes
+        if (is_data != in_data) {
+            runs[run_count++] = (uint8_t)run_len;
+            run_len = 0;
+            in_data = is_data;
+        }
+        if (is_data) {
+            memcpy(gather + (data_blocks * BLOCK_SIZE_BYTES), block, BLOCK_SIZE_BYTES);
+            ++data_blocks;
+        }
+        ++run_len;
+    }
+    if (data_blocks == 0) return 0;
+
+    // A trailing zero run is implied by the chunk size
+    if (in_data) runs[run_count++] = (uint8_t)run_len;
+
+    size_t raw_bytes = data_blocks * BLOCK_SIZE_BYTES;
+    uint8_t *payload = runs + run_count;
+    size_t payload_bytes = lz_compress(gather, raw_bytes, payload, lz_compress_bound(BS_CHUNK_BYTES));
+
+    rec->encoding = PACKED_LZ;
+    if (payload_bytes == 0 || payload_bytes >= raw_bytes) {
+        memcpy(payload, gather, raw_bytes);
+        payload_bytes = raw_bytes;
+        rec->encoding = PACKED_RAW;
+    }
+    rec->payload_bytes = (uint32_t)payload_bytes;
+    rec->data_blocks = (uint16_t)data_blocks;
+    rec->run_count = (uint8_t)run_count;
+
+    return sizeof(packed_chunk_t) + run_count + payload_bytes;
+}
+
+/*
+ * @function packed_decode_chunk
+ * @brief Reads a chunk record from fd and expands it into the chunk's blocks.
+ * @param fd The image file.
+ * @param offset File offset of the record.
+ * @param dest First byte of the chunk in the destination store.
+ * @param chunk_blocks Number of blocks in this chunk.
+ * @param gather Scratch buffer of BS_CHUNK_BYTES.
+ * @param payload Scratch buffer of lz_compress_bound(BS_CHUNK_BYTES) bytes.
+ * @return Size of the record in bytes, 0 on a malformed or short record.
+*/
+static size_t packed_decode_chunk(int fd, off_t offset, uint8_t *dest, size_t chunk_blocks, uint8_t *gather, uint8_t *payload)
+{
+    packed_chunk_t rec;
+    uint8_t runs[PACKED_MAX_RUNS];
+
+    if (!pread_full(fd, &rec, sizeof(rec), offset)) return 0;
+    offset += sizeof(rec);
+
+    size_t raw_bytes = (size_t)rec.data_blocks * BLOCK_SIZE_BYTES;
+    if (rec.data_blocks == 0 || rec.data_blocks > chunk_blocks || rec.run_count > PACKED_MAX_RUNS) return 0;
+    if (rec.payload_bytes > lz_compress_bound(BS_CHUNK_BYTES)) return 0;
+    if (rec.encoding == PACKED_RAW && rec.payload_bytes != raw_bytes) return 0;
+    if (rec.encoding != PACKED_RAW && rec.encoding != PACKED_LZ) return 0;
+
+    if (!pread_full(fd, runs, rec.run_count, offset)
+        || !pread_full(fd, payload, rec.payload_bytes, offset + rec.run_count)) return 0;
+
+    const uint8_t *src = payload;
+    if (rec.encoding == PACKED_LZ) {
+        if (lz_decompress(payload, rec.payload_bytes, gather, raw_bytes) != raw_bytes) return 0;
+        src = gather;
+    }
+
+    // Scatter the data runs back into place, zero runs are already zero
+    size_t block = 0, copied = 0;
+    for (size_t r = 0; r < rec.run_count; ++r) {
+        size_t len = runs[r];
+        if (block + len > chunk_blocks) return 0;
+        if (r & 1) {
+            if (copied + len > rec.data_blocks) return 0;
+            memcpy(dest + (block * BLOCK_SIZE_BYTES), src + (copied * BLOCK_SIZE_BYTES), len * BLOCK_SIZE_BYTES);
+            copied += len;
+        }
+        block += len;
+    }
+    if (copied != rec.data_blocks) return 0;
+
+    return sizeof(rec) + rec.run_count + rec.payload_bytes;
+}
+
+/*
+ * @function block_store_serialize_compressed
+ * @brief Writes the block store to a compressed image file.
+ * @param bs A pointer to the block_store structure to serialize.
+ * @param filename The path to the file to write, truncated if it exists.
+ * @return The size of the image in bytes, or 0 on failure.
+*/
+size_t block_store_serialize_compressed(const block_store_t *const bs, const char *const filename)
+{
+    if (!bs || !filename || bs->num_blocks > UINT32_MAX) return 0;
+
+    uint64_t start = stats_begin();
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (fd == -1) return 0;
+
+    size_t directory_bytes = bs->num_chunks * sizeof(uint32_t);
+    uint8_t *gather = malloc(BS_CHUNK_BYTES);
+    uint8_t *out = malloc(sizeof(packed_chunk_t) + PACKED_MAX_RUNS + lz_compress_bound(BS_CHUNK_BYTES));
+    uint32_t *directory = calloc(bs->num_chunks, sizeof(uint32_t));
+    packed_header_t header = {PACKED_MAGIC, PACKED_VERSION, BLOCK_SIZE_BYTES, (uint32_t)bs->num_blocks, BS_CHUNK_BLOCKS};
+
+    store_lock_read(bs);
+    // Remapped stores record which logical ids are in use, to match the records
+    bitmap_t *logical = bs->to_phys != NULL ? bitmap_create(bs->num_blocks) : NULL;
+    for (size_t id = 0; logical != NULL && id < bs->num_blocks; ++id) {
+        if (owners_locked(bs, id) != 0) bitmap_set_inline(logical, id);
+    }
+    bool ok = gather && out && directory && (logical != NULL || bs->to_phys == NULL)
+        && write_full(fd, &header, sizeof(header))
+        && write_full(fd, bitmap_export(logical != NULL ? logical : bs->bitmap), bs->num_blocks / 8)
+        && write_full(fd, directory, directory_bytes);
+    bitmap_destroy(logical);
+
+    // Records go out one chunk at a time; the directory is patched in afterwards
+    size_t offset = packed_records_offset(bs->num_blocks);
+    for (size_t chunk = 0; ok && chunk < bs->num_chunks; ++chunk) {
+        if (!block_store_fault_in(bs, chunk * BS_CHUNK_BLOCKS)) {
+            ok = false;
+            break;
+        }
+
+        size_t len = packed_encode_chunk(bs, chunk, gather, out);
+        if (len == 0) continue;
+
+        // Directory entries are 32-bit offsets
+        ok = offset <= UINT32_MAX && write_full(fd, out, len);
+        directory[chunk] = (uint32_t)offset;
+        offset += len;
+    }
+    store_unlock(bs);
+
+    ok = ok && pwrite_full(fd, directory, directory_bytes, (off_t)packed_directory_offset(bs->num_blocks));
+    stats_end(bs, BLOCK_STORE_STAT_SERIALIZE, start);
+
+    free(directory);
+    free(out);
+    free(gather);
+    close(fd);
+    return ok ? offset : 0;
+}
+
+/*
+ * @function block_store_deserialize_compressed
+ * @brief Loads a block store from a compressed image file, one chunk at a time.
+ * @param filename The path to the image written by block_store_serialize_compressed.
+ * @return A pointer to the loaded block store, or NULL on failure.
+*/
+block_store_t *block_store_deserialize_compressed(const char *const filename)
+{
+    if (!filename) return NULL;
+    uint64_t start = stats_begin();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    packed_header_t header;
+    if (!packed_read_header(fd, &header)) {
+        close(fd);
+        return NULL;
+    }
+
+    block_store_options_t options = {0};
+    options.num_blocks = header.num_blocks;
+    block_store_t *bs = block_store_create_ex(&options);
+    uint8_t *bitmap_data = malloc(header.num_blocks / 8);
+    uint32_t *directory = malloc((header.num_blocks / BS_CHUNK_BLOCKS) * sizeof(uint32_t));
+    uint8_t *gather = malloc(BS_CHUNK_BYTES);
+    uint8_t *payload = malloc(lz_compress_bound(BS_CHUNK_BYTES));
+
+    bool ok = bs && bitmap_data && directory && gather && payload
+        && read_full(fd, bitmap_data, header.num_blocks / 8)
+        && read_full(fd, directory, bs->num_chunks * sizeof(uint32_t));
+    if (ok) {
+        bitmap_destroy(bs->bitmap);
+        bs->bitmap = bitmap_import(bs->num_blocks, bitmap_data);
+        ok = bs->bitmap != NULL;
+        if (ok) extents_rebuild(bs);
+    }
+
+    // Records are stored in chunk order, so this is a single sequential pass
+    size_t offset = ok ? packed_records_offset(bs->num_blocks) : 0;
+    for (size_t chunk = 0; ok && chunk < bs->num_chunks; ++chunk) {
+        if (directory[chunk] == 0) continue;
+        if (directory[chunk] != offset) {
+            ok = false;
+            break;
+        }
+
+        size_t first = chunk * BS_CHUNK_BLOCKS;
+        size_t count = bs->num_blocks - first < BS_CHUNK_BLOCKS ? bs->num_blocks - first : BS_CHUNK_BLOCKS;
+        size_t len = packed_decode_chunk(fd, offset, bs->chunks[chunk]->bytes, count, gather, payload);
+        ok = len != 0;
+        offset += len;
+    }
+
+    free(payload);
+    free(gather);
+    free(directory);
+    free(bitmap_data);
+    close(fd);
+
+    if (!ok) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+    stats_end(bs, BLOCK_STORE_STAT_DESERIALIZE, start);
+    return bs;
+}
+
+/*
+ * @function block_store_fault_in
+ * @brief Makes sure the chunk holding block_id has been loaded from the backing image or file.
+ *  The store is logically const here: loading a chunk doesn't change what a read returns.
+ *  Lazily opened stores are sparse, so the chunk's memory is allocated here too.
+ * @param bs A pointer to the block_store structure.
+ * @param block_id Any block in the chunk.
+ * @return True if the block's data is in memory, False on an I/O or format error.
+*/
+static bool block_store_fault_in(const block_store_t *const bs, const size_t block_id)
+{
+    // File-backed stores read the chunk into a cache frame, possibly evicting another
+    if (bs->cache != NULL) return block_cache_get(bs->cache, block_id / BS_CHUNK_BLOCKS, false) != NULL;
+
+    // Everything is already in memory unless the store was opened lazily
+    if (bs->resident == NULL) return true;
+
+    size_t chunk = block_id / BS_CHUNK_BLOCKS;
+    if (bitmap_test_inline(bs->resident, chunk)) return true;
+
+    size_t first = chunk * BS_CHUNK_BLOCKS;
+    size_t count = bs->num_blocks - first < BS_CHUNK_BLOCKS ? bs->num_blocks - first : BS_CHUNK_BLOCKS;
+    uint8_t *gather = bs->scratch;
+    uint8_t *payload = bs->scratch + BS_CHUNK_BYTES;
+
+    bs_chunk_t *loaded = (bs_chunk_t *)calloc(1, sizeof(bs_chunk_t));
+    if (loaded == NULL) return false;
+    if (packed_decode_chunk(bs->image_fd, bs->directory[chunk], loaded->bytes, count, gather, payload) == 0) {
+        free(loaded);
+        return false;
+    }
+    atomic_init(&loaded->refs, 1);
+    bs->chunks[chunk] = loaded;
+    ++((block_store_t *)bs)->materialized;
+
+    bitmap_set_inline(bs->resident, chunk);
+    return true;
+}
+
+/*
+ * @function block_store_open_lazy
+ * @brief Opens a compressed image without loading any block data.
+ *  Only the header, allocation bitmap and chunk directory are read here; the store is sparse,
+ *  and each chunk is allocated and decoded the first time one of its blocks is read or
+ *  written. The file stays open until the store is destroyed.
+ * @param filename The path to the image written by block_store_serialize_compressed.
+ * @return A pointer to the block store, or NULL on failure.
+*/
+block_store_t *block_store_open_lazy(const char *const filename)
+{
+    if (!filename) return NULL;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    packed_header_t header;
+    if (!packed_read_header(fd, &header)) {
+        close(fd);
+        return NULL;
+    }
+
+    block_store_options_t options = {0};
+    options.num_blocks = header.num_blocks;
+    options.flags = BLOCK_STORE_OPT_SPARSE;
+    block_store_t *bs = block_store_create_ex(&options);
+    if (!bs) {
+        close(fd);
+        return NULL;
+    }
+
+    uint8_t *bitmap_data = malloc(bs->num_blocks / 8);
+    bs->image_fd = fd;
+    bs->directory = malloc(bs->num_chunks * sizeof(uint32_t));
+    bs->scratch = malloc(BS_CHUNK_BYTES + lz_compress_bound(BS_CHUNK_BYTES));
+    bs->resident = bitmap_create(bs->num_chunks);
+
+    bool ok = bitmap_data && bs->directory && bs->scratch && bs->resident
+        && read_full(fd, bitmap_data, bs->num_blocks / 8)
+        && read_full(fd, bs->directory, bs->num_chunks * sizeof(uint32_t));
+    if (ok) {
+        bitmap_destroy(bs->bitmap);
+        bs->bitmap = bitmap_import(bs->num_blocks, bitmap_data);
+        ok = bs->bitmap != NULL;
+        if (ok) extents_rebuild(bs);
+    }
+    free(bitmap_data);
+    if (!ok) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    // Chunks without a record are all zeros, which is what a sparse store's missing chunks read as
+    for (size_t chunk = 0; chunk < bs->num_chunks; ++chunk) {
+        if (bs->directory[chunk] == 0) bitmap_set_inline(bs->resident, chunk);
+    }
+
+    return bs;
+}
+
+/*
+ * Striped images are the raw image cut into stripes of whole chunks, dealt out to the
+ *  files in turn: stripe s goes to file s % file_count, after that file's earlier stripes.
+ *  Each file is serviced by its own thread.
+*/
+
+// Chunks moved per preadv/pwritev call
+#define STRIPE_IOV 64
+
+typedef struct stripe_job 
+{
+    block_store_t *bs;
+    int fd;
+    size_t file;            // This job's file, 0 to file_count - 1
+    size_t file_count;
+    size_t stripe_chunks;   // Chunks per stripe
+    bool writing;           // Store to file, else file to store
+    bool ok;
+} stripe_job_t;
+
+// Bytes of a striped image that land in one file
+static size_t stripe_file_bytes(const size_t num_chunks, const size_t stripe_chunks, const size_t file, const size_t file_count)
+{
+    size_t chunks = 0;
+    for (size_t first = file * stripe_chunks; first < num_chunks; first += file_count * stripe_chunks) {
+        chunks += num_chunks - first < stripe_chunks ? num_chunks - first : stripe_chunks;
+    }
+    return chunks * BS_CHUNK_BYTES;
+}
 
 /*
- * @struct block_store
- * @brief Structure representing a block storage system.
+ * @function stripe_transfer
+ * @brief Moves count whole chunks between memory and a file with one vectored call.
+ *  A short transfer is redone chunk by chunk.
+ * @return True if every chunk was transferred.
 */
-typedef struct block_store 
+static bool stripe_transfer(int fd, const struct iovec *iov, const int count, off_t offset, const bool writing)
 {
-    bitmap_t* bitmap;   // Bitmap to track used/free blocks
-    uint8_t data[BLOCK_STORE_NUM_BYTES];    // Storage for blocks
-} block_store_t;
+    ssize_t want = (ssize_t)count * BS_CHUNK_BYTES;
+    ssize_t done = writing ? pwritev(fd, iov, count, offset) : preadv(fd, iov, count, offset);
+    if (done == want) return true;
+    if (done < 0) return false;
 
+    bool ok = true;
+    for (int i = 0; ok && i < count; ++i, offset += BS_CHUNK_BYTES) {
+        ok = writing ? pwrite_full(fd, iov[i].iov_base, BS_CHUNK_BYTES, offset)
+                     : pread_full(fd, iov[i].iov_base, BS_CHUNK_BYTES, offset);
+    }
+    return ok;
+}
 
 /*
- * @function block_store_create
- * @brief Creates and initializes a block store structure.
- * @return A pointer to the newly created block_store structure on sucess, or NULL on failure.
+ * @function stripe_worker
+ * @brief Transfers every stripe of one file, in file order.
+ *  Stores without chunks in memory (dedup and file-backed) are gathered through a scratch
+ *  buffer, since chunk_data only hands out one file-backed chunk at a time.
+ * @param arg The stripe_job_t; its ok field is set to the outcome.
+ * @return NULL.
 */
-block_store_t *block_store_create()
+static void *stripe_worker(void *arg)
 {
-    //Allocate mem for block store struct and initialize all bits to zero
-    block_store_t *block = (block_store_t *)calloc(1, sizeof(block_store_t));
-
-    //Error check. Check that allocation worked
-    if (block != NULL) {
-        //Allocate and initilizae num of stored blocks in bitmap 
-        block->bitmap = bitmap_create(BLOCK_STORE_NUM_BLOCKS);
+    stripe_job_t *job = (stripe_job_t *)arg;
+    const block_store_t *bs = job->bs;
+    struct iovec iov[STRIPE_IOV];
+    bool gather = bs->chunks == NULL || bs->to_phys != NULL;
+    uint8_t *scratch = gather ? malloc((size_t)STRIPE_IOV * BS_CHUNK_BYTES) : NULL;
 
-        //Error check that bitmap created succesfully by checking if pointer == Null, else continue/skip 
-        if (block->bitmap == NULL) {
-            free(block); //free mem
-            return NULL; //null on error
+    job->ok = !gather || scratch != NULL;
+    off_t offset = 0;
+    for (size_t first = job->file * job->stripe_chunks; job->ok && first < bs->num_chunks;
+         first += job->file_count * job->stripe_chunks) {
+        size_t end = bs->num_chunks - first < job->stripe_chunks ? bs->num_chunks : first + job->stripe_chunks;
+        for (size_t chunk = first; job->ok && chunk < end; ) {
+            int count = end - chunk < STRIPE_IOV ? (int)(end - chunk) : STRIPE_IOV;
+            for (int i = 0; job->ok && i < count; ++i) {
+                uint8_t *data = NULL;
+                if (!job->writing) {
+                    data = bs->chunks[chunk + i]->bytes;
+                } else if (scratch == NULL) {
+                    data = (uint8_t *)chunk_data(bs, chunk + i, NULL);
+                } else {
+                    uint8_t *slot = scratch + (i * BS_CHUNK_BYTES);
+                    const uint8_t *loaded = chunk_data(bs, chunk + i, slot);
+                    if (loaded != NULL && loaded != slot) memcpy(slot, loaded, BS_CHUNK_BYTES);
+                    data = loaded != NULL ? slot : NULL;
+                }
+                iov[i].iov_base = data;
+                iov[i].iov_len = BS_CHUNK_BYTES;
+                job->ok = data != NULL;
+            }
+            job->ok = job->ok && stripe_transfer(job->fd, iov, count, offset, job->writing);
+            offset += (off_t)count * BS_CHUNK_BYTES;
+            chunk += (size_t)count;
         }
+    }
 
-        return block;
+    free(scratch);
+    return NULL;
+}
+
+/*
+ * @function stripe_run
+ * @brief Runs the jobs, one thread per file when parallel is set, else one after another.
+ *  A job whose thread can't be started runs on the calling thread instead.
+ * @return True if every job succeeded.
+*/
+static bool stripe_run(stripe_job_t *jobs, const size_t count, const bool parallel)
+{
+    pthread_t *threads = parallel ? malloc(count * sizeof(pthread_t)) : NULL;
+    bool *started = parallel ? calloc(count, sizeof(bool)) : NULL;
+    if (threads == NULL || started == NULL) {
+        free(threads);
+        free(started);
+        threads = NULL;
+        started = NULL;
     }
 
-    return NULL; //null on error
+    for (size_t i = 0; i < count; ++i) {
+        if (threads != NULL && pthread_create(&threads[i], NULL, stripe_worker, &jobs[i]) == 0) started[i] = true;
+        else stripe_worker(&jobs[i]);
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < count; ++i) {
+        if (started != NULL && started[i]) pthread_join(threads[i], NULL);
+        ok = ok && jobs[i].ok;
+    }
+    free(threads);
+    free(started);
+    return ok;
 }
 
 /*
- * @function block_store_destroy
- * @brief Deletes block store structure.
- * @param BS device.
+ * @function stripe_open
+ * @brief Opens every file of a striped image and sets up a job for each.
+ * @return The jobs, or NULL on failure (with every file closed again).
 */
-void block_store_destroy(block_store_t *const bs)
+static stripe_job_t *stripe_open(const char *const *filenames, const size_t file_count, const size_t stripe_blocks, int oflags)
 {
-    //Check if block store is not empty
-     if (bs != NULL) {
-        bitmap_destroy(bs->bitmap); //Free the bitmap for the given block
-        free(bs); //free mem
+    if (!filenames || file_count == 0 || stripe_blocks % BS_CHUNK_BLOCKS != 0) return NULL;
+
+    stripe_job_t *jobs = calloc(file_count, sizeof(stripe_job_t));
+    if (!jobs) return NULL;
+
+    bool ok = true;
+    for (size_t i = 0; i < file_count; ++i) {
+        jobs[i].fd = ok && filenames[i] != NULL ? open(filenames[i], oflags, S_IRUSR | S_IWUSR) : -1;
+        jobs[i].file = i;
+        jobs[i].file_count = file_count;
+        jobs[i].stripe_chunks = (stripe_blocks != 0 ? stripe_blocks : BS_CHUNK_BLOCKS) / BS_CHUNK_BLOCKS;
+        jobs[i].writing = (oflags & O_ACCMODE) != O_RDONLY;
+        ok = jobs[i].fd != -1;
+    }
+    if (!ok) {
+        for (size_t i = 0; i < file_count; ++i) {
+            if (jobs[i].fd != -1) close(jobs[i].fd);
+        }
+        free(jobs);
+        return NULL;
     }
+    return jobs;
+}
+
+static void stripe_close(stripe_job_t *jobs, const size_t file_count)
+{
+    for (size_t i = 0; i < file_count; ++i) close(jobs[i].fd);
+    free(jobs);
 }
 
 /*
- * @function block_store_allocate
- * @brief Searches for a free block, marks it as in use, and returns the block's id
- * @param BS device.
- * @return Allocated block's id, SIZE_MAX on error
+ * @function block_store_serialize_striped
+ * @brief Serializes a block store as a raw image striped over several files.
+ *  Plain, dedup and snapshot stores are written by one thread per file; file-backed and
+ *  lazily opened stores load chunks through shared state, so their files are written in turn.
+ * @param bs A pointer to the block_store structure to serialize.
+ * @param filenames The files to write, overwritten if they exist.
+ * @param file_count Number of files.
+ * @param stripe_blocks Blocks per stripe, a multiple of BS_CHUNK_BLOCKS; 0 for one chunk.
+ * @return The number of bytes written over all files, or 0 on failure.
 */
-size_t block_store_allocate(block_store_t *const bs)
+size_t block_store_serialize_striped(const block_store_t *const bs, const char *const *filenames, const size_t file_count, const size_t stripe_blocks)
 {
-    // Check if bs NULL
-    if (bs == NULL || bs->bitmap == NULL) return SIZE_MAX;
+    if (!bs) return 0;
 
-    // iterate through block store, with i as the id
-    for (size_t i = 0; i < block_store_get_total_blocks(); ++i) {
-        // Check if the current block is within the reserved range and skip it if so
-        if (i >= BITMAP_START_BLOCK && i < BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS) {
-            continue;
+    uint64_t start = stats_begin();
+    stripe_job_t *jobs = stripe_open(filenames, file_count, stripe_blocks, O_WRONLY | O_CREAT | O_TRUNC);
+    if (!jobs) return 0;
+    for (size_t i = 0; i < file_count; ++i) jobs[i].bs = (block_store_t *)bs;
+
+    store_lock_read(bs);
+    bool ok = stripe_run(jobs, file_count, bs->cache == NULL && bs->resident == NULL);
+    store_unlock(bs);
+    stats_end(bs, BLOCK_STORE_STAT_SERIALIZE, start);
+
+    stripe_close(jobs, file_count);
+    return ok ? bs->num_blocks * BLOCK_SIZE_BYTES : 0;
+}
+
+/*
+ * @function block_store_deserialize_striped
+ * @brief Deserializes a block store from a striped image, one thread per file.
+ *  The files' sizes give the block count and must match the striping exactly.
+ * @param filenames The files written by block_store_serialize_striped, in the same order.
+ * @param file_count Number of files.
+ * @param stripe_blocks The stripe size the image was written with.
+ * @return A pointer to the deserialized block store structure, or NULL on failure.
+*/
+block_store_t *block_store_deserialize_striped(const char *const *filenames, const size_t file_count, const size_t stripe_blocks)
+{
+    uint64_t start = stats_begin();
+    stripe_job_t *jobs = stripe_open(filenames, file_count, stripe_blocks, O_RDONLY);
+    if (!jobs) return NULL;
+
+    // Together the files hold the raw image, in whole chunks
+    size_t total = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < file_count; ++i) {
+        struct stat st;
+        ok = fstat(jobs[i].fd, &st) == 0;
+        total += ok ? (size_t)st.st_size : 0;
+    }
+    block_store_options_t options = {0};
+    options.num_blocks = total / BS_CHUNK_BYTES * BS_CHUNK_BLOCKS;
+    for (size_t i = 0; ok && i < file_count; ++i) {
+        struct stat st;
+        ok = fstat(jobs[i].fd, &st) == 0
+            && (size_t)st.st_size == stripe_file_bytes(options.num_blocks / BS_CHUNK_BLOCKS, jobs[i].stripe_chunks, i, file_count);
+    }
+
+    block_store_t *bs = ok && total % BS_CHUNK_BYTES == 0 && total >= BLOCK_STORE_NUM_BYTES ? block_store_create_ex(&options) : NULL;
+    if (!bs) {
+        stripe_close(jobs, file_count);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < file_count; ++i) jobs[i].bs = bs;
+    ok = stripe_run(jobs, file_count, true);
+    stripe_close(jobs, file_count);
+    if (!ok) {
+        block_store_destroy(bs);
+        return NULL;
+    }
+
+    mark_written_blocks(bs);
+    stats_end(bs, BLOCK_STORE_STAT_DESERIALIZE, start);
+    return bs;
+}
+
+/*
+ * @function open_image
+ * @brief Opens an image file, with O_DIRECT if BLOCK_STORE_IO_DIRECT is set.
+ *  Filesystems that don't support direct I/O (tmpfs, for one) reject O_DIRECT with EINVAL;
+ *  those fall back to a normal buffered open.
+ * @param filename The path to open.
+ * @param oflags open(2) flags.
+ * @param io_flags BLOCK_STORE_IO_* flags.
+ * @param direct Set to whether the descriptor actually bypasses the page cache.
+ * @return The file descriptor, or -1 on failure.
+*/
+static int open_image(const char *const filename, int oflags, const unsigned io_flags, bool *direct)
+{
+    *direct = false;
+    if (io_flags & BLOCK_STORE_IO_DIRECT) {
+        int fd = open(filename, oflags | O_DIRECT, S_IRUSR | S_IWUSR);
+        if (fd != -1 || errno != EINVAL) {
+            *direct = fd != -1;
+            return fd;
         }
-        // Check if the current block is free        
-        if (bitmap_test(bs->bitmap, i) == false) {
-            // If free, set and return the ID
-            bitmap_set(bs->bitmap, i);
-            return i;
+    }
+    return open(filename, oflags, S_IRUSR | S_IWUSR);
+}
+
+/*
+ * @function direct_pread
+ * @brief Reads a whole plain image from an O_DIRECT file through an aligned bounce buffer.
+ *  Every request is a whole number of BS_DIRECT_ALIGN blocks; the last one may come up
+ *  short at end of file, which is fine as long as it covers the image.
+ * @return True if the entire image was read.
+*/
+static bool direct_pread(int fd, block_store_t *const bs)
+{
+    void *buffer;
+    if (posix_memalign(&buffer, BS_DIRECT_ALIGN, BS_DIRECT_BUFFER) != 0) return false;
+
+    size_t total = bs->num_blocks * BLOCK_SIZE_BYTES;
+    bool ok = true;
+    for (size_t offset = 0; ok && offset < total; offset += BS_DIRECT_BUFFER) {
+        size_t len = total - offset < BS_DIRECT_BUFFER ? total - offset : BS_DIRECT_BUFFER;
+        size_t padded = (len + BS_DIRECT_ALIGN - 1) & ~(size_t)(BS_DIRECT_ALIGN - 1);
+
+        ssize_t got = pread(fd, buffer, padded, (off_t)offset);
+        ok = got >= 0 && (size_t)got >= len;
+
+        // Scatter into chunks (the buffer is a whole number of chunks)
+        for (size_t done = 0; ok && done < len; done += BS_CHUNK_BYTES) {
+            size_t piece = len - done < BS_CHUNK_BYTES ? len - done : BS_CHUNK_BYTES;
+            memcpy(bs->chunks[(offset + done) / BS_CHUNK_BYTES]->bytes, (uint8_t *)buffer + done, piece);
         }
     }
 
-    //return SIZE_MAX in no availible/free block
-    return SIZE_MAX;
+    free(buffer);
+    return ok;
 }
 
 /*
- * @function block_store_request
- * @brief Attempts to allocate a specific block by its ID.
- * @param bs A pointer to the block_store structure.
- * @param block_id The ID of the block to allocate.
- * @return True if the block was successfully allocated, False otherwise.
+ * @function direct_pwrite
+ * @brief Writes a whole plain image to an O_DIRECT file through an aligned bounce buffer.
+ *  A short tail is zero padded out to BS_DIRECT_ALIGN and the file trimmed back afterwards.
+ * @return True if the entire image was written.
 */
-bool block_store_request(block_store_t *const bs, const size_t block_id)
+static bool direct_pwrite(int fd, const block_store_t *const bs)
 {
-    if (bs == NULL || bs->bitmap == NULL || block_id >= block_store_get_total_blocks()) return false;
+    void *buffer;
+    if (posix_memalign(&buffer, BS_DIRECT_ALIGN, BS_DIRECT_BUFFER) != 0) return false;
+
+    size_t total = bs->num_blocks * BLOCK_SIZE_BYTES;
+    bool ok = true, padded_tail = false;
+    for (size_t offset = 0; ok && offset < total; offset += BS_DIRECT_BUFFER) {
+        size_t len = total - offset < BS_DIRECT_BUFFER ? total - offset : BS_DIRECT_BUFFER;
+        size_t padded = (len + BS_DIRECT_ALIGN - 1) & ~(size_t)(BS_DIRECT_ALIGN - 1);
 
-    if (!bitmap_test(bs->bitmap, block_id)) { // Check if the block is free
-        bitmap_set(bs->bitmap, block_id); // Mark it as used
-        return true;
+        // Gather from chunks (the buffer is a whole number of chunks)
+        for (size_t done = 0; ok && done < len; done += BS_CHUNK_BYTES) {
+            size_t piece = len - done < BS_CHUNK_BYTES ? len - done : BS_CHUNK_BYTES;
+            uint8_t *dest = (uint8_t *)buffer + done;
+            const uint8_t *data = chunk_data(bs, (offset + done) / BS_CHUNK_BYTES, dest);
+            if (data != NULL) memmove(dest, data, piece);
+            ok = data != NULL;
+        }
+        memset((uint8_t *)buffer + len, 0, padded - len);
+        padded_tail = padded != len;
+
+        // O_DIRECT writes can still come up short (a full disk, a signal), and the kernel stops
+        // on a logical-block boundary, so the rest stays aligned; if it doesn't, the retry fails
+        // with EINVAL and the write is reported as failed
+        ok = ok && pwrite_full(fd, buffer, padded, (off_t)offset);
     }
 
-    return false; // Block was already in use
+    free(buffer);
+    return ok && (!padded_tail || ftruncate(fd, (off_t)total) == 0);
 }
 
 /*
- * @function block_store_release
- * @brief Frees a specified block by marking it as available for use.
+ * @function block_store_snapshot
+ * @brief Takes a read-only, point-in-time view of a block store.
+ *  The snapshot shares chunks with the store; the store copies a chunk the first time
+ *  it writes to it afterwards. The snapshot can be read and released from any thread.
  * @param bs A pointer to the block_store structure.
- * @param block_id The ID of the block to be released.
+ * @return The snapshot, or NULL on failure.
 */
-void block_store_release(block_store_t *const bs, const size_t block_id) 
+block_store_t *block_store_snapshot(block_store_t *const bs)
 {
-    // Check if bs is valid and the provided block_id is within valid range
-    if (bs != NULL && bs->bitmap != NULL && block_id < block_store_get_total_blocks()) {
-        // Check if the block is currently allocated (marked as used)
-        if (bitmap_test(bs->bitmap, block_id)) {
-            // Mark the block as free in the bitmap
-            bitmap_reset(bs->bitmap, block_id);
+    if (bs == NULL || bs->bitmap == NULL || bs->dedup != NULL || bs->cache != NULL || bs->shards != NULL) return NULL;
+
+    block_store_t *snap = store_alloc(bs->num_blocks);
+    if (snap == NULL) return NULL;
+    snap->read_only = true;
+    snap->chunks = (bs_chunk_t **)malloc(bs->num_chunks * sizeof(bs_chunk_t *));
+
+    store_lock_write(bs);
+    // Sharing a chunk that hasn't been loaded yet would leave both sides loading it
+    bool ok = snap->chunks != NULL;
+    for (size_t block_id = 0; ok && block_id < bs->num_blocks; block_id += BS_CHUNK_BLOCKS) {
+        ok = block_store_fault_in(bs, block_id);
+    }
+    if (ok) snap->bitmap = bitmap_import(bs->num_blocks, bitmap_export(bs->bitmap));
+    if (snap->bitmap != NULL && bs->to_phys != NULL) {
+        snap->to_phys = (size_t *)malloc(bs->num_blocks * sizeof(size_t));
+        if (snap->to_phys != NULL) {
+            memcpy(snap->to_phys, bs->to_phys, bs->num_blocks * sizeof(size_t));
+        } else {
+            bitmap_destroy(snap->bitmap);
+            snap->bitmap = NULL;
+        }
+    }
+    if (snap->bitmap != NULL) {
+        for (size_t i = 0; i < bs->num_chunks; ++i) {
+            if (bs->chunks[i] != NULL) atomic_fetch_add_explicit(&bs->chunks[i]->refs, 1, memory_order_relaxed);
+            snap->chunks[i] = bs->chunks[i];
         }
+        snap->sparse = bs->sparse;
+        snap->materialized = bs->materialized;
     }
+    store_unlock(bs);
+
+    if (snap->bitmap == NULL) {
+        free(snap->chunks);
+        snap->chunks = NULL;
+        block_store_destroy(snap);
+        return NULL;
+    }
+    return snap;
 }
 
 /*
- * @function block_store_get_used_blocks
- * @brief Counts the total number of used blocks in the block store.
+ * @function block_store_snapshot_release
+ * @brief Releases a snapshot taken with block_store_snapshot.
+ * @param snapshot The snapshot to release.
+*/
+void block_store_snapshot_release(block_store_t *const snapshot)
+{
+    if (snapshot != NULL && snapshot->read_only) block_store_destroy(snapshot);
+}
+
+/*
+ * @function block_store_get_physical_blocks
+ * @brief Counts the blocks of memory actually holding block data.
  * @param bs A pointer to the block_store structure.
- * @return The total number of used blocks or SIZE_MAX on error.
+ * @return Distinct non-zero blocks stored for dedup stores, the blocks of the chunks written so
+ *  far for sparse stores, the total block count otherwise, SIZE_MAX on error.
 */
-size_t block_store_get_used_blocks(const block_store_t *const bs)
+size_t block_store_get_physical_blocks(const block_store_t *const bs)
 {
-    if (bs == NULL || bs->bitmap == NULL) return SIZE_MAX;
+    if (bs == NULL) return SIZE_MAX;
+    if (bs->sparse) {
+        store_lock_read(bs);
+        size_t materialized = bs->materialized;
+        store_unlock(bs);
+        return materialized * BS_CHUNK_BLOCKS;
+    }
+    if (bs->dedup == NULL) return bs->num_blocks;
 
-    return bitmap_total_set(bs->bitmap) + BITMAP_NUM_BLOCKS;
+    store_lock_read(bs);
+    size_t physical = dedup_physical_blocks(bs->dedup);
+    store_unlock(bs);
+    return physical;
 }
 
 /*
- * @function block_store_get_free_blocks
- * @brief Counts the total number of free blocks in the block store.
- * @param bs A pointer to the block_store structure.
- * @return The total number of free blocks or SIZE_MAX on error.
+ * Compaction (remapped stores). Each step moves the data of the highest block in use into the
+ *  lowest free block below it and points its logical id at the new block, so blocks in use
+ *  converge on a dense prefix and free space on one run at the end. Steps are independent,
+ *  so compaction can stop after any of them and pick up again later.
 */
-size_t block_store_get_free_blocks(const block_store_t *const bs) 
+
+// Whether a chunk holds no block in use and none of the reserved range
+static bool chunk_is_free(const block_store_t *const bs, const size_t chunk)
 {
-    // Check if the provided block store pointer is valid
-    if (bs == NULL || bs->bitmap == NULL) {
-        return SIZE_MAX; // Return SIZE_MAX on error
+    size_t first = chunk * BS_CHUNK_BLOCKS;
+    size_t reserved_end = BITMAP_START_BLOCK + reserved_blocks(bs->num_blocks);
+    if (first < reserved_end && first + BS_CHUNK_BLOCKS > BITMAP_START_BLOCK) return false;
+
+    const uint8_t *bits = bs->bitmap->data + (first >> 3);
+    for (size_t i = 0; i < BS_CHUNK_BLOCKS / 8; ++i) {
+        if (bits[i] != 0) return false;
     }
+    return true;
+}
 
-    // Get the total number of blocks in the bitmap
-    size_t total_blocks = block_store_get_total_blocks();
+// Moves a block in use, with its owners and logical id, to a free block
+static bool move_block(block_store_t *const bs, const size_t from, const size_t to)
+{
+    uint8_t *dest = block_data_for_write(bs, to);
+    if (dest == NULL) return false;
+    memcpy(dest, block_data(bs, from), BLOCK_SIZE_BYTES);
 
-    // Calculate the number of free blocks by subtracting the used blocks from the total blocks
-    size_t used_blocks = block_store_get_used_blocks(bs);
-    size_t free_blocks = total_blocks - used_blocks;
+    bitmap_set_inline(bs->bitmap, to);
+    extents_claim(bs, to, 1);
+    bitmap_reset_inline(bs->bitmap, from);
+    extents_free(bs, from);
+    if (bs->refs != NULL) {
+        bs->refs[to] = bs->refs[from];
+        bs->refs[from] = 0;
+    }
+    size_t id = bs->to_logical[from];
+    bs->to_phys[id] = to;
+    bs->to_logical[to] = id;
+    bs->to_logical[from] = SIZE_MAX;
 
-    return free_blocks;
+    // Sparse stores give back chunks compaction has emptied
+    size_t chunk = from / BS_CHUNK_BLOCKS;
+    if (bs->sparse && bs->chunks[chunk] != NULL && chunk_is_free(bs, chunk)) {
+        chunk_unref(bs->chunks[chunk]);
+        bs->chunks[chunk] = NULL;
+        --bs->materialized;
+    }
+    return true;
 }
 
 /*
- * @function block_store_get_total_blocks
- * @return The total number of blocks available in the block store.
+ * @function block_store_compact
+ * @brief Runs up to max_moves compaction steps under one acquisition of the lock.
+ * @param bs A pointer to the block_store structure, created with BLOCK_STORE_OPT_REMAP.
+ * @param max_moves The most blocks to move, which bounds how long other callers wait.
+ * @return The number of blocks moved; 0 once the blocks in use are a dense prefix, or on error.
 */
-size_t block_store_get_total_blocks()
+size_t block_store_compact(block_store_t *const bs, const size_t max_moves)
 {
-    return BLOCK_STORE_NUM_BLOCKS;
+    if (bs == NULL || bs->to_logical == NULL || bs->read_only) return 0;
+
+    store_lock_write(bs);
+    size_t reserved_end = BITMAP_START_BLOCK + reserved_blocks(bs->num_blocks);
+    size_t moved = 0;
+    while (moved < max_moves && (bs->extents != NULL || extents_rebuild(bs))) {
+        // Bring compact_top down to the highest block in use, a byte at a time through free space
+        while (bs->compact_top > 0) {
+            size_t top = bs->compact_top - 1;
+            if (top >= BITMAP_START_BLOCK && top < reserved_end) bs->compact_top = BITMAP_START_BLOCK;
+            else if ((top & 0x07) == 0x07 && bs->bitmap->data[top >> 3] == 0) bs->compact_top -= 8;
+            else if (!bitmap_test_inline(bs->bitmap, top)) --bs->compact_top;
+            else break;
+        }
+
+        size_t to = extent_index_next_free(bs->extents, 0);
+        if (to == SIZE_MAX || to >= bs->compact_top || !move_block(bs, bs->compact_top - 1, to)) break;
+        ++moved;
+    }
+    store_unlock(bs);
+    return moved;
 }
 
 /*
- * @function block_store_read
- * @brief Reads data from a specified block into a buffer.
+ * @function block_store_locate
+ * @brief Finds the block a logical id's data is in.
  * @param bs A pointer to the block_store structure.
- * @param block_id The ID of the block to read from.
- * @param buffer The buffer the data should be read into.
- * @return The number of bytes read or 0 on error.
+ * @param block_id The logical id.
+ * @return The block, block_id itself if the store isn't remapped, SIZE_MAX if the id isn't in
+ *  use on a remapped store or on error.
 */
-size_t block_store_read(const block_store_t *const bs, const size_t block_id, void *buffer) 
+size_t block_store_locate(const block_store_t *const bs, const size_t block_id)
 {
-    if (bs == NULL || bs->data == NULL || buffer == NULL || block_id >= block_store_get_total_blocks()) return 0;
+    if (bs == NULL || block_id >= bs->num_blocks) return SIZE_MAX;
 
-    // Copy data from the specified block into the buffer
-    memcpy(buffer, bs->data + (block_id * BLOCK_SIZE_BYTES), BLOCK_SIZE_BYTES);
-    return BLOCK_SIZE_BYTES;
+    store_lock_read(bs);
+    size_t block = physical_id(bs, block_id);
+    store_unlock(bs);
+    return block;
 }
 
 /*
- * @function block_store_write
- * @brief Writes data from a buffer to a specified block.
- * @param bs A pointer to the block_store structure.
- * @param block_id The ID of the block to write to.
- * @param buffer The buffer containing the data to be written.
- * @return The number of bytes written or 0 on error.
+ * Slab-backed data areas, for NUMA and huge-page stores. Instead of one allocation per chunk,
+ *  shard i holds chunks [i * num_chunks / num_shards, (i + 1) * num_chunks / num_shards) in one
+ *  anonymous mapping (a single shard unless the store is NUMA-sharded).
+ *  NUMA shards are bound to node i % (nodes online) before any page is touched. Binding is
+ *  best effort: a kernel or container that refuses mbind leaves the default first-touch
+ *  placement, and the store works the same apart from where its pages land.
+ *  Allocation tries the shards bound to the caller's node first, then the rest nearest node
+ *  first, by the distances the kernel reports (or round-robin from the caller's node).
+ *  Huge-page mappings try MAP_HUGETLB first, asking for 2 MiB pages explicitly rather than the
+ *  host's default size (which may be 1 GiB, or 512 MiB on arm64 with 64 KiB pages), since that
+ *  needs pages reserved in the 2 MiB hugetlb pool. Otherwise they fall back to ordinary pages
+ *  with MADV_HUGEPAGE so transparent huge pages can back them. Huge-page mappings are sized in
+ *  whole 2 MiB pages either way, so munmap gets the length the kernel used; other shards are
+ *  sized in base pages.
+ *  Chunks are never shared (no snapshots), so they are never copied or freed one by one.
 */
-size_t block_store_write(block_store_t *const bs, const size_t block_id, const void *buffer) 
-{
-    if (bs == NULL || bs->data == NULL || buffer == NULL || block_id >= block_store_get_total_blocks()) return 0;
 
-    // Copy data from the buffer to the specified block
-    memcpy(bs->data + (block_id * BLOCK_SIZE_BYTES), buffer, BLOCK_SIZE_BYTES);
-    return BLOCK_SIZE_BYTES;
+// Huge page size mappings are sized for, and asked of MAP_HUGETLB by MAP_HUGE_2MB
+#define BS_HUGE_PAGE (2 * 1024 * 1024)
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+// Bytes of shard's mapping
+static size_t slab_bytes(const block_store_t *const bs, const size_t shard)
+{
+    size_t chunks = (shard + 1) * bs->num_chunks / bs->num_shards - shard * bs->num_chunks / bs->num_shards;
+    return (chunks * sizeof(bs_chunk_t) + bs->slab_align - 1) & ~(bs->slab_align - 1);
 }
 
 /*
- * @function block_store_deserialize
- * @brief Deserializes a block store from a file into memory.
- * @param filename The path to the file containing the serialized block store data.
- * @return A pointer to the deserialized block store structure, or NULL on failure.
+ * @function numa_nodes_online
+ * @brief Reads how many nodes the system has from sysfs, e.g. "0-1" or "0,2-3".
+ * @return The highest node online plus one, 1 if that can't be read.
 */
-block_store_t *block_store_deserialize(const char *const filename) 
+static size_t numa_nodes_online(void)
 {
-    if (!filename) return NULL;
-
-    // Open the file in read-only mode.
-    int fd = open(filename, O_RDONLY);
-    if (fd == -1) return NULL;
+    FILE *file = fopen("/sys/devices/system/node/online", "r");
+    if (file == NULL) return 1;
 
-    // Allocate and zero-initialize a block store structure.
-    block_store_t *bs = calloc(1, sizeof(block_store_t));
-    if (!bs) {
-        close(fd);
-        return NULL;
+    size_t highest = 0, value = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        if (c >= '0' && c <= '9') {
+            value = value * 10 + (size_t)(c - '0');
+            if (value > highest) highest = value;
+        } else {
+            value = 0;
+        }
     }
+    fclose(file);
+    return highest + 1;
+}
 
-    // Initialize bitmap for managing block allocations.
-    bs->bitmap = bitmap_create(block_store_get_total_blocks());
-    if (!bs->bitmap) {
-        close(fd);
-        free(bs);
-        return NULL;
-    }
+/*
+ * @function numa_distances
+ * @brief Reads the distance from one node to every node from sysfs, e.g. "10 21".
+ * @param from The node.
+ * @param nodes Nodes to read distances to.
+ * @param distance Filled in with nodes distances.
+ * @return False if the file couldn't be read or was short.
+*/
+static bool numa_distances(const size_t from, const size_t nodes, size_t *const distance)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/distance", from);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) return false;
 
-    // Read block store data from the file.
-    ssize_t read_bytes = read(fd, bs->data, BLOCK_STORE_NUM_BYTES);
-    if (read_bytes != BLOCK_STORE_NUM_BYTES) {
-        bitmap_destroy(bs->bitmap);
-        close(fd);
-        free(bs);
-        return NULL;
+    size_t count = 0;
+    unsigned long value;
+    while (count < nodes && fscanf(file, "%lu", &value) == 1) distance[count++] = value;
+    fclose(file);
+    return count == nodes;
+}
+
+/*
+ * @function numa_order_create
+ * @brief Works out, for callers on each node, the order to try shards in: the shards bound to
+ *  that node, then the others by distance to their node, lowest index first among equals.
+ *  Without distances from sysfs, nodes after the caller's come round-robin.
+ * @param bs The store, with num_shards set.
+ * @param nodes Nodes online.
+ * @return False if the table couldn't be allocated.
+*/
+static bool numa_order_create(block_store_t *const bs, const size_t nodes)
+{
+    bs->shard_order = (size_t *)malloc(nodes * bs->num_shards * sizeof(size_t));
+    size_t *distance = (size_t *)malloc(nodes * sizeof(size_t));
+    if (bs->shard_order == NULL || distance == NULL) {
+        free(distance);
+        return false;
     }
+    bs->num_nodes = nodes;
 
-    // Mark blocks as allocated in the bitmap based on their content.
-    for (size_t block_id = 0; block_id < block_store_get_total_blocks(); ++block_id) {
-        uint8_t *block_data = bs->data + (block_id * BLOCK_SIZE_BYTES);
-        
-        bool is_allocated = false;
-        for (size_t byte_index = 0; byte_index < BLOCK_SIZE_BYTES; ++byte_index) {
-            if (block_data[byte_index] != 0) {
-                is_allocated = true;    // Mark block as used.
-                break;  // Only need one non-zero byte to mark as used.
-            }
+    for (size_t node = 0; node < nodes; ++node) {
+        if (!numa_distances(node, nodes, distance)) {
+            for (size_t other = 0; other < nodes; ++other) distance[other] = (other + nodes - node) % nodes;
         }
+        distance[node] = 0; // Local shards first even if the kernel reports odd distances
 
-        // If the block is allocated, set its bit in the bitmap
-        if (is_allocated) bitmap_set(bs->bitmap, block_id);
+        // Insertion sort by (distance of the shard's node, shard index)
+        size_t *order = bs->shard_order + (node * bs->num_shards);
+        for (size_t shard = 0; shard < bs->num_shards; ++shard) {
+            size_t i = shard;
+            while (i > 0 && distance[order[i - 1] % nodes] > distance[shard % nodes]) {
+                order[i] = order[i - 1];
+                --i;
+            }
+            order[i] = shard;
+        }
     }
+    free(distance);
+    return true;
+}
 
-    close(fd);
-    return bs;
+/*
+ * @function slab_map
+ * @brief Maps one shard, with huge pages if asked for, and records what backing it got.
+ *  The store reports the weakest backing any of its shards got.
+ * @return The mapping, or MAP_FAILED.
+*/
+static void *slab_map(block_store_t *const bs, const size_t bytes, const bool huge)
+{
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    unsigned backing = BLOCK_STORE_PAGES_SMALL;
+    void *memory = huge ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0) : MAP_FAILED;
+    if (memory != MAP_FAILED) {
+        backing = BLOCK_STORE_PAGES_HUGETLB;
+    } else {
+        memory = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (memory != MAP_FAILED && huge && madvise(memory, bytes, MADV_HUGEPAGE) == 0) {
+            backing = BLOCK_STORE_PAGES_TRANSPARENT;
+        }
+    }
+    if (memory != MAP_FAILED && backing < bs->page_backing) bs->page_backing = backing;
+    return memory;
 }
 
 /*
- * @function block_store_serialize
- * @brief Serializes a block store to a file.
- * @param bs A pointer to the block_store structure to serialize.
- * @param filename The path to the file where the block store data will be written.
- * @return The number of bytes written to the file, or 0 on failure.
+ * @function slab_create
+ * @brief Maps the shards of a new store and points its chunks into them.
+ * @param bs The store, with its chunks array allocated and empty.
+ * @param shards Shards wanted, 0 for one per node; capped at one per chunk.
+ * @param numa Whether to bind shard i to its node.
+ * @param huge Whether to ask for huge pages.
+ * @return False if a mapping couldn't be made.
 */
-size_t block_store_serialize(const block_store_t *const bs, const char *const filename) 
+static bool slab_create(block_store_t *const bs, size_t shards, const bool numa, const bool huge)
 {
-    if (!bs || !filename) return 0;
+    size_t nodes = numa ? numa_nodes_online() : 1;
+    if (shards == 0) shards = nodes;
+    if (shards > bs->num_chunks) shards = bs->num_chunks;
+    bs->slab_align = huge ? BS_HUGE_PAGE : (size_t)sysconf(_SC_PAGESIZE);
 
-    // Open or create the file for writing, truncating it if it already exists.
-    // File permissions set to read and write for owner.
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd == -1) return 0;
+    bs->shards = (void **)calloc(shards, sizeof(void *));
+    if (bs->shards == NULL) return false;
+    bs->num_shards = shards;
+    bs->page_backing = BLOCK_STORE_PAGES_HUGETLB;
+    if (numa && shards > 1 && !numa_order_create(bs, nodes)) return false;
 
-    // Attempt to write the entire block store data to file.
-    ssize_t written = write(fd, bs->data, BLOCK_STORE_NUM_BYTES);
-    if (written != (ssize_t)BLOCK_STORE_NUM_BYTES) {
-        close(fd);
-        return 0;
+    for (size_t shard = 0; shard < shards; ++shard) {
+        size_t bytes = slab_bytes(bs, shard);
+        void *memory = slab_map(bs, bytes, huge);
+        if (memory == MAP_FAILED) return false;
+        bs->shards[shard] = memory;
+
+        unsigned long mask[16] = {0};
+        size_t node = shard % nodes, bits = sizeof(mask[0]) * 8;
+        if (numa && node < sizeof(mask) * 8) {
+            mask[node / bits] = 1UL << (node % bits);
+            syscall(SYS_mbind, memory, bytes, MPOL_BIND, mask, sizeof(mask) * 8, 0);
+        }
+
+        // The mapping comes zeroed; only the reference counts need setting
+        size_t first = shard * bs->num_chunks / shards;
+        for (size_t chunk = first; chunk < (shard + 1) * bs->num_chunks / shards; ++chunk) {
+            bs->chunks[chunk] = (bs_chunk_t *)((uint8_t *)memory + ((chunk - first) * sizeof(bs_chunk_t)));
+            atomic_init(&bs->chunks[chunk]->refs, 1);
+        }
     }
+    return true;
+}
 
-    close(fd);
-    return BLOCK_STORE_NUM_BYTES;
+static void slab_destroy(block_store_t *const bs)
+{
+    for (size_t shard = 0; bs->shards != NULL && shard < bs->num_shards; ++shard) {
+        if (bs->shards[shard] != NULL) munmap(bs->shards[shard], slab_bytes(bs, shard));
+    }
+    free(bs->shards);
+    free(bs->shard_order);
+}
+
+// The order to try shards in for the node the calling thread is running on
+static const size_t *numa_caller_order(const block_store_t *const bs)
+{
+    unsigned cpu, node;
+    if (getcpu(&cpu, &node) != 0) node = 0;
+    return bs->shard_order + ((node % bs->num_nodes) * bs->num_shards);
+}
+
+/*
+ * @function block_store_get_page_backing
+ * @brief Reports what kind of pages hold the store's block data.
+ * @param bs A pointer to the block_store structure.
+ * @return A BLOCK_STORE_PAGES_* value.
+*/
+unsigned block_store_get_page_backing(const block_store_t *const bs)
+{
+    return bs != NULL && bs->shards != NULL ? bs->page_backing : BLOCK_STORE_PAGES_SMALL;
 }
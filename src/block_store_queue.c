@@ -0,0 +1,184 @@
+#include "block_store_queue.h"
+#include <pthread.h>
+
+// Requests a worker takes off the submission ring per lock acquisition
+#define WORKER_BATCH 16
+
+struct block_store_queue
+{
+    block_store_t *bs;
+    size_t entries;
+
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;   // Signalled when requests are added or the queue stops
+    pthread_cond_t completed;   // Signalled when completions are added
+
+    // Both rings hold entries slots; at most entries requests are in flight, so neither overflows
+    block_store_sqe_t *sq;
+    size_t sq_head, sq_count;
+    block_store_cqe_t *cq;
+    size_t cq_head, cq_count;
+    size_t in_flight;           // Submitted and not yet reaped
+
+    bool stopping;
+    pthread_t *threads;
+    size_t thread_count;
+};
+
+static size_t run(block_store_t *const bs, const block_store_sqe_t *const sqe)
+{
+    switch (sqe->op)
+    {
+        case BLOCK_STORE_OP_READ:
+            return block_store_read(bs, sqe->block_id, sqe->buffer);
+        case BLOCK_STORE_OP_WRITE:
+            return block_store_write(bs, sqe->block_id, sqe->buffer);
+        case BLOCK_STORE_OP_ALLOCATE:
+            return block_store_allocate(bs);
+        case BLOCK_STORE_OP_RELEASE:
+            block_store_release(bs, sqe->block_id);
+            return 0;
+    }
+    return 0;
+}
+
+static void *worker(void *arg)
+{
+    block_store_queue_t *queue = (block_store_queue_t *) arg;
+    block_store_sqe_t batch[WORKER_BATCH];
+    block_store_cqe_t done[WORKER_BATCH];
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;)
+    {
+        while (queue->sq_count == 0 && !queue->stopping)
+        {
+            pthread_cond_wait(&queue->submitted, &queue->lock);
+        }
+        if (queue->sq_count == 0) break;
+
+        size_t n = 0;
+        while (n < WORKER_BATCH && queue->sq_count > 0)
+        {
+            batch[n++] = queue->sq[queue->sq_head];
+            queue->sq_head = (queue->sq_head + 1) % queue->entries;
+            --queue->sq_count;
+        }
+        pthread_mutex_unlock(&queue->lock);
+
+        // The store does its own locking
+        for (size_t i = 0; i < n; ++i)
+        {
+            done[i].user_data = batch[i].user_data;
+            done[i].result = run(queue->bs, &batch[i]);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        for (size_t i = 0; i < n; ++i)
+        {
+            queue->cq[(queue->cq_head + queue->cq_count++) % queue->entries] = done[i];
+        }
+        pthread_cond_broadcast(&queue->completed);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+block_store_queue_t *block_store_queue_create(block_store_t *const bs, const size_t entries, const size_t workers)
+{
+    if (!bs || !entries || !workers) return NULL;
+
+    block_store_queue_t *queue = (block_store_queue_t *) calloc(1, sizeof(block_store_queue_t));
+    if (!queue) return NULL;
+    queue->bs = bs;
+    queue->entries = entries;
+    queue->sq = (block_store_sqe_t *) malloc(entries * sizeof(block_store_sqe_t));
+    queue->cq = (block_store_cqe_t *) malloc(entries * sizeof(block_store_cqe_t));
+    queue->threads = (pthread_t *) malloc(workers * sizeof(pthread_t));
+    if (!queue->sq || !queue->cq || !queue->threads || pthread_mutex_init(&queue->lock, NULL) != 0)
+    {
+        free(queue->sq);
+        free(queue->cq);
+        free(queue->threads);
+        free(queue);
+        return NULL;
+    }
+    pthread_cond_init(&queue->submitted, NULL);
+    pthread_cond_init(&queue->completed, NULL);
+
+    for (; queue->thread_count < workers; ++queue->thread_count)
+    {
+        if (pthread_create(&queue->threads[queue->thread_count], NULL, worker, queue) != 0) break;
+    }
+    if (queue->thread_count == 0)
+    {
+        block_store_queue_destroy(queue);
+        return NULL;
+    }
+    return queue;
+}
+
+void block_store_queue_destroy(block_store_queue_t *queue)
+{
+    if (queue)
+    {
+        // Workers drain the submission ring before they see stopping
+        pthread_mutex_lock(&queue->lock);
+        queue->stopping = true;
+        pthread_cond_broadcast(&queue->submitted);
+        pthread_mutex_unlock(&queue->lock);
+        for (size_t i = 0; i < queue->thread_count; ++i)
+        {
+            pthread_join(queue->threads[i], NULL);
+        }
+
+        pthread_cond_destroy(&queue->submitted);
+        pthread_cond_destroy(&queue->completed);
+        pthread_mutex_destroy(&queue->lock);
+        free(queue->sq);
+        free(queue->cq);
+        free(queue->threads);
+        free(queue);
+    }
+}
+
+size_t block_store_queue_submit(block_store_queue_t *const queue, const block_store_sqe_t *const sqes, const size_t count)
+{
+    if (!queue || !sqes) return 0;
+
+    pthread_mutex_lock(&queue->lock);
+    size_t n = 0;
+    while (n < count && queue->in_flight < queue->entries)
+    {
+        queue->sq[(queue->sq_head + queue->sq_count++) % queue->entries] = sqes[n++];
+        ++queue->in_flight;
+    }
+    if (n == 1) pthread_cond_signal(&queue->submitted);
+    else if (n > 1) pthread_cond_broadcast(&queue->submitted);
+    pthread_mutex_unlock(&queue->lock);
+    return n;
+}
+
+size_t block_store_queue_reap(block_store_queue_t *const queue, block_store_cqe_t *const cqes, const size_t max, const size_t wait_for)
+{
+    if (!queue || !cqes) return 0;
+
+    pthread_mutex_lock(&queue->lock);
+    size_t want = wait_for < queue->in_flight ? wait_for : queue->in_flight;
+    if (want > max) want = max;
+    while (queue->cq_count < want)
+    {
+        pthread_cond_wait(&queue->completed, &queue->lock);
+    }
+
+    size_t n = 0;
+    while (n < max && queue->cq_count > 0)
+    {
+        cqes[n++] = queue->cq[queue->cq_head];
+        queue->cq_head = (queue->cq_head + 1) % queue->entries;
+        --queue->cq_count;
+        --queue->in_flight;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return n;
+}
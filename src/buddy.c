@@ -0,0 +1,145 @@
+#include "buddy.h"
+
+#define NO_ID SIZE_MAX
+
+struct buddy
+{
+    size_t n_ids;
+    unsigned max_order;
+
+    // Free blocks, by the id they start at
+    uint8_t *free_order;    // Order + 1 if a free block starts here, 0 otherwise
+    size_t *next, *prev;    // Doubly linked free list of that block's order
+
+    size_t heads[sizeof(size_t) * 8];   // First free block of each order, NO_ID if none
+};
+
+static void list_push(buddy_t *const buddy, const size_t id, const unsigned order)
+{
+    buddy->free_order[id] = (uint8_t) (order + 1);
+    buddy->prev[id] = NO_ID;
+    buddy->next[id] = buddy->heads[order];
+    if (buddy->heads[order] != NO_ID) buddy->prev[buddy->heads[order]] = id;
+    buddy->heads[order] = id;
+}
+
+static void list_remove(buddy_t *const buddy, const size_t id, const unsigned order)
+{
+    buddy->free_order[id] = 0;
+    if (buddy->prev[id] != NO_ID) buddy->next[buddy->prev[id]] = buddy->next[id];
+    else buddy->heads[order] = buddy->next[id];
+    if (buddy->next[id] != NO_ID) buddy->prev[buddy->next[id]] = buddy->prev[id];
+}
+
+buddy_t *buddy_create(const size_t n_ids)
+{
+    if (n_ids == 0) return NULL;
+
+    buddy_t *buddy = (buddy_t *) calloc(1, sizeof(buddy_t));
+    if (!buddy) return NULL;
+    buddy->n_ids = n_ids;
+    while (buddy->max_order + 1 < sizeof(size_t) * 8 && ((size_t) 2 << buddy->max_order) <= n_ids) ++buddy->max_order;
+    for (size_t i = 0; i < sizeof(buddy->heads) / sizeof(buddy->heads[0]); ++i)
+    {
+        buddy->heads[i] = NO_ID;
+    }
+
+    buddy->free_order = (uint8_t *) calloc(n_ids, 1);
+    buddy->next = (size_t *) malloc(n_ids * sizeof(size_t));
+    buddy->prev = (size_t *) malloc(n_ids * sizeof(size_t));
+    if (!buddy->free_order || !buddy->next || !buddy->prev)
+    {
+        buddy_destroy(buddy);
+        return NULL;
+    }
+    return buddy;
+}
+
+void buddy_destroy(buddy_t *buddy)
+{
+    if (buddy)
+    {
+        free(buddy->free_order);
+        free(buddy->next);
+        free(buddy->prev);
+        free(buddy);
+    }
+}
+
+unsigned buddy_max_order(const buddy_t *const buddy)
+{
+    return buddy->max_order;
+}
+
+size_t buddy_allocate(buddy_t *const buddy, const unsigned order)
+{
+    if (order > buddy->max_order) return SIZE_MAX;
+
+    unsigned found = order;
+    while (found <= buddy->max_order && buddy->heads[found] == NO_ID) ++found;
+    if (found > buddy->max_order) return SIZE_MAX;
+
+    // Split the block down, keeping the lower half each time
+    const size_t id = buddy->heads[found];
+    list_remove(buddy, id, found);
+    while (found > order)
+    {
+        --found;
+        list_push(buddy, id + ((size_t) 1 << found), found);
+    }
+    return id;
+}
+
+void buddy_free(buddy_t *const buddy, size_t id, unsigned order)
+{
+    while (order < buddy->max_order)
+    {
+        const size_t mate = id ^ ((size_t) 1 << order);
+        if (mate >= buddy->n_ids || buddy->free_order[mate] != order + 1) break;
+        list_remove(buddy, mate, order);
+        if (mate < id) id = mate;
+        ++order;
+    }
+    list_push(buddy, id, order);
+}
+
+void buddy_free_range(buddy_t *const buddy, size_t start, const size_t count)
+{
+    const size_t end = start + count;
+    while (start < end)
+    {
+        unsigned order = 0;
+        while (order < buddy->max_order && start % ((size_t) 2 << order) == 0 && start + ((size_t) 2 << order) <= end) ++order;
+        buddy_free(buddy, start, order);
+        start += (size_t) 1 << order;
+    }
+}
+
+bool buddy_take(buddy_t *const buddy, const size_t id)
+{
+    // The free block holding id starts at id rounded down to its order
+    for (unsigned order = 0; order <= buddy->max_order; ++order)
+    {
+        size_t start = id & ~(((size_t) 1 << order) - 1);
+        if (buddy->free_order[start] != order + 1) continue;
+
+        // Split it, handing back every half that doesn't hold id
+        list_remove(buddy, start, order);
+        while (order > 0)
+        {
+            --order;
+            const size_t half = (size_t) 1 << order;
+            if (id >= start + half)
+            {
+                list_push(buddy, start, order);
+                start += half;
+            }
+            else
+            {
+                list_push(buddy, start + half, order);
+            }
+        }
+        return true;
+    }
+    return false;
+}
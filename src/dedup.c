@@ -0,0 +1,262 @@
+#include "dedup.h"
+#include <string.h>
+
+// Physical ids are stored +1 everywhere so that zero can mean "nothing":
+//  map[block] == 0  -> the logical block is all zeros
+//  slots[i] == 0    -> empty index slot
+#define NO_BLOCK 0u
+
+#define INITIAL_PHYSICAL 16
+
+struct dedup
+{
+    size_t block_size;
+    size_t n_blocks;
+    uint32_t *map;          // Logical block -> physical id + 1
+
+    uint8_t *pool;          // Physical block contents
+    uint32_t *refs;         // Logical blocks mapped to each physical block
+    uint32_t *hashes;       // Content hash of each physical block
+    size_t capacity;        // Physical blocks allocated in the arrays above
+    size_t used;            // High water mark of physical ids handed out
+    size_t live;            // Physical blocks with refs > 0
+
+    uint32_t *free_ids;     // Stack of released physical ids below used
+    size_t free_count;
+
+    uint32_t *slots;        // Open addressing (linear probing) index: physical id + 1
+    size_t slot_mask;       // Slot count - 1, slot count is a power of two
+};
+
+static const uint8_t zero_block[256];
+
+// Four 64-bit lanes of multiply-rotate, then a final avalanche (xxhash/murmur style)
+static uint32_t block_hash(const uint8_t *data, size_t len)
+{
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+    for (size_t i = 0; i < len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        w *= 0xC2B2AE3D27D4EB4Full;
+        w = (w << 31) | (w >> 33);
+        h ^= w * 0x9E3779B185EBCA87ull;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52DCE729;
+    }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return (uint32_t) h;
+}
+
+static inline uint8_t *physical_data(const dedup_t *const dedup, const size_t id)
+{
+    return dedup->pool + id * dedup->block_size;
+}
+
+// Returns the physical id + 1 of a block with these contents, NO_BLOCK if there isn't one
+static uint32_t index_find(const dedup_t *const dedup, const uint32_t hash, const void *const data)
+{
+    for (size_t pos = hash & dedup->slot_mask; dedup->slots[pos] != NO_BLOCK; pos = (pos + 1) & dedup->slot_mask)
+    {
+        const uint32_t id = dedup->slots[pos] - 1;
+        if (dedup->hashes[id] == hash && memcmp(physical_data(dedup, id), data, dedup->block_size) == 0)
+        {
+            return id + 1;
+        }
+    }
+    return NO_BLOCK;
+}
+
+static void index_insert(dedup_t *const dedup, const uint32_t id)
+{
+    size_t pos = dedup->hashes[id] & dedup->slot_mask;
+    while (dedup->slots[pos] != NO_BLOCK)
+    {
+        pos = (pos + 1) & dedup->slot_mask;
+    }
+    dedup->slots[pos] = id + 1;
+}
+
+// Backward-shift deletion: no tombstones, so probe lengths don't decay with churn
+static void index_remove(dedup_t *const dedup, const uint32_t id)
+{
+    size_t hole = dedup->hashes[id] & dedup->slot_mask;
+    while (dedup->slots[hole] != id + 1)
+    {
+        hole = (hole + 1) & dedup->slot_mask;
+    }
+
+    for (size_t pos = (hole + 1) & dedup->slot_mask; dedup->slots[pos] != NO_BLOCK; pos = (pos + 1) & dedup->slot_mask)
+    {
+        // An entry can fill the hole only if its home slot isn't cyclically within (hole, pos]
+        const size_t home = dedup->hashes[dedup->slots[pos] - 1] & dedup->slot_mask;
+        const bool stays = hole <= pos ? (home > hole && home <= pos) : (home > hole || home <= pos);
+        if (!stays)
+        {
+            dedup->slots[hole] = dedup->slots[pos];
+            hole = pos;
+        }
+    }
+    dedup->slots[hole] = NO_BLOCK;
+}
+
+// Keeps the index at most half full
+static bool index_reserve(dedup_t *const dedup, const size_t live)
+{
+    size_t slot_count = dedup->slot_mask + 1;
+    if (live * 2 <= slot_count) return true;
+    while (live * 2 > slot_count)
+    {
+        slot_count <<= 1;
+    }
+
+    uint32_t *slots = (uint32_t *) calloc(slot_count, sizeof(uint32_t));
+    if (!slots) return false;
+
+    uint32_t *old = dedup->slots;
+    const size_t old_count = dedup->slot_mask + 1;
+    dedup->slots = slots;
+    dedup->slot_mask = slot_count - 1;
+    for (size_t i = 0; i < old_count; ++i)
+    {
+        if (old[i] != NO_BLOCK) index_insert(dedup, old[i] - 1);
+    }
+    free(old);
+    return true;
+}
+
+// Hands out an unused physical id, growing the pool if needed. UINT32_MAX on failure.
+static uint32_t physical_alloc(dedup_t *const dedup)
+{
+    if (!index_reserve(dedup, dedup->live + 1)) return UINT32_MAX;
+    if (dedup->free_count) return dedup->free_ids[--dedup->free_count];
+
+    if (dedup->used == dedup->capacity)
+    {
+        const size_t capacity = dedup->capacity * 2;
+        uint8_t *pool = (uint8_t *) realloc(dedup->pool, capacity * dedup->block_size);
+        if (pool) dedup->pool = pool;
+        uint32_t *refs = (uint32_t *) realloc(dedup->refs, capacity * sizeof(uint32_t));
+        if (refs) dedup->refs = refs;
+        uint32_t *hashes = (uint32_t *) realloc(dedup->hashes, capacity * sizeof(uint32_t));
+        if (hashes) dedup->hashes = hashes;
+        uint32_t *free_ids = (uint32_t *) realloc(dedup->free_ids, capacity * sizeof(uint32_t));
+        if (free_ids) dedup->free_ids = free_ids;
+        if (!pool || !refs || !hashes || !free_ids) return UINT32_MAX;
+        dedup->capacity = capacity;
+    }
+    return (uint32_t) dedup->used++;
+}
+
+static void physical_unref(dedup_t *const dedup, const uint32_t id)
+{
+    if (--dedup->refs[id] == 0)
+    {
+        index_remove(dedup, id);
+        dedup->free_ids[dedup->free_count++] = id;
+        --dedup->live;
+    }
+}
+
+dedup_t *dedup_create(const size_t n_blocks, const size_t block_size)
+{
+    if (!n_blocks || !block_size || block_size % 8 || block_size > sizeof(zero_block) || n_blocks >= UINT32_MAX)
+    {
+        return NULL;
+    }
+
+    dedup_t *dedup = (dedup_t *) calloc(1, sizeof(dedup_t));
+    if (dedup)
+    {
+        dedup->block_size = block_size;
+        dedup->n_blocks = n_blocks;
+        dedup->capacity = INITIAL_PHYSICAL;
+        dedup->slot_mask = INITIAL_PHYSICAL * 2 - 1;
+        dedup->map = (uint32_t *) calloc(n_blocks, sizeof(uint32_t));
+        dedup->pool = (uint8_t *) malloc(INITIAL_PHYSICAL * block_size);
+        dedup->refs = (uint32_t *) malloc(INITIAL_PHYSICAL * sizeof(uint32_t));
+        dedup->hashes = (uint32_t *) malloc(INITIAL_PHYSICAL * sizeof(uint32_t));
+        dedup->free_ids = (uint32_t *) malloc(INITIAL_PHYSICAL * sizeof(uint32_t));
+        dedup->slots = (uint32_t *) calloc(INITIAL_PHYSICAL * 2, sizeof(uint32_t));
+        if (dedup->map && dedup->pool && dedup->refs && dedup->hashes && dedup->free_ids && dedup->slots)
+        {
+            return dedup;
+        }
+        dedup_destroy(dedup);
+    }
+    return NULL;
+}
+
+void dedup_destroy(dedup_t *dedup)
+{
+    if (dedup)
+    {
+        free(dedup->map);
+        free(dedup->pool);
+        free(dedup->refs);
+        free(dedup->hashes);
+        free(dedup->free_ids);
+        free(dedup->slots);
+        free(dedup);
+    }
+}
+
+const uint8_t *dedup_read(const dedup_t *const dedup, const size_t block)
+{
+    const uint32_t mapped = dedup->map[block];
+    return mapped == NO_BLOCK ? zero_block : physical_data(dedup, mapped - 1);
+}
+
+bool dedup_write(dedup_t *const dedup, const size_t block, const void *const data)
+{
+    const uint32_t old = dedup->map[block];
+
+    if (memcmp(data, zero_block, dedup->block_size) == 0)
+    {
+        dedup->map[block] = NO_BLOCK;
+        if (old != NO_BLOCK) physical_unref(dedup, old - 1);
+        return true;
+    }
+
+    const uint32_t hash = block_hash((const uint8_t *) data, dedup->block_size);
+    const uint32_t match = index_find(dedup, hash, data);
+    if (match != NO_BLOCK)
+    {
+        if (match != old)
+        {
+            ++dedup->refs[match - 1];
+            dedup->map[block] = match;
+            if (old != NO_BLOCK) physical_unref(dedup, old - 1);
+        }
+        return true;
+    }
+
+    // New contents. If nobody else shares the old copy, rewrite it in place.
+    if (old != NO_BLOCK && dedup->refs[old - 1] == 1)
+    {
+        index_remove(dedup, old - 1);
+        memcpy(physical_data(dedup, old - 1), data, dedup->block_size);
+        dedup->hashes[old - 1] = hash;
+        index_insert(dedup, old - 1);
+        return true;
+    }
+
+    const uint32_t id = physical_alloc(dedup);
+    if (id == UINT32_MAX) return false;
+
+    memcpy(physical_data(dedup, id), data, dedup->block_size);
+    dedup->refs[id] = 1;
+    dedup->hashes[id] = hash;
+    index_insert(dedup, id);
+    ++dedup->live;
+
+    dedup->map[block] = id + 1;
+    if (old != NO_BLOCK) physical_unref(dedup, old - 1);
+    return true;
+}
+
+size_t dedup_physical_blocks(const dedup_t *const dedup)
+{
+    return dedup->live;
+}
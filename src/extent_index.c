@@ -0,0 +1,346 @@
+#include "extent_index.h"
+
+// Both trees are treaps sharing one node per extent and one heap priority per node.
+// The by-start tree also keeps, in each node, the longest extent in its subtree, which is
+// what lets first-fit skip whole subtrees.
+
+enum
+{
+    BY_START,
+    BY_LENGTH,
+};
+
+typedef struct extent
+{
+    size_t start, length;
+    size_t max_length;              // Longest extent in this node's by-start subtree
+    uint32_t priority;              // Max-heap order, the same in both trees
+    struct extent *link[2][2];      // [tree][0 left, 1 right]
+} extent_t;
+
+struct extent_index
+{
+    extent_t *root[2];              // [tree]
+    size_t count;
+    uint32_t seed;                  // xorshift state for priorities
+};
+
+static inline size_t subtree_max(const extent_t *const node)
+{
+    return node != NULL ? node->max_length : 0;
+}
+
+static void update(extent_t *const node, const int tree)
+{
+    if (tree == BY_START)
+    {
+        size_t max = node->length;
+        if (subtree_max(node->link[BY_START][0]) > max) max = subtree_max(node->link[BY_START][0]);
+        if (subtree_max(node->link[BY_START][1]) > max) max = subtree_max(node->link[BY_START][1]);
+        node->max_length = max;
+    }
+}
+
+// Whether node sorts after other in tree
+static inline bool goes_right(const extent_t *const node, const extent_t *const other, const int tree)
+{
+    if (tree == BY_LENGTH && node->length != other->length) return node->length > other->length;
+    return node->start > other->start;
+}
+
+// Lifts child dir of *root into its place
+static void rotate(extent_t **root, const int dir, const int tree)
+{
+    extent_t *top = *root;
+    extent_t *child = top->link[tree][dir];
+    top->link[tree][dir] = child->link[tree][!dir];
+    child->link[tree][!dir] = top;
+    update(top, tree);
+    update(child, tree);
+    *root = child;
+}
+
+static void tree_insert(extent_t **root, extent_t *const node, const int tree)
+{
+    if (*root == NULL)
+    {
+        node->link[tree][0] = node->link[tree][1] = NULL;
+        update(node, tree);
+        *root = node;
+        return;
+    }
+    const int dir = goes_right(node, *root, tree);
+    tree_insert(&(*root)->link[tree][dir], node, tree);
+    if ((*root)->link[tree][dir]->priority > (*root)->priority) rotate(root, dir, tree);
+    else update(*root, tree);
+}
+
+static void tree_erase(extent_t **root, const extent_t *const node, const int tree)
+{
+    extent_t *cur = *root;
+    if (cur == node)
+    {
+        extent_t *left = cur->link[tree][0], *right = cur->link[tree][1];
+        if (left == NULL || right == NULL)
+        {
+            *root = left != NULL ? left : right;
+            return;
+        }
+        // Sink the node below its higher-priority child, then keep going
+        const int dir = left->priority > right->priority ? 0 : 1;
+        rotate(root, dir, tree);
+        tree_erase(&(*root)->link[tree][!dir], node, tree);
+        update(*root, tree);
+        return;
+    }
+    tree_erase(&cur->link[tree][goes_right(node, cur, tree)], node, tree);
+    update(cur, tree);
+}
+
+static inline void link_extent(extent_index_t *const index, extent_t *const node)
+{
+    tree_insert(&index->root[BY_START], node, BY_START);
+    tree_insert(&index->root[BY_LENGTH], node, BY_LENGTH);
+}
+
+static inline void unlink_extent(extent_index_t *const index, const extent_t *const node)
+{
+    tree_erase(&index->root[BY_START], node, BY_START);
+    tree_erase(&index->root[BY_LENGTH], node, BY_LENGTH);
+}
+
+// Changes an extent's bounds, moving it to its new place in both trees
+static void reshape(extent_index_t *const index, extent_t *const node, const size_t start, const size_t length)
+{
+    unlink_extent(index, node);
+    node->start = start;
+    node->length = length;
+    link_extent(index, node);
+}
+
+static extent_t *extent_new(extent_index_t *const index, const size_t start, const size_t length)
+{
+    extent_t *node = (extent_t *) malloc(sizeof(extent_t));
+    if (node)
+    {
+        index->seed ^= index->seed << 13;
+        index->seed ^= index->seed >> 17;
+        index->seed ^= index->seed << 5;
+        node->start = start;
+        node->length = length;
+        node->priority = index->seed;
+    }
+    return node;
+}
+
+// The extent with the highest start <= id, NULL if there isn't one
+static extent_t *floor_extent(const extent_index_t *const index, const size_t id)
+{
+    extent_t *best = NULL;
+    for (extent_t *cur = index->root[BY_START]; cur != NULL;)
+    {
+        if (cur->start <= id)
+        {
+            best = cur;
+            cur = cur->link[BY_START][1];
+        }
+        else
+        {
+            cur = cur->link[BY_START][0];
+        }
+    }
+    return best;
+}
+
+// The extent with the lowest start > id, NULL if there isn't one
+static extent_t *after_extent(const extent_index_t *const index, const size_t id)
+{
+    extent_t *best = NULL;
+    for (extent_t *cur = index->root[BY_START]; cur != NULL;)
+    {
+        if (cur->start > id)
+        {
+            best = cur;
+            cur = cur->link[BY_START][0];
+        }
+        else
+        {
+            cur = cur->link[BY_START][1];
+        }
+    }
+    return best;
+}
+
+static void free_tree(extent_t *node)
+{
+    while (node != NULL)
+    {
+        free_tree(node->link[BY_START][0]);
+        extent_t *right = node->link[BY_START][1];
+        free(node);
+        node = right;
+    }
+}
+
+static void walk_tree(const extent_t *node, void (*func)(size_t, size_t, void *), void *arg)
+{
+    while (node != NULL)
+    {
+        walk_tree(node->link[BY_START][0], func, arg);
+        func(node->start, node->length, arg);
+        node = node->link[BY_START][1];
+    }
+}
+
+extent_index_t *extent_index_create(void)
+{
+    extent_index_t *index = (extent_index_t *) calloc(1, sizeof(extent_index_t));
+    if (index) index->seed = 0x9E3779B9u;
+    return index;
+}
+
+void extent_index_destroy(extent_index_t *index)
+{
+    if (index)
+    {
+        free_tree(index->root[BY_START]);
+        free(index);
+    }
+}
+
+bool extent_index_insert(extent_index_t *const index, const size_t start, const size_t length)
+{
+    if (!index || length == 0) return true;
+
+    extent_t *before = floor_extent(index, start);
+    extent_t *after = after_extent(index, start);
+    const bool join_before = before != NULL && before->start + before->length == start;
+    const bool join_after = after != NULL && start + length == after->start;
+
+    if (join_before && join_after)
+    {
+        unlink_extent(index, after);
+        reshape(index, before, before->start, before->length + length + after->length);
+        free(after);
+        --index->count;
+    }
+    else if (join_before)
+    {
+        reshape(index, before, before->start, before->length + length);
+    }
+    else if (join_after)
+    {
+        reshape(index, after, start, length + after->length);
+    }
+    else
+    {
+        extent_t *node = extent_new(index, start, length);
+        if (!node) return false;
+        link_extent(index, node);
+        ++index->count;
+    }
+    return true;
+}
+
+bool extent_index_remove(extent_index_t *const index, const size_t start, const size_t length)
+{
+    if (!index || length == 0) return true;
+
+    extent_t *node = floor_extent(index, start);
+    if (!node || start + length > node->start + node->length) return true;
+
+    const size_t head = start - node->start;
+    const size_t tail = node->start + node->length - (start + length);
+    if (head > 0 && tail > 0)
+    {
+        extent_t *rest = extent_new(index, start + length, tail);
+        if (!rest) return false;
+        reshape(index, node, node->start, head);
+        link_extent(index, rest);
+        ++index->count;
+    }
+    else if (head > 0)
+    {
+        reshape(index, node, node->start, head);
+    }
+    else if (tail > 0)
+    {
+        reshape(index, node, start + length, tail);
+    }
+    else
+    {
+        unlink_extent(index, node);
+        free(node);
+        --index->count;
+    }
+    return true;
+}
+
+size_t extent_index_first_fit(const extent_index_t *const index, const size_t length)
+{
+    if (!index) return SIZE_MAX;
+
+    const extent_t *cur = index->root[BY_START];
+    if (subtree_max(cur) < length) return SIZE_MAX;
+    for (;;)
+    {
+        // Leftmost first: the left subtree, then this extent, then the right subtree
+        if (subtree_max(cur->link[BY_START][0]) >= length) cur = cur->link[BY_START][0];
+        else if (cur->length >= length) return cur->start;
+        else cur = cur->link[BY_START][1];
+    }
+}
+
+size_t extent_index_best_fit(const extent_index_t *const index, const size_t length)
+{
+    if (!index) return SIZE_MAX;
+
+    const extent_t *best = NULL;
+    for (const extent_t *cur = index->root[BY_LENGTH]; cur != NULL;)
+    {
+        if (cur->length >= length)
+        {
+            best = cur;
+            cur = cur->link[BY_LENGTH][0];
+        }
+        else
+        {
+            cur = cur->link[BY_LENGTH][1];
+        }
+    }
+    return best != NULL ? best->start : SIZE_MAX;
+}
+
+size_t extent_index_next_free(const extent_index_t *const index, const size_t from)
+{
+    if (!index) return SIZE_MAX;
+
+    const extent_t *node = floor_extent(index, from);
+    if (node && from < node->start + node->length) return from;
+    node = after_extent(index, from);
+    return node != NULL ? node->start : SIZE_MAX;
+}
+
+size_t extent_index_prev_free(const extent_index_t *const index, const size_t from)
+{
+    if (!index) return SIZE_MAX;
+
+    const extent_t *node = floor_extent(index, from);
+    if (!node) return SIZE_MAX;
+    return from < node->start + node->length ? from : node->start + node->length - 1;
+}
+
+size_t extent_index_count(const extent_index_t *const index)
+{
+    return index != NULL ? index->count : 0;
+}
+
+size_t extent_index_largest(const extent_index_t *const index)
+{
+    return index != NULL ? subtree_max(index->root[BY_START]) : 0;
+}
+
+void extent_index_for_each(const extent_index_t *const index, void (*func)(size_t, size_t, void *), void *arg)
+{
+    if (index && func) walk_tree(index->root[BY_START], func, arg);
+}
@@ -0,0 +1,175 @@
+#include "lz.h"
+#include <stdbool.h>
+#include <string.h>
+
+// Sequence layout (same idea as LZ4):
+//  token: high nibble = literal count, low nibble = match length - LZ_MIN_MATCH
+//         a nibble of 15 is continued with 255-valued bytes plus a final byte < 255
+//  literals
+//  2 byte little-endian match offset, then the match length continuation bytes
+// The last sequence carries literals only and simply ends the input.
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 0xFFFF
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1u << LZ_HASH_BITS)
+
+static inline uint32_t lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Knuth multiplicative hash of the next four bytes
+static inline uint32_t lz_hash(const uint8_t *p)
+{
+    return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the 255-continued tail of a length that overflowed its nibble
+static uint8_t *lz_put_length(uint8_t *op, const uint8_t *const oend, size_t len)
+{
+    while (len >= 255)
+    {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t) len;
+    return op;
+}
+
+static uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *const oend, const uint8_t *lit, size_t lit_len,
+                                size_t offset, size_t match_len)
+{
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t) ((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15 && !(op = lz_put_length(op, oend, lit_len - 15))) return NULL;
+
+    if ((size_t) (oend - op) < lit_len) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    // Final literal-only sequence
+    if (match_len == 0) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t) (offset & 0xFF);
+    *op++ = (uint8_t) (offset >> 8);
+
+    match_len -= LZ_MIN_MATCH;
+    *token |= (uint8_t) (match_len >= 15 ? 15 : match_len);
+    if (match_len >= 15 && !(op = lz_put_length(op, oend, match_len - 15))) return NULL;
+    return op;
+}
+
+// Reads a 255-continued length, returns false if the input runs out
+static bool lz_get_length(const uint8_t **ip, const uint8_t *const iend, size_t *len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+size_t lz_compress_bound(const size_t n)
+{
+    return n + n / 255 + 16;
+}
+
+size_t lz_compress(const void *const src, const size_t src_len, void *const dst, const size_t dst_cap)
+{
+    if (!src || !dst) return 0;
+
+    const uint8_t *const base = (const uint8_t *) src;
+    uint8_t *op = (uint8_t *) dst;
+    const uint8_t *const oend = op + dst_cap;
+
+    // Positions are stored +1 so that zero means "empty"
+    uint32_t table[LZ_HASH_SIZE];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0, anchor = 0;
+    while (src_len >= LZ_MIN_MATCH && ip <= src_len - LZ_MIN_MATCH)
+    {
+        const uint32_t h = lz_hash(base + ip);
+        const size_t cand = table[h];
+        table[h] = (uint32_t) (ip + 1);
+
+        if (cand && ip - (cand - 1) <= LZ_MAX_OFFSET && lz_read32(base + cand - 1) == lz_read32(base + ip))
+        {
+            const size_t ref = cand - 1;
+            size_t len = LZ_MIN_MATCH;
+            while (ip + len < src_len && base[ref + len] == base[ip + len])
+            {
+                ++len;
+            }
+
+            op = lz_put_sequence(op, oend, base + anchor, ip - anchor, ip - ref, len);
+            if (!op) return 0;
+
+            ip += len;
+            anchor = ip;
+        }
+        else
+        {
+            ++ip;
+        }
+    }
+
+    op = lz_put_sequence(op, oend, base + anchor, src_len - anchor, 0, 0);
+    if (!op) return 0;
+    return (size_t) (op - (uint8_t *) dst);
+}
+
+size_t lz_decompress(const void *const src, const size_t src_len, void *const dst, const size_t dst_len)
+{
+    if (!src || !dst) return 0;
+
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *const iend = ip + src_len;
+    uint8_t *const out = (uint8_t *) dst;
+    size_t op = 0;
+
+    while (ip < iend)
+    {
+        const uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(&ip, iend, &lit_len)) return 0;
+        if ((size_t) (iend - ip) < lit_len || dst_len - op < lit_len) return 0;
+        memcpy(out + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // Literal-only sequence at the end of the input
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return 0;
+        const size_t offset = (size_t) ip[0] | ((size_t) ip[1] << 8);
+        ip += 2;
+
+        size_t match_len = token & 0x0F;
+        if (match_len == 15 && !lz_get_length(&ip, iend, &match_len)) return 0;
+        match_len += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > op || dst_len - op < match_len) return 0;
+
+        // Byte at a time because the match may overlap what it is producing
+        const uint8_t *ref = out + op - offset;
+        for (size_t i = 0; i < match_len; ++i)
+        {
+            out[op + i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return op == dst_len ? dst_len : 0;
+}
@@ -0,0 +1,220 @@
+/*
+ * Micro-benchmarks for the block store and bitmap, built as hw3_bench when Google Benchmark is
+ * installed. Inputs come from fixed seeds so runs can be compared across builds, e.g.
+ *  ./hw3_bench --benchmark_repetitions=5 --benchmark_format=json > before.json
+ */
+
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "block_store.h"
+#include "bitmap.h"
+
+// Store size for the allocation and I/O benchmarks, large enough that scans outweigh call overhead
+static const size_t BENCH_BLOCKS = 1 << 16;
+
+static const char *const BENCH_IMAGE = "bench.bs";
+static const char *const BENCH_IMAGE_COMPRESSED = "bench.bsz";
+
+// A store of num_blocks with fill_percent of its free blocks allocated at random
+static block_store_t *filled_store(const size_t num_blocks, const int fill_percent, const unsigned policy = BLOCK_STORE_POLICY_FIRST_FIT)
+{
+    block_store_options_t options = {};
+    options.num_blocks = num_blocks;
+    options.policy = policy;
+    block_store_t *bs = block_store_create_ex(&options);
+    if (bs == NULL) return NULL;
+
+    std::vector<size_t> ids;
+    for (size_t id; (id = block_store_allocate(bs)) != SIZE_MAX;) ids.push_back(id);
+    std::mt19937 rng(42);
+    std::shuffle(ids.begin(), ids.end(), rng);
+    size_t keep = ids.size() * fill_percent / 100;
+    for (size_t i = keep; i < ids.size(); ++i) block_store_release(bs, ids[i]);
+    return bs;
+}
+
+// Allocate and release one block at a given fill level and placement policy
+static void BM_Allocate(benchmark::State &state)
+{
+    block_store_t *bs = filled_store(BENCH_BLOCKS, (int)state.range(0), (unsigned)state.range(1));
+    if (bs == NULL) {
+        state.SkipWithError("store creation failed");
+        return;
+    }
+    for (auto _ : state) {
+        size_t id = block_store_allocate(bs);
+        benchmark::DoNotOptimize(id);
+        block_store_release(bs, id);
+    }
+    state.SetItemsProcessed(state.iterations());
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_Allocate)->ArgsProduct({{0, 50, 90, 99}, {BLOCK_STORE_POLICY_FIRST_FIT, BLOCK_STORE_POLICY_NEXT_FIT,
+                                                       BLOCK_STORE_POLICY_BEST_FIT, BLOCK_STORE_POLICY_NEAR}});
+
+// Request and release random ids on a half-full store
+static void BM_RequestReleaseChurn(benchmark::State &state)
+{
+    block_store_t *bs = filled_store(BENCH_BLOCKS, 50);
+    if (bs == NULL) {
+        state.SkipWithError("store creation failed");
+        return;
+    }
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<size_t> pick(0, BENCH_BLOCKS - 1);
+    for (auto _ : state) {
+        size_t id = pick(rng);
+        if (block_store_request(bs, id)) block_store_release(bs, id);
+    }
+    state.SetItemsProcessed(state.iterations());
+    block_store_destroy(bs);
+}
+BENCHMARK(BM_RequestReleaseChurn);
+
+// Block reads and writes, sequential (arg 0) or at random (arg 1)
+static void block_io(benchmark::State &state, const bool writing)
+{
+    block_store_t *bs = filled_store(BENCH_BLOCKS, 100);
+    if (bs == NULL) {
+        state.SkipWithError("store creation failed");
+        return;
+    }
+    std::vector<size_t> order(BENCH_BLOCKS);
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    if (state.range(0)) std::shuffle(order.begin(), order.end(), std::mt19937(3));
+
+    uint8_t buffer[BLOCK_SIZE_BYTES] = {1};
+    size_t next = 0;
+    for (auto _ : state) {
+        size_t id = order[next++ % order.size()];
+        size_t done = writing ? block_store_write(bs, id, buffer) : block_store_read(bs, id, buffer);
+        benchmark::DoNotOptimize(done);
+    }
+    state.SetBytesProcessed(state.iterations() * BLOCK_SIZE_BYTES);
+    block_store_destroy(bs);
+}
+
+static void BM_Read(benchmark::State &state)
+{
+    block_io(state, false);
+}
+BENCHMARK(BM_Read)->Arg(0)->Arg(1);
+
+static void BM_Write(benchmark::State &state)
+{
+    block_io(state, true);
+}
+BENCHMARK(BM_Write)->Arg(0)->Arg(1);
+
+// A bitmap of range(0) bits with range(1) percent of them set: a prefix if prefix, else at random
+static bitmap_t *bench_bitmap(const benchmark::State &state, const bool prefix)
+{
+    size_t bits = (size_t)state.range(0);
+    bitmap_t *bitmap = bitmap_create(bits);
+    if (bitmap == NULL) return NULL;
+    size_t set = bits * (size_t)state.range(1) / 100;
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<size_t> pick(0, 99);
+    for (size_t i = 0; i < bits; ++i) {
+        if (prefix ? i < set : pick(rng) < (size_t)state.range(1)) bitmap_set(bitmap, i);
+    }
+    return bitmap;
+}
+
+static void bitmap_args(benchmark::internal::Benchmark *bench)
+{
+    bench->ArgsProduct({{1 << 10, 1 << 16, 1 << 20}, {1, 50, 99}});
+}
+
+// First zero after a run of set bits covering range(1) percent of the bitmap
+static void BM_BitmapFfz(benchmark::State &state)
+{
+    bitmap_t *bitmap = bench_bitmap(state, true);
+    for (auto _ : state) benchmark::DoNotOptimize(bitmap_ffz(bitmap));
+    state.SetBytesProcessed(state.iterations() * (state.range(0) / 8));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_BitmapFfz)->Apply(bitmap_args);
+
+static void BM_BitmapTotalSet(benchmark::State &state)
+{
+    bitmap_t *bitmap = bench_bitmap(state, false);
+    for (auto _ : state) benchmark::DoNotOptimize(bitmap_total_set(bitmap));
+    state.SetBytesProcessed(state.iterations() * (state.range(0) / 8));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_BitmapTotalSet)->Apply(bitmap_args);
+
+static void count_bit(size_t bit, void *arg)
+{
+    *(size_t *)arg += bit;
+}
+
+static void BM_BitmapForEach(benchmark::State &state)
+{
+    bitmap_t *bitmap = bench_bitmap(state, false);
+    for (auto _ : state) {
+        size_t sum = 0;
+        bitmap_for_each(bitmap, count_bit, &sum);
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetBytesProcessed(state.iterations() * (state.range(0) / 8));
+    bitmap_destroy(bitmap);
+}
+BENCHMARK(BM_BitmapForEach)->Apply(bitmap_args);
+
+// A store of range(0) blocks, half of them allocated and written with a per-block pattern
+static block_store_t *written_store(const benchmark::State &state)
+{
+    block_store_t *bs = filled_store((size_t)state.range(0), 50);
+    uint8_t buffer[BLOCK_SIZE_BYTES] = {};
+    for (size_t id = 0; bs != NULL && id < (size_t)state.range(0); ++id) {
+        if (block_store_get_refs(bs, id) == 0) continue;
+        for (size_t i = 0; i < sizeof(buffer); ++i) buffer[i] = (uint8_t)(id + i);
+        block_store_write(bs, id, buffer);
+    }
+    return bs;
+}
+
+// Raw (arg 1 = 0) or compressed (arg 1 = 1) images
+static void BM_Serialize(benchmark::State &state)
+{
+    block_store_t *bs = written_store(state);
+    bool compressed = state.range(1) != 0;
+    for (auto _ : state) {
+        size_t written = compressed ? block_store_serialize_compressed(bs, BENCH_IMAGE_COMPRESSED)
+                                    : block_store_serialize(bs, BENCH_IMAGE);
+        if (written == 0) state.SkipWithError("serialize failed");
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * BLOCK_SIZE_BYTES);
+    block_store_destroy(bs);
+    unlink(compressed ? BENCH_IMAGE_COMPRESSED : BENCH_IMAGE);
+}
+BENCHMARK(BM_Serialize)->ArgsProduct({{1 << 16, 1 << 20}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+static void BM_Deserialize(benchmark::State &state)
+{
+    block_store_t *bs = written_store(state);
+    bool compressed = state.range(1) != 0;
+    size_t written = compressed ? block_store_serialize_compressed(bs, BENCH_IMAGE_COMPRESSED)
+                                : block_store_serialize(bs, BENCH_IMAGE);
+    block_store_destroy(bs);
+    if (written == 0) {
+        state.SkipWithError("serialize failed");
+        return;
+    }
+    for (auto _ : state) {
+        block_store_t *loaded = compressed ? block_store_deserialize_compressed(BENCH_IMAGE_COMPRESSED)
+                                           : block_store_deserialize(BENCH_IMAGE);
+        if (loaded == NULL) state.SkipWithError("deserialize failed");
+        block_store_destroy(loaded);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0) * BLOCK_SIZE_BYTES);
+    unlink(compressed ? BENCH_IMAGE_COMPRESSED : BENCH_IMAGE);
+}
+BENCHMARK(BM_Deserialize)->ArgsProduct({{1 << 16, 1 << 20}, {0, 1}})->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -3,7 +3,20 @@
 
 #include <gtest/gtest.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include <algorithm>
 #include "block_store.h"
+#include "lz.h"
+#include "block_cache.h"
+#include "block_store_queue.h"
+#include "block_store.hpp"
+#include "block_store_fixed.hpp"
+#include "bitmap_inline.h"
 
 // The object is opaque, so we can't really test things directly....
 
@@ -250,7 +263,7 @@ TEST(block_store_write_read, valid_write) {
 TEST(block_store_write_read, null_bs_write) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_write(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
 
@@ -278,7 +291,7 @@ TEST(block_store_write_read, null_buffer_write) {
 TEST(block_store_write_read, null_bs_read) {
     size_t bytesWritten;
     // Want to give buffer a valid value since we are testing bs.
-    int buffer;
+    int buffer = 0;
     bytesWritten = block_store_read(NULL, 0, &buffer);
     ASSERT_EQ(bytesWritten, 0);
     score += 2;
@@ -509,3 +522,1492 @@ TEST(block_store_deserialize, null_filename)
     score += 2;
 }
 
+
+
+TEST(block_store_serialize_compressed, round_trip)
+{
+    block_store_t *bsWrite = block_store_create();
+    ASSERT_NE(nullptr, bsWrite) << "block_store_create returned NULL when it should not have\n";
+
+    // A few repetitive blocks, one random-looking one, and an allocated but zero block
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 20; id < 30; ++id) {
+        ASSERT_EQ(true, block_store_request(bsWrite, id));
+        memset(write_buffer, (int)('a' + id % 3), BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, id, write_buffer));
+    }
+    ASSERT_EQ(true, block_store_request(bsWrite, 300));
+    for (size_t i = 0; i < BLOCK_SIZE_BYTES; ++i) {
+        write_buffer[i] = (uint8_t)(i * 131 + 7);
+    }
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, 300, write_buffer));
+    ASSERT_EQ(true, block_store_request(bsWrite, 400));
+
+    size_t bytesSerialized = block_store_serialize_compressed(bsWrite, "test.bsz");
+    ASSERT_NE(0, bytesSerialized);
+    ASSERT_LT(bytesSerialized, BLOCK_STORE_NUM_BYTES / 5);
+
+    struct stat st;
+    ASSERT_EQ(0, stat("test.bsz", &st));
+    ASSERT_EQ(bytesSerialized, (size_t)st.st_size);
+
+    block_store_t *bsRead = block_store_deserialize_compressed("test.bsz");
+    ASSERT_NE(nullptr, bsRead);
+    ASSERT_EQ(block_store_get_used_blocks(bsWrite), block_store_get_used_blocks(bsRead));
+    ASSERT_EQ(false, block_store_request(bsRead, 400));
+
+    uint8_t expected[BLOCK_SIZE_BYTES], actual[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsWrite, id, expected));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsRead, id, actual));
+        ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES)) << "block " << id << " differs\n";
+    }
+
+    block_store_destroy(bsWrite);
+    block_store_destroy(bsRead);
+}
+
+TEST(block_store_serialize_compressed, null_and_bad_input)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+    ASSERT_EQ(0, block_store_serialize_compressed(bs, NULL));
+    ASSERT_EQ(0, block_store_serialize_compressed(NULL, "test.bsz"));
+    ASSERT_EQ(nullptr, block_store_deserialize_compressed(NULL));
+
+    // A plain image is not a compressed one
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+    ASSERT_EQ(nullptr, block_store_deserialize_compressed("test.bs"));
+    block_store_destroy(bs);
+}
+
+TEST(lz, round_trip)
+{
+    const size_t len = 8192;
+    uint8_t *src = (uint8_t *) malloc(len);
+    uint8_t *packed = (uint8_t *) malloc(lz_compress_bound(len));
+    uint8_t *unpacked = (uint8_t *) malloc(len);
+    ASSERT_NE(nullptr, src);
+    ASSERT_NE(nullptr, packed);
+    ASSERT_NE(nullptr, unpacked);
+
+    // Runs, short repeats and noise in one buffer
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < len; ++i) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = i < 2000 ? 0 : (i < 5000 ? (uint8_t)(i % 7) : (uint8_t)(seed >> 16));
+    }
+
+    size_t packed_len = lz_compress(src, len, packed, lz_compress_bound(len));
+    ASSERT_NE(0, packed_len);
+    ASSERT_LT(packed_len, len);
+    ASSERT_EQ(len, lz_decompress(packed, packed_len, unpacked, len));
+    ASSERT_EQ(0, memcmp(src, unpacked, len));
+
+    // Truncated input must be rejected rather than overrun
+    ASSERT_EQ(0, lz_decompress(packed, packed_len / 2, unpacked, len));
+
+    free(src);
+    free(packed);
+    free(unpacked);
+}
+
+TEST(block_store_open_lazy, read_write_and_reserialize)
+{
+    block_store_t *bsWrite = block_store_create();
+    ASSERT_NE(nullptr, bsWrite) << "block_store_create returned NULL when it should not have\n";
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < 200; id += 3) {
+        ASSERT_EQ(true, block_store_request(bsWrite, id));
+        memset(write_buffer, (int)(id + 1), BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, id, write_buffer));
+    }
+    ASSERT_NE(0, block_store_serialize_compressed(bsWrite, "test.bsz"));
+
+    block_store_t *bsLazy = block_store_open_lazy("test.bsz");
+    ASSERT_NE(nullptr, bsLazy);
+    ASSERT_EQ(block_store_get_used_blocks(bsWrite), block_store_get_used_blocks(bsLazy));
+    ASSERT_EQ(false, block_store_request(bsLazy, 3));
+
+    // Writing into a chunk that hasn't been loaded must keep its neighbours
+    memset(write_buffer, 0x5A, BLOCK_SIZE_BYTES);
+    ASSERT_EQ(true, block_store_request(bsLazy, 130));
+    ASSERT_EQ(true, block_store_request(bsWrite, 130));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsLazy, 130, write_buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, 130, write_buffer));
+
+    uint8_t expected[BLOCK_SIZE_BYTES], actual[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsWrite, id, expected));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsLazy, id, actual));
+        ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES)) << "block " << id << " differs\n";
+    }
+
+    ASSERT_NE(0, block_store_serialize_compressed(bsLazy, "test_lazy.bsz"));
+    block_store_t *bsRead = block_store_deserialize_compressed("test_lazy.bsz");
+    ASSERT_NE(nullptr, bsRead);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsRead, 130, actual));
+    ASSERT_EQ(0, memcmp(write_buffer, actual, BLOCK_SIZE_BYTES));
+
+    block_store_destroy(bsRead);
+    block_store_destroy(bsLazy);
+    block_store_destroy(bsWrite);
+}
+
+TEST(block_store_open_lazy, loads_chunks_on_demand)
+{
+    block_store_t *bsWrite = block_store_create();
+    ASSERT_NE(nullptr, bsWrite) << "block_store_create returned NULL when it should not have\n";
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, '~', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(true, block_store_request(bsWrite, 10));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, 10, write_buffer));
+    size_t bytesSerialized = block_store_serialize_compressed(bsWrite, "test.bsz");
+    ASSERT_NE(0, bytesSerialized);
+
+    block_store_t *bsLazy = block_store_open_lazy("test.bsz");
+    ASSERT_NE(nullptr, bsLazy);
+    ASSERT_EQ(0u, block_store_get_physical_blocks(bsLazy));
+
+    // Cut the chunk records off: only the data chunk should notice
+    ASSERT_EQ(0, truncate("test.bsz", (off_t)(bytesSerialized - 1)));
+    uint8_t read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsLazy, 300, read_buffer));
+    ASSERT_EQ(0, block_store_read(bsLazy, 10, read_buffer));
+    ASSERT_EQ(0u, block_store_get_physical_blocks(bsLazy));
+    block_store_destroy(bsLazy);
+
+    // Memory is only taken for chunks as they're loaded; chunks of zeros never take any
+    ASSERT_NE(0, block_store_serialize_compressed(bsWrite, "test.bsz"));
+    bsLazy = block_store_open_lazy("test.bsz");
+    ASSERT_NE(nullptr, bsLazy);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsLazy, 300, read_buffer));
+    ASSERT_EQ(0u, block_store_get_physical_blocks(bsLazy));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsLazy, 10, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(128u, block_store_get_physical_blocks(bsLazy)); // One chunk
+    block_store_destroy(bsLazy);
+    block_store_destroy(bsWrite);
+
+    ASSERT_EQ(nullptr, block_store_open_lazy(NULL));
+    ASSERT_EQ(nullptr, block_store_open_lazy("does_not_exist.bsz"));
+}
+
+TEST(block_store_serialize_ex, direct_round_trip)
+{
+    block_store_t *bsWrite = block_store_create();
+    ASSERT_NE(nullptr, bsWrite) << "block_store_create returned NULL when it should not have\n";
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, 'D', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(true, block_store_request(bsWrite, 511));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bsWrite, 511, write_buffer));
+
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize_ex(bsWrite, "test.bs", BLOCK_STORE_IO_DIRECT));
+    struct stat st;
+    ASSERT_EQ(0, stat("test.bs", &st));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, st.st_size);
+
+    // Both readers must agree regardless of how the image was written
+    block_store_t *bsDirect = block_store_deserialize_ex("test.bs", BLOCK_STORE_IO_DIRECT);
+    block_store_t *bsBuffered = block_store_deserialize("test.bs");
+    ASSERT_NE(nullptr, bsDirect);
+    ASSERT_NE(nullptr, bsBuffered);
+    ASSERT_EQ(false, block_store_request(bsDirect, 511));
+
+    uint8_t read_buffer[BLOCK_SIZE_BYTES];
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsDirect, 511, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bsBuffered, 511, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+
+    block_store_destroy(bsDirect);
+    block_store_destroy(bsBuffered);
+    block_store_destroy(bsWrite);
+
+    ASSERT_EQ(nullptr, block_store_deserialize_ex(NULL, BLOCK_STORE_IO_DIRECT));
+    ASSERT_EQ(0, block_store_serialize_ex(NULL, "test.bs", BLOCK_STORE_IO_DIRECT));
+}
+
+TEST(block_store_snapshot, point_in_time_view)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    uint8_t before[BLOCK_SIZE_BYTES], after[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    memset(before, 'b', BLOCK_SIZE_BYTES);
+    memset(after, 'a', BLOCK_SIZE_BYTES);
+    ASSERT_EQ(true, block_store_request(bs, 5));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, before));
+
+    block_store_t *snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap);
+
+    // The live store moves on, the snapshot doesn't
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 5, after));
+    ASSERT_EQ(true, block_store_request(bs, 6));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, 5, read_buffer));
+    ASSERT_EQ(0, memcmp(before, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 5, read_buffer));
+    ASSERT_EQ(0, memcmp(after, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(block_store_get_used_blocks(bs) - 1, block_store_get_used_blocks(snap));
+
+    // Snapshots are read-only
+    ASSERT_EQ(0, block_store_write(snap, 5, after));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(snap));
+    ASSERT_EQ(false, block_store_request(snap, 7));
+    block_store_release(snap, 5);
+    ASSERT_EQ(false, block_store_request(snap, 5));
+
+    // And outlive the store they came from
+    block_store_destroy(bs);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, 5, read_buffer));
+    ASSERT_EQ(0, memcmp(before, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(snap, "test.bs"));
+    block_store_snapshot_release(snap);
+
+    ASSERT_EQ(nullptr, block_store_snapshot(NULL));
+    block_store_snapshot_release(NULL);
+}
+
+TEST(block_store_snapshot, concurrent_reader)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs) << "block_store_create returned NULL when it should not have\n";
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, 1, BLOCK_SIZE_BYTES);
+    for (size_t id = 0; id < 100; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, write_buffer));
+    }
+    block_store_t *snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap);
+
+    // Readers of the snapshot keep seeing ones while the store is rewritten underneath them
+    bool consistent = true;
+    std::thread reader([snap, &consistent]() {
+        uint8_t read_buffer[BLOCK_SIZE_BYTES];
+        for (int pass = 0; pass < 200; ++pass) {
+            for (size_t id = 0; id < 100; ++id) {
+                block_store_read(snap, id, read_buffer);
+                for (size_t i = 0; i < BLOCK_SIZE_BYTES; ++i) {
+                    if (read_buffer[i] != 1) consistent = false;
+                }
+            }
+        }
+        block_store_snapshot_release(snap);
+    });
+    for (int pass = 2; pass < 50; ++pass) {
+        memset(write_buffer, pass, BLOCK_SIZE_BYTES);
+        for (size_t id = 0; id < 100; ++id) {
+            block_store_write(bs, id, write_buffer);
+        }
+    }
+    reader.join();
+    ASSERT_EQ(true, consistent);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_dedup, shares_identical_blocks)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_DEDUP;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs) << "block_store_create_ex returned NULL when it should not have\n";
+    ASSERT_EQ(0, block_store_get_physical_blocks(bs));
+
+    uint8_t header[BLOCK_SIZE_BYTES], other[BLOCK_SIZE_BYTES], zeros[BLOCK_SIZE_BYTES] = {0};
+    uint8_t read_buffer[BLOCK_SIZE_BYTES];
+    memset(header, 'H', BLOCK_SIZE_BYTES);
+    memset(other, 'O', BLOCK_SIZE_BYTES);
+
+    for (size_t id = 0; id < 100; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, header));
+    }
+    ASSERT_EQ(1, block_store_get_physical_blocks(bs));
+
+    // Changing one copy leaves the others alone
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 50, other));
+    ASSERT_EQ(2, block_store_get_physical_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 49, read_buffer));
+    ASSERT_EQ(0, memcmp(header, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 50, read_buffer));
+    ASSERT_EQ(0, memcmp(other, read_buffer, BLOCK_SIZE_BYTES));
+
+    // Zero blocks don't take any storage
+    for (size_t id = 0; id < 100; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, zeros));
+    }
+    ASSERT_EQ(0, block_store_get_physical_blocks(bs));
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+    block_store_destroy(bs);
+
+    ASSERT_EQ(SIZE_MAX, block_store_get_physical_blocks(NULL));
+}
+
+TEST(block_store_dedup, matches_plain_store_under_churn)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_DEDUP;
+    block_store_t *dedup = block_store_create_ex(&options);
+    block_store_t *plain = block_store_create_ex(NULL);
+    ASSERT_NE(nullptr, dedup);
+    ASSERT_NE(nullptr, plain);
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_physical_blocks(plain));
+
+    // A small alphabet of contents so blocks keep colliding, merging and splitting
+    uint32_t seed = 99;
+    uint8_t write_buffer[BLOCK_SIZE_BYTES];
+    for (int i = 0; i < 20000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        size_t id = (seed >> 8) % BLOCK_STORE_NUM_BLOCKS;
+        memset(write_buffer, (int)((seed >> 20) % 40), BLOCK_SIZE_BYTES);
+        write_buffer[0] = (uint8_t)((seed >> 4) % 3);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(dedup, id, write_buffer));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(plain, id, write_buffer));
+    }
+    ASSERT_LE(block_store_get_physical_blocks(dedup), 120);
+
+    uint8_t expected[BLOCK_SIZE_BYTES], actual[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(plain, id, expected));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(dedup, id, actual));
+        ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES)) << "block " << id << " differs\n";
+    }
+
+    // Images of a dedup store look like any other
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(dedup, "test.bs"));
+    block_store_t *loaded = block_store_deserialize("test.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, 7, actual));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(plain, 7, expected));
+    ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES));
+
+    block_store_destroy(loaded);
+    block_store_destroy(dedup);
+    block_store_destroy(plain);
+}
+
+TEST(block_store_backing, larger_than_cache_round_trip)
+{
+    unlink("test_backing.bs");
+    block_store_options_t options = {};
+    options.num_blocks = 128 * 64;
+    options.backing_file = "test_backing.bs";
+    options.cache_chunks = 4;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(options.num_blocks, block_store_get_block_count(bs));
+
+    // Every block gets its own contents, so evicted frames have to be written back to be read again
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    size_t allocated = 0;
+    for (size_t id = 0; id < options.num_blocks; id += 3) {
+        if (!block_store_request(bs, id)) continue;
+        memset(write_buffer, (int)(id % 251) + 1, BLOCK_SIZE_BYTES);
+        memcpy(write_buffer, &id, sizeof(id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, write_buffer));
+        ++allocated;
+    }
+    size_t used = block_store_get_used_blocks(bs);
+    ASSERT_EQ(options.num_blocks - used, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+
+    // Reopen, taking the size from the file
+    options.num_blocks = 0;
+    bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(128 * 64, block_store_get_block_count(bs));
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    for (size_t id = 0; id < 128 * 64; id += 3) {
+        memset(write_buffer, (int)(id % 251) + 1, BLOCK_SIZE_BYTES);
+        memcpy(write_buffer, &id, sizeof(id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, read_buffer));
+        ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES)) << "block " << id << " differs\n";
+    }
+
+    // Images of a file-backed store stream through the cache and reload in memory
+    ASSERT_EQ(128 * 64 * BLOCK_SIZE_BYTES, block_store_serialize(bs, "test.bs"));
+    block_store_t *loaded = block_store_deserialize("test.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(128 * 64, block_store_get_block_count(loaded));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, 300, read_buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 300, write_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_NE(0, allocated);
+
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+    ASSERT_TRUE(block_store_flush(bs));
+    ASSERT_TRUE(block_store_flush(loaded));
+    block_store_destroy(loaded);
+    block_store_destroy(bs);
+
+    // A file of the wrong size for the requested geometry is refused
+    options.num_blocks = 128 * 32;
+    ASSERT_EQ(nullptr, block_store_create_ex(&options));
+    options.num_blocks = 100;
+    options.backing_file = NULL;
+    ASSERT_EQ(nullptr, block_store_create_ex(&options));
+}
+
+TEST(block_cache, scan_does_not_evict_hot_set)
+{
+    int fd = open("test_cache.bin", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    ASSERT_NE(-1, fd);
+    block_cache_t *cache = block_cache_create(fd, 64, 100, 8);
+    ASSERT_NE(nullptr, cache);
+
+    // Hot chunks are touched, pushed out of probation by other traffic, then touched again
+    for (size_t chunk = 0; chunk < 4; ++chunk) ASSERT_NE(nullptr, block_cache_get(cache, chunk, true));
+    for (size_t chunk = 10; chunk < 18; ++chunk) ASSERT_NE(nullptr, block_cache_get(cache, chunk, false));
+    for (size_t chunk = 0; chunk < 4; ++chunk) ASSERT_NE(nullptr, block_cache_get(cache, chunk, false));
+
+    // A long one-off scan only cycles the probation frames
+    for (size_t chunk = 20; chunk < 100; ++chunk) ASSERT_NE(nullptr, block_cache_get(cache, chunk, false));
+    size_t misses = block_cache_misses(cache);
+    for (size_t chunk = 0; chunk < 4; ++chunk) {
+        uint8_t *data = block_cache_get(cache, chunk, false);
+        ASSERT_NE(nullptr, data);
+        data[0] = (uint8_t)chunk + 1;
+    }
+    ASSERT_EQ(misses, block_cache_misses(cache));
+
+    ASSERT_TRUE(block_cache_destroy(cache));
+    close(fd);
+}
+
+TEST(block_cache, sequential_reads_grow_readahead)
+{
+    int fd = open("test_cache.bin", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    ASSERT_NE(-1, fd);
+    ASSERT_EQ(0, ftruncate(fd, 4096 * 1024));
+    block_cache_t *cache = block_cache_create(fd, 4096, 1024, 8);
+    ASSERT_NE(nullptr, cache);
+
+    // Scattered chunks are no pattern at all
+    for (size_t chunk : {500, 3, 77, 900, 12, 640}) ASSERT_NE(nullptr, block_cache_get(cache, chunk, false));
+    ASSERT_EQ(0, block_cache_readahead(cache));
+
+    // A run keeps ahead of itself, with a window that grows past the cache size
+    size_t previous = 0, steps = 0;
+    for (size_t chunk = 100; chunk < 400; ++chunk) {
+        ASSERT_NE(nullptr, block_cache_get(cache, chunk, false));
+        size_t advised = block_cache_readahead(cache);
+        if (advised != previous) ++steps;
+        previous = advised;
+    }
+    ASSERT_GE(previous, 299);
+    ASSERT_LE(previous, 300 + 256);
+    ASSERT_LT(steps, 40);
+
+    ASSERT_TRUE(block_cache_destroy(cache));
+    close(fd);
+}
+
+TEST(block_cache, write_back_coalesces_adjacent_chunks)
+{
+    int fd = open("test_cache.bin", O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    ASSERT_NE(-1, fd);
+    block_cache_t *cache = block_cache_create(fd, 64, 32, 16);
+    ASSERT_NE(nullptr, cache);
+    block_cache_set_writeback(cache, 16, 60000);
+
+    // Two runs of adjacent chunks, dirtied out of order
+    for (size_t chunk : {5, 3, 10, 4, 6, 11}) {
+        uint8_t *data = block_cache_get(cache, chunk, true);
+        ASSERT_NE(nullptr, data);
+        memset(data, (int)chunk, 64);
+    }
+    ASSERT_EQ(0, block_cache_writes(cache));
+    ASSERT_TRUE(block_cache_flush(cache));
+    ASSERT_EQ(2, block_cache_writes(cache));
+    ASSERT_TRUE(block_cache_flush(cache));
+    ASSERT_EQ(2, block_cache_writes(cache));
+
+    uint8_t on_disk[64];
+    for (size_t chunk : {3, 4, 5, 6, 10, 11}) {
+        ASSERT_EQ(64, pread(fd, on_disk, 64, (off_t)(chunk * 64)));
+        ASSERT_EQ(chunk, on_disk[0]);
+        ASSERT_EQ(chunk, on_disk[63]);
+    }
+
+    // The size threshold flushes on the next call once enough chunks are dirty
+    block_cache_set_writeback(cache, 3, 60000);
+    for (size_t chunk = 20; chunk < 23; ++chunk) ASSERT_NE(nullptr, block_cache_get(cache, chunk, true));
+    ASSERT_EQ(2, block_cache_writes(cache));
+    ASSERT_NE(nullptr, block_cache_get(cache, 0, false));
+    ASSERT_EQ(3, block_cache_writes(cache));
+
+    // So does the age threshold
+    block_cache_set_writeback(cache, 16, 1);
+    ASSERT_NE(nullptr, block_cache_get(cache, 25, true));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    ASSERT_NE(nullptr, block_cache_get(cache, 0, false));
+    ASSERT_EQ(4, block_cache_writes(cache));
+
+    ASSERT_TRUE(block_cache_destroy(cache));
+    close(fd);
+}
+
+TEST(block_store_txn, commit_and_abort)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    size_t doomed = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, doomed);
+    size_t used = block_store_get_used_blocks(bs);
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, 0x5A, sizeof(write_buffer));
+
+    // Nothing but the claims is visible until commit
+    block_store_txn_t *txn = block_store_txn_begin(bs);
+    ASSERT_NE(nullptr, txn);
+    size_t a = block_store_txn_allocate(txn), b = block_store_txn_allocate(txn);
+    ASSERT_NE(SIZE_MAX, a);
+    ASSERT_NE(SIZE_MAX, b);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_txn_write(txn, a, write_buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_txn_write(txn, b, write_buffer));
+    ASSERT_TRUE(block_store_txn_release(txn, doomed));
+    ASSERT_EQ(used + 2, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, a, read_buffer));
+    ASSERT_NE(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_TRUE(block_store_txn_commit(txn));
+    ASSERT_EQ(used + 1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, b, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+
+    // Abort hands the claims back and drops the writes
+    txn = block_store_txn_begin(bs);
+    size_t c = block_store_txn_allocate(txn);
+    ASSERT_NE(SIZE_MAX, c);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_txn_write(txn, c, write_buffer));
+    block_store_txn_abort(txn);
+    ASSERT_EQ(used + 1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, c, read_buffer));
+    ASSERT_NE(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+
+    // Releasing a free block fails validation, so nothing is applied
+    txn = block_store_txn_begin(bs);
+    c = block_store_txn_allocate(txn);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_txn_write(txn, c, write_buffer));
+    ASSERT_TRUE(block_store_txn_release(txn, BLOCK_STORE_NUM_BLOCKS - 1));
+    ASSERT_FALSE(block_store_txn_commit(txn));
+    ASSERT_EQ(used + 1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, c, read_buffer));
+    ASSERT_NE(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+
+    ASSERT_EQ(0, block_store_txn_write(NULL, 0, write_buffer));
+    ASSERT_FALSE(block_store_txn_commit(NULL));
+    block_store_txn_abort(NULL);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_txn, readers_never_see_half_a_commit)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    std::thread writer([bs]() {
+        uint8_t data[BLOCK_SIZE_BYTES] = {0};
+        for (uint32_t round = 1; round <= 2000; ++round) {
+            memcpy(data, &round, sizeof(round));
+            block_store_txn_t *txn = block_store_txn_begin(bs);
+            for (size_t id = 10; id < 20; ++id) block_store_txn_write(txn, id, data);
+            block_store_txn_commit(txn);
+        }
+    });
+
+    // Snapshots are taken under the store's lock, so they land between commits
+    for (int i = 0; i < 500; ++i) {
+        block_store_t *snap = block_store_snapshot(bs);
+        ASSERT_NE(nullptr, snap);
+        uint8_t first[BLOCK_SIZE_BYTES], other[BLOCK_SIZE_BYTES];
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, 10, first));
+        for (size_t id = 11; id < 20; ++id) {
+            ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, id, other));
+            ASSERT_EQ(0, memcmp(first, other, BLOCK_SIZE_BYTES));
+        }
+        block_store_snapshot_release(snap);
+    }
+
+    writer.join();
+    block_store_destroy(bs);
+}
+
+TEST(block_store_txn, failed_write_rolls_back)
+{
+    unlink("test_backing.bs");
+    block_store_options_t options = {};
+    options.num_blocks = 128 * 4;
+    options.backing_file = "test_backing.bs";
+    options.cache_chunks = 2;
+    options.dirty_chunks = 64;
+    options.dirty_ms = 60000;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+
+    // One block in each of chunks 1 to 3, all written back to the file
+    const size_t ids[3] = {200, 300, 400};
+    uint8_t old_data[3][BLOCK_SIZE_BYTES], new_data[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_TRUE(block_store_request(bs, ids[i]));
+        memset(old_data[i], (int)i + 1, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, ids[i], old_data[i]));
+    }
+    ASSERT_TRUE(block_store_flush(bs));
+    size_t used = block_store_get_used_blocks(bs);
+    memset(new_data, 0xEE, sizeof(new_data));
+
+    block_store_txn_t *txn = block_store_txn_begin(bs);
+    ASSERT_NE(SIZE_MAX, block_store_txn_allocate(txn));
+    for (size_t i = 0; i < 3; ++i) ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_txn_write(txn, ids[i], new_data));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_txn_write(txn, ids[0], new_data));
+    ASSERT_TRUE(block_store_txn_release(txn, ids[2]));
+    ASSERT_FALSE(block_store_txn_release(txn, ids[2]));
+
+    // With writes past chunk 0 refused, the third chunk written has to evict a dirty frame and fails
+    struct rlimit saved, limit;
+    ASSERT_EQ(0, getrlimit(RLIMIT_FSIZE, &saved));
+    limit = saved;
+    limit.rlim_cur = 128 * BLOCK_SIZE_BYTES;
+    void (*saved_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+    ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &limit));
+    bool committed = block_store_txn_commit(txn);
+    ASSERT_EQ(0, setrlimit(RLIMIT_FSIZE, &saved));
+    signal(SIGXFSZ, saved_handler);
+    ASSERT_FALSE(committed);
+
+    // None of it shows: not the writes that went through, the release or the claim
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    for (size_t i = 0; i < 3; ++i) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, ids[i], read_buffer));
+        ASSERT_EQ(0, memcmp(old_data[i], read_buffer, BLOCK_SIZE_BYTES)) << "block " << ids[i];
+    }
+    ASSERT_TRUE(block_store_flush(bs));
+    block_store_destroy(bs);
+    unlink("test_backing.bs");
+}
+
+TEST(block_store_queue, writes_then_reads_through_the_rings)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    block_store_queue_t *queue = block_store_queue_create(bs, 32, 4);
+    ASSERT_NE(nullptr, queue);
+
+    // More requests than fit in the rings: keep submitting and reaping until all are done
+    static uint8_t data[200][BLOCK_SIZE_BYTES];
+    block_store_sqe_t sqes[200];
+    for (size_t i = 0; i < 200; ++i) {
+        memset(data[i], (int)i + 1, BLOCK_SIZE_BYTES);
+        sqes[i] = {BLOCK_STORE_OP_WRITE, i + 200, data[i], i};
+    }
+    block_store_cqe_t cqes[32];
+    size_t submitted = 0, completed = 0;
+    while (completed < 200) {
+        submitted += block_store_queue_submit(queue, sqes + submitted, 200 - submitted);
+        size_t n = block_store_queue_reap(queue, cqes, 32, 1);
+        for (size_t i = 0; i < n; ++i) ASSERT_EQ(BLOCK_SIZE_BYTES, cqes[i].result);
+        completed += n;
+    }
+    ASSERT_EQ(0, block_store_queue_reap(queue, cqes, 32, 0));
+
+    // Read them back, matching completions to requests by user_data
+    static uint8_t read_back[32][BLOCK_SIZE_BYTES];
+    for (size_t i = 0; i < 32; ++i) sqes[i] = {BLOCK_STORE_OP_READ, i * 6 + 200, read_back[i], i};
+    ASSERT_EQ(32, block_store_queue_submit(queue, sqes, 32));
+    ASSERT_EQ(0, block_store_queue_submit(queue, sqes, 1));
+    ASSERT_EQ(32, block_store_queue_reap(queue, cqes, 32, 32));
+    for (size_t i = 0; i < 32; ++i) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, cqes[i].result);
+        size_t tag = (size_t)cqes[i].user_data;
+        ASSERT_EQ(0, memcmp(data[tag * 6], read_back[tag], BLOCK_SIZE_BYTES));
+    }
+
+    // Allocations race each other but never hand out the same block twice
+    size_t used = block_store_get_used_blocks(bs);
+    for (size_t i = 0; i < 20; ++i) sqes[i] = {BLOCK_STORE_OP_ALLOCATE, 0, NULL, i};
+    ASSERT_EQ(20, block_store_queue_submit(queue, sqes, 20));
+    ASSERT_EQ(20, block_store_queue_reap(queue, cqes, 32, 20));
+    for (size_t i = 0; i < 20; ++i) sqes[i] = {BLOCK_STORE_OP_RELEASE, cqes[i].result, NULL, i};
+    ASSERT_EQ(used + 20, block_store_get_used_blocks(bs));
+    ASSERT_EQ(20, block_store_queue_submit(queue, sqes, 20));
+
+    // Destroy waits for the releases still in flight
+    block_store_queue_destroy(queue);
+    ASSERT_EQ(used, block_store_get_used_blocks(bs));
+    ASSERT_EQ(nullptr, block_store_queue_create(bs, 0, 1));
+    block_store_destroy(bs);
+}
+
+static blockstore::Task<bool> round_trip(blockstore::Store &store, uint8_t fill)
+{
+    size_t id = co_await store.allocate();
+    if (id == SIZE_MAX) co_return false;
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, fill, sizeof(write_buffer));
+    if (co_await store.write(id, write_buffer) != BLOCK_SIZE_BYTES) co_return false;
+    if (co_await store.read(id, read_buffer) != BLOCK_SIZE_BYTES) co_return false;
+    co_return memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES) == 0;
+}
+
+static blockstore::Task<size_t> round_trips(blockstore::Store &store, uint8_t fill, size_t count)
+{
+    size_t ok = 0;
+    for (size_t i = 0; i < count; ++i) ok += co_await round_trip(store, fill);
+    co_return ok;
+}
+
+TEST(block_store_coroutines, awaitable_read_write_allocate)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    size_t used = block_store_get_used_blocks(bs);
+    {
+        blockstore::ThreadPool pool(4);
+        blockstore::Store store(bs, pool);
+        ASSERT_TRUE(blockstore::sync_wait(round_trip(store, 0x11)));
+
+        // Several callers at once, each a chain of nested tasks
+        std::vector<std::thread> callers;
+        std::vector<size_t> results(8);
+        for (size_t t = 0; t < 8; ++t) {
+            callers.emplace_back([&store, &results, t]() {
+                results[t] = blockstore::sync_wait(round_trips(store, (uint8_t)(t + 1), 40));
+            });
+        }
+        for (std::thread &caller : callers) caller.join();
+        for (size_t ok : results) ASSERT_EQ(40, ok);
+    }
+    ASSERT_EQ(used + 1 + 8 * 40, block_store_get_used_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_fixed, matches_c_store)
+{
+    using Fixed = blockstore::BlockStore<BLOCK_STORE_NUM_BLOCKS, BLOCK_SIZE_BYTES>;
+    static_assert(Fixed::total_blocks() == BLOCK_STORE_NUM_BLOCKS, "geometry is a constant");
+    auto fixed = std::make_unique<Fixed>();
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(block_store_get_used_blocks(bs), fixed->used_blocks());
+
+    // The same random mix of calls gives the same results on both
+    uint32_t seed = 7;
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], expected[BLOCK_SIZE_BYTES], actual[BLOCK_SIZE_BYTES];
+    for (int i = 0; i < 5000; ++i) {
+        seed = seed * 1103515245 + 12345;
+        size_t id = (seed >> 8) % (BLOCK_STORE_NUM_BLOCKS + 8);
+        switch ((seed >> 4) % 5) {
+            case 0:
+                ASSERT_EQ(block_store_allocate(bs), fixed->allocate());
+                break;
+            case 1:
+                ASSERT_EQ(block_store_request(bs, id), fixed->request(id));
+                break;
+            case 2:
+                block_store_release(bs, id);
+                fixed->release(id);
+                break;
+            case 3:
+                memset(write_buffer, (int)(seed >> 24), sizeof(write_buffer));
+                ASSERT_EQ(block_store_write(bs, id, write_buffer), fixed->write(id, write_buffer));
+                break;
+            default:
+                ASSERT_EQ(block_store_read(bs, id, expected), fixed->read(id, actual));
+                if (id < BLOCK_STORE_NUM_BLOCKS) {
+                    ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES));
+                }
+                break;
+        }
+        ASSERT_EQ(block_store_get_used_blocks(bs), fixed->used_blocks());
+    }
+    ASSERT_EQ(block_store_get_free_blocks(bs), fixed->free_blocks());
+
+    // Images are interchangeable
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, fixed->serialize("test.bs"));
+    block_store_t *loaded = block_store_deserialize("test.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+    auto reloaded = std::make_unique<Fixed>();
+    ASSERT_TRUE(reloaded->deserialize("test.bs"));
+    ASSERT_EQ(block_store_get_used_blocks(loaded), reloaded->used_blocks());
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, id, expected));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, reloaded->read(id, actual));
+        ASSERT_EQ(0, memcmp(expected, actual, BLOCK_SIZE_BYTES));
+    }
+
+    block_store_destroy(loaded);
+    block_store_destroy(bs);
+}
+
+TEST(bitmap_inline, matches_exported)
+{
+    // The inline operations and the library's own must agree bit for bit
+    bitmap_t *bitmap = bitmap_create(1000);
+    ASSERT_NE(nullptr, bitmap);
+    for (size_t bit = 0; bit < 1000; bit += 3) bitmap_set_inline(bitmap, bit);
+    for (size_t bit = 0; bit < 1000; bit += 6) bitmap_reset(bitmap, bit);
+    for (size_t bit = 0; bit < 1000; ++bit) {
+        bool expected = bit % 3 == 0 && bit % 6 != 0;
+        ASSERT_EQ(expected, bitmap_test(bitmap, bit));
+        ASSERT_EQ(expected, bitmap_test_inline(bitmap, bit));
+    }
+    for (size_t bit = 3; bit < 1000; bit += 6) bitmap_reset_inline(bitmap, bit);
+    ASSERT_EQ(0u, bitmap_total_set(bitmap));
+    bitmap_destroy(bitmap);
+}
+
+TEST(block_store_striped, round_trip_over_three_files)
+{
+    // 40 chunks in stripes of 2 don't divide evenly between the files
+    const char *files[] = {"test_stripe0.bs", "test_stripe1.bs", "test_stripe2.bs"};
+    block_store_options_t options = {};
+    options.num_blocks = 128 * 40;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < options.num_blocks; id += 7) {
+        if (!block_store_request(bs, id)) continue;
+        memset(write_buffer, (int)(id % 251) + 1, BLOCK_SIZE_BYTES);
+        memcpy(write_buffer, &id, sizeof(id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, write_buffer));
+    }
+    ASSERT_EQ(options.num_blocks * BLOCK_SIZE_BYTES, block_store_serialize_striped(bs, files, 3, 256));
+
+    struct stat st;
+    ASSERT_EQ(0, stat(files[2], &st));
+    ASSERT_EQ(12 * 128 * BLOCK_SIZE_BYTES, (size_t)st.st_size);
+
+    block_store_t *loaded = block_store_deserialize_striped(files, 3, 256);
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(options.num_blocks, block_store_get_block_count(loaded));
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(loaded));
+    for (size_t id = 0; id < options.num_blocks; ++id) {
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, write_buffer));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, id, read_buffer));
+        ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES)) << "block " << id << " differs\n";
+    }
+
+    // The files only fit the stripe size they were written with
+    ASSERT_EQ(nullptr, block_store_deserialize_striped(files, 3, 128));
+    ASSERT_EQ(0, block_store_serialize_striped(bs, files, 3, 100));
+
+    block_store_destroy(loaded);
+    block_store_destroy(bs);
+    for (const char *file : files) unlink(file);
+}
+
+TEST(block_store_numa, allocation_stays_in_local_shard_until_full)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_NUMA;
+    options.num_blocks = 128 * 4;
+    options.numa_shards = 2;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+
+    // Each shard is 256 blocks; the calling thread's one has the 2 reserved blocks or none
+    size_t first = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, first);
+    const size_t local = first / 256;
+    const size_t local_free = local == 0 ? 254 : 256;
+    for (size_t n = 1; n < local_free; ++n) {
+        size_t id = block_store_allocate(bs);
+        ASSERT_EQ(local, id / 256) << "allocation " << n << " left the local shard\n";
+    }
+    size_t spilled = block_store_allocate(bs);
+    ASSERT_NE(SIZE_MAX, spilled);
+    ASSERT_NE(local, spilled / 256);
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    memset(write_buffer, 0x5A, BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, spilled, write_buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, spilled, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    block_store_destroy(bs);
+
+    options.flags |= BLOCK_STORE_OPT_DEDUP;
+    ASSERT_EQ(nullptr, block_store_create_ex(&options));
+}
+
+TEST(block_store_numa, fills_one_shard_at_a_time)
+{
+    // More shards than most hosts have nodes, so several are bound to the caller's node
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_NUMA;
+    options.num_blocks = 128 * 8;
+    options.numa_shards = 8;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+
+    // Each shard is one chunk; once allocation leaves a shard it never comes back to it
+    std::vector<bool> done(8, false), seen(options.num_blocks, false);
+    size_t current = SIZE_MAX, allocated = 0;
+    for (size_t id; (id = block_store_allocate(bs)) != SIZE_MAX; ++allocated) {
+        ASSERT_FALSE(seen[id]);
+        seen[id] = true;
+        if (id / 128 != current) {
+            if (current != SIZE_MAX) done[current] = true;
+            current = id / 128;
+            ASSERT_FALSE(done[current]) << "went back to shard " << current;
+        }
+    }
+    ASSERT_EQ(0u, block_store_get_free_blocks(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_huge_pages, data_area_reports_its_backing)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_HUGE_PAGES;
+    options.num_blocks = 128 * 1024;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(nullptr, block_store_snapshot(bs));
+
+    // Which backing is granted depends on the host's hugetlb pool and THP settings
+    unsigned backing = block_store_get_page_backing(bs);
+    ASSERT_TRUE(backing == BLOCK_STORE_PAGES_SMALL || backing == BLOCK_STORE_PAGES_TRANSPARENT
+                || backing == BLOCK_STORE_PAGES_HUGETLB);
+
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    for (size_t id = 0; id < options.num_blocks; id += 4099) {
+        memset(write_buffer, (int)(id % 251) + 1, BLOCK_SIZE_BYTES);
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, write_buffer));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, read_buffer));
+        ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    }
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 1, read_buffer));
+    ASSERT_EQ(0, read_buffer[0]);
+    block_store_destroy(bs);
+
+    // Everything else is on ordinary pages
+    bs = block_store_create();
+    ASSERT_EQ(BLOCK_STORE_PAGES_SMALL, block_store_get_page_backing(bs));
+    block_store_destroy(bs);
+    options.flags |= BLOCK_STORE_OPT_DEDUP;
+    ASSERT_EQ(nullptr, block_store_create_ex(&options));
+}
+
+TEST(block_store_sparse, chunks_materialize_on_first_write)
+{
+    // 2^30 blocks is 32 GiB of logical space
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_SPARSE;
+    options.num_blocks = size_t(1) << 30;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(options.num_blocks, block_store_get_block_count(bs));
+    ASSERT_EQ(0u, block_store_get_physical_blocks(bs));
+
+    // Reading a block that was never written allocates nothing
+    uint8_t write_buffer[BLOCK_SIZE_BYTES], read_buffer[BLOCK_SIZE_BYTES];
+    memset(read_buffer, 0xFF, BLOCK_SIZE_BYTES);
+    memset(write_buffer, 0, BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, options.num_blocks - 1, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(0u, block_store_get_physical_blocks(bs));
+
+    const size_t far = options.num_blocks - 3;
+    ASSERT_TRUE(block_store_request(bs, far));
+    memset(write_buffer, 0x3C, BLOCK_SIZE_BYTES);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, far, write_buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, far, read_buffer));
+    ASSERT_EQ(0, memcmp(write_buffer, read_buffer, BLOCK_SIZE_BYTES));
+    ASSERT_EQ(128u, block_store_get_physical_blocks(bs));
+
+    // Snapshots share the written chunks and the holes alike
+    block_store_t *snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap);
+    ASSERT_EQ(0u, block_store_allocate(bs));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 0, write_buffer));
+    ASSERT_EQ(256u, block_store_get_physical_blocks(bs));
+    ASSERT_EQ(128u, block_store_get_physical_blocks(snap));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, 0, read_buffer));
+    ASSERT_EQ(0, read_buffer[0]);
+    block_store_snapshot_release(snap);
+    block_store_destroy(bs);
+
+    options.flags |= BLOCK_STORE_OPT_DEDUP;
+    ASSERT_EQ(nullptr, block_store_create_ex(&options));
+}
+
+TEST(block_store_allocate_extent, first_and_best_fit)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+
+    // Runs never cross the reserved range
+    ASSERT_EQ(0u, block_store_allocate_extent(bs, BITMAP_START_BLOCK, BLOCK_STORE_FIT_FIRST));
+    const size_t reserved_end = BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS;
+    ASSERT_EQ(reserved_end, block_store_allocate_extent(bs, BLOCK_STORE_NUM_BLOCKS - reserved_end, BLOCK_STORE_FIT_BEST));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate(bs));
+
+    // Holes of 10, 3 and 5 blocks
+    for (size_t id = 10; id < 20; ++id) block_store_release(bs, id);
+    for (size_t id = 40; id < 43; ++id) block_store_release(bs, id);
+    for (size_t id = 60; id < 65; ++id) block_store_release(bs, id);
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(bs, 11, BLOCK_STORE_FIT_FIRST));
+    ASSERT_EQ(60u, block_store_allocate_extent(bs, 4, BLOCK_STORE_FIT_BEST));
+    ASSERT_EQ(10u, block_store_allocate_extent(bs, 4, BLOCK_STORE_FIT_FIRST));
+    ASSERT_EQ(40u, block_store_allocate_extent(bs, 3, BLOCK_STORE_FIT_BEST));
+    ASSERT_EQ(14u, block_store_allocate(bs));
+    ASSERT_EQ(64u, block_store_allocate_extent(bs, 1, BLOCK_STORE_FIT_BEST));
+    ASSERT_EQ(15u, block_store_allocate_extent(bs, 5, BLOCK_STORE_FIT_BEST));
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+    // Releases merge back into one run, and a reloaded store indexes its free runs again
+    for (size_t id = 10; id < 65; ++id) block_store_release(bs, id);
+    ASSERT_EQ(10u, block_store_allocate_extent(bs, 55, BLOCK_STORE_FIT_BEST));
+    for (size_t id = 30; id < 50; ++id) block_store_release(bs, id);
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    memset(buffer, 1, BLOCK_SIZE_BYTES);
+    for (size_t id = 0; id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+        if (id < 30 || id >= 50) block_store_write(bs, id, buffer);
+    }
+    ASSERT_EQ(BLOCK_STORE_NUM_BYTES, block_store_serialize(bs, "test.bs"));
+    block_store_t *loaded = block_store_deserialize("test.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_extent(loaded, 21, BLOCK_STORE_FIT_FIRST));
+    ASSERT_EQ(30u, block_store_allocate_extent(loaded, 20, BLOCK_STORE_FIT_FIRST));
+    block_store_destroy(loaded);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_allocate_extent, matches_model_under_churn)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    const size_t reserved_end = BITMAP_START_BLOCK + BITMAP_NUM_BLOCKS;
+    std::vector<bool> used(BLOCK_STORE_NUM_BLOCKS, false);
+    for (size_t id = BITMAP_START_BLOCK; id < reserved_end; ++id) used[id] = true;
+
+    // The free runs the model has, as (start, length)
+    auto runs = [&used]() {
+        std::vector<std::pair<size_t, size_t>> found;
+        for (size_t id = 0; id < used.size(); ++id) {
+            if (used[id]) continue;
+            size_t start = id;
+            while (id < used.size() && !used[id]) ++id;
+            found.emplace_back(start, id - start);
+        }
+        return found;
+    };
+
+    srand(42);
+    for (int step = 0; step < 4000; ++step) {
+        size_t count = 1 + rand() % 12;
+        switch (rand() % 4) {
+            case 0:
+            case 1: {
+                unsigned fit = rand() % 2 ? BLOCK_STORE_FIT_BEST : BLOCK_STORE_FIT_FIRST;
+                size_t expected = SIZE_MAX, best = SIZE_MAX;
+                for (auto run : runs()) {
+                    if (run.second < count) continue;
+                    if (fit == BLOCK_STORE_FIT_FIRST && expected == SIZE_MAX) expected = run.first;
+                    if (fit == BLOCK_STORE_FIT_BEST && run.second < best) {
+                        best = run.second;
+                        expected = run.first;
+                    }
+                }
+                ASSERT_EQ(expected, block_store_allocate_extent(bs, count, fit)) << "step " << step;
+                for (size_t id = expected; expected != SIZE_MAX && id < expected + count; ++id) used[id] = true;
+                break;
+            }
+            case 2: {
+                size_t start = rand() % BLOCK_STORE_NUM_BLOCKS;
+                for (size_t id = start; id < start + count && id < BLOCK_STORE_NUM_BLOCKS; ++id) {
+                    block_store_release(bs, id);
+                    if (id < BITMAP_START_BLOCK || id >= reserved_end) used[id] = false;
+                }
+                break;
+            }
+            default: {
+                size_t expected = std::find(used.begin(), used.end(), false) - used.begin();
+                size_t id = block_store_allocate(bs);
+                ASSERT_EQ(expected == used.size() ? SIZE_MAX : expected, id) << "step " << step;
+                if (id != SIZE_MAX) used[id] = true;
+                break;
+            }
+        }
+    }
+    block_store_destroy(bs);
+}
+
+TEST(block_store_buddy, orders_split_and_merge)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_BUDDY;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 9));
+
+    // [256, 512) is the only free block of order 8; once it's taken, order 8 has to wait
+    ASSERT_EQ(256u, block_store_allocate_order(bs, 8));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 8));
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 256, block_store_get_used_blocks(bs));
+
+    // Single blocks come from the smallest free blocks, not from splitting big ones
+    size_t single = block_store_allocate(bs);
+    ASSERT_TRUE(single == 126 || single == 129);
+
+    // Random orders stay aligned and never overlap
+    std::vector<std::pair<size_t, unsigned>> held;
+    std::vector<bool> used(BLOCK_STORE_NUM_BLOCKS, false);
+    srand(7);
+    for (int step = 0; step < 200; ++step) {
+        unsigned order = rand() % 5;
+        size_t id = block_store_allocate_order(bs, order);
+        if (id == SIZE_MAX) continue;
+        ASSERT_EQ(0u, id % (size_t(1) << order));
+        for (size_t i = id; i < id + (size_t(1) << order); ++i) {
+            ASSERT_FALSE(used[i]) << "block " << i << " handed out twice\n";
+            used[i] = true;
+        }
+        held.emplace_back(id, order);
+    }
+
+    // Freeing everything merges the halves back together
+    for (auto block : held) block_store_release_order(bs, block.first, block.second);
+    block_store_release(bs, single);
+    block_store_release_order(bs, 256, 8);
+    ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+    ASSERT_EQ(256u, block_store_allocate_order(bs, 8));
+    ASSERT_EQ(0u, block_store_allocate_order(bs, 6) % 64);
+    block_store_destroy(bs);
+
+    // Other stores have no buddy system
+    bs = block_store_create();
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_order(bs, 0));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_policy, each_policy_picks_its_block)
+{
+    block_store_options_t options = {};
+    options.policy = 4;
+    ASSERT_EQ(nullptr, block_store_create_ex(&options));
+
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    ASSERT_FALSE(block_store_set_policy(bs, 4));
+    ASSERT_FALSE(block_store_set_policy(NULL, BLOCK_STORE_POLICY_FIRST_FIT));
+    for (size_t i = 0; i < 10; ++i) ASSERT_EQ(i, block_store_allocate(bs));
+
+    // First-fit reuses the lowest hole
+    block_store_release(bs, 1);
+    ASSERT_EQ(1u, block_store_allocate(bs));
+
+    // Next-fit carries on from the last block, passing the hole, and wraps around at the end
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_POLICY_NEXT_FIT));
+    block_store_release(bs, 0);
+    ASSERT_EQ(10u, block_store_allocate(bs));
+    while (block_store_allocate(bs) != SIZE_MAX) {}
+    block_store_release(bs, 7);
+    ASSERT_EQ(7u, block_store_allocate(bs));
+
+    // Best-fit takes the single-block hole before the first block of a longer run
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_POLICY_BEST_FIT));
+    block_store_release(bs, 2);
+    block_store_release(bs, 3);
+    block_store_release(bs, 8);
+    ASSERT_EQ(8u, block_store_allocate(bs));
+    ASSERT_EQ(2u, block_store_allocate(bs));
+    ASSERT_EQ(3u, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_policy, allocate_near_searches_both_ways)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    for (size_t i = 0; i < 20; ++i) ASSERT_EQ(i, block_store_allocate(bs));
+    block_store_release(bs, 5);
+    block_store_release(bs, 12);
+
+    ASSERT_EQ(12u, block_store_allocate_near(bs, 10));
+    ASSERT_EQ(5u, block_store_allocate_near(bs, 10));
+    ASSERT_EQ(20u, block_store_allocate_near(bs, 10));
+
+    // A hint inside the reserved range lands on whichever side is closer, the later on a tie
+    ASSERT_EQ(126u, block_store_allocate_near(bs, 127));
+    ASSERT_EQ(129u, block_store_allocate_near(bs, 127));
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - 1, block_store_allocate_near(bs, SIZE_MAX));
+    ASSERT_EQ(SIZE_MAX, block_store_allocate_near(NULL, 0));
+
+    // The near policy works from the last block handed out
+    ASSERT_TRUE(block_store_set_policy(bs, BLOCK_STORE_POLICY_NEAR));
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - 2, block_store_allocate(bs));
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - 3, block_store_allocate(bs));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_refcount, last_owner_frees_the_block)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_REFCOUNT;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+
+    size_t id = block_store_allocate(bs);
+    ASSERT_EQ(1u, block_store_get_refs(bs, id));
+    ASSERT_TRUE(block_store_ref(bs, id));
+    ASSERT_TRUE(block_store_ref(bs, id));
+    ASSERT_EQ(3u, block_store_get_refs(bs, id));
+    ASSERT_FALSE(block_store_ref(bs, id + 1));
+
+    // Plain release drops one owner, like unref
+    block_store_release(bs, id);
+    ASSERT_EQ(1u, block_store_unref(bs, id));
+    ASSERT_EQ(BITMAP_NUM_BLOCKS + 1, block_store_get_used_blocks(bs));
+    ASSERT_EQ(0u, block_store_unref(bs, id));
+    ASSERT_EQ(SIZE_MAX, block_store_unref(bs, id));
+    ASSERT_EQ(0u, block_store_get_refs(bs, id));
+    ASSERT_EQ(BITMAP_NUM_BLOCKS, block_store_get_used_blocks(bs));
+
+    // A reallocated block starts with one owner again
+    ASSERT_EQ(id, block_store_allocate(bs));
+    ASSERT_EQ(1u, block_store_get_refs(bs, id));
+
+    // Transactions release through the counts too
+    ASSERT_TRUE(block_store_ref(bs, id));
+    block_store_txn_t *txn = block_store_txn_begin(bs);
+    ASSERT_TRUE(block_store_txn_release(txn, id));
+    ASSERT_TRUE(block_store_txn_commit(txn));
+    ASSERT_EQ(1u, block_store_get_refs(bs, id));
+    block_store_destroy(bs);
+
+    // Without the option every block in use has a single owner
+    bs = block_store_create();
+    id = block_store_allocate(bs);
+    ASSERT_FALSE(block_store_ref(bs, id));
+    ASSERT_EQ(1u, block_store_get_refs(bs, id));
+    ASSERT_EQ(0u, block_store_unref(bs, id));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_compact, moves_blocks_into_a_dense_prefix)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_REMAP | BLOCK_STORE_OPT_SPARSE;
+    options.num_blocks = 4096;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    size_t reserved = block_store_get_used_blocks(bs);
+
+    // Checkerboard the first 1024 blocks, each stamped with its id
+    uint8_t buffer[BLOCK_SIZE_BYTES];
+    std::vector<size_t> ids, kept;
+    for (size_t n = 0; n < 1024; ++n) {
+        size_t id = block_store_allocate(bs);
+        ASSERT_NE(SIZE_MAX, id);
+        memset(buffer, 0, sizeof(buffer));
+        memcpy(buffer, &id, sizeof(id));
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+        ids.push_back(id);
+    }
+    for (size_t n = 0; n < ids.size(); ++n) {
+        if (n % 2) block_store_release(bs, ids[n]);
+        else kept.push_back(ids[n]);
+    }
+    size_t last = kept.back();
+    ASSERT_EQ(last, block_store_locate(bs, last));
+    size_t materialized = block_store_get_physical_blocks(bs);
+    block_store_t *snap = block_store_snapshot(bs);
+    ASSERT_NE(nullptr, snap);
+
+    // Bounded steps, each doing at most what it's allowed to
+    size_t steps = 0, moves;
+    while ((moves = block_store_compact(bs, 16)) != 0) {
+        ASSERT_LE(moves, 16u);
+        ++steps;
+    }
+    ASSERT_GT(steps, 1u);
+
+    // Same ids, same data, now packed below the point where half the blocks used to end
+    std::vector<bool> taken(4096, false);
+    for (size_t id : kept) {
+        size_t block = block_store_locate(bs, id);
+        ASSERT_LT(block, 512 + reserved);
+        ASSERT_FALSE(taken[block]);
+        taken[block] = true;
+        ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+        ASSERT_EQ(0, memcmp(buffer, &id, sizeof(id)));
+    }
+    ASSERT_NE(last, block_store_locate(bs, last));
+    ASSERT_LT(block_store_get_physical_blocks(bs), materialized);
+
+    // The snapshot keeps the layout it was taken with
+    ASSERT_EQ(last, block_store_locate(snap, last));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(snap, last, buffer));
+    ASSERT_EQ(0, memcmp(buffer, &last, sizeof(last)));
+    block_store_snapshot_release(snap);
+
+    // Free space is one run again
+    size_t run = block_store_allocate_extent(bs, 1024, BLOCK_STORE_FIT_FIRST);
+    ASSERT_NE(SIZE_MAX, run);
+    ASSERT_EQ(block_store_locate(bs, run) + 1023, block_store_locate(bs, run + 1023));
+
+    // Images hold the logical layout
+    ASSERT_NE(0u, block_store_serialize_compressed(bs, "test.bsz"));
+    block_store_t *loaded = block_store_deserialize_compressed("test.bsz");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_EQ(block_store_get_used_blocks(bs), block_store_get_used_blocks(loaded));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(loaded, last, buffer));
+    ASSERT_EQ(0, memcmp(buffer, &last, sizeof(last)));
+    block_store_destroy(loaded);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_compact, logical_ids_behave_like_blocks)
+{
+    block_store_options_t options = {};
+    options.flags = BLOCK_STORE_OPT_REMAP | BLOCK_STORE_OPT_REFCOUNT;
+    block_store_t *bs = block_store_create_ex(&options);
+    ASSERT_NE(nullptr, bs);
+    options.flags = BLOCK_STORE_OPT_REMAP | BLOCK_STORE_OPT_BUDDY;
+    ASSERT_EQ(nullptr, block_store_create_ex(&options));
+
+    // Ids that aren't allocated have nowhere to keep data
+    uint8_t buffer[BLOCK_SIZE_BYTES], zeros[BLOCK_SIZE_BYTES] = {};
+    memset(buffer, 0xAB, sizeof(buffer));
+    ASSERT_EQ(0u, block_store_write(bs, 40, buffer));
+    ASSERT_EQ(SIZE_MAX, block_store_locate(bs, 40));
+
+    for (int i = 0; i < 8; ++i) ASSERT_EQ(size_t(i), block_store_allocate(bs));
+    ASSERT_TRUE(block_store_ref(bs, 7));
+    block_store_release(bs, 2);
+    ASSERT_EQ(1u, block_store_compact(bs, 100));
+    ASSERT_EQ(0u, block_store_compact(bs, 100));
+
+    // Block 7's data and owners moved into 2, under the same id
+    ASSERT_EQ(2u, block_store_locate(bs, 7));
+    ASSERT_EQ(2u, block_store_get_refs(bs, 7));
+    ASSERT_FALSE(block_store_request(bs, 7));
+
+    // Id 2 is free but block 2 isn't, so requesting it puts the data in the first free block
+    ASSERT_TRUE(block_store_request(bs, 2));
+    ASSERT_EQ(7u, block_store_locate(bs, 2));
+    ASSERT_EQ(1u, block_store_unref(bs, 7));
+    ASSERT_EQ(0u, block_store_unref(bs, 7));
+    ASSERT_EQ(SIZE_MAX, block_store_locate(bs, 7));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, 2, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 2, zeros));
+    ASSERT_EQ(0, memcmp(buffer, zeros, sizeof(buffer)));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, 40, buffer));
+    ASSERT_EQ(0, buffer[0]);
+    block_store_destroy(bs);
+
+    // Stores without remapping can't move blocks
+    bs = block_store_create();
+    ASSERT_EQ(0u, block_store_compact(bs, 10));
+    ASSERT_EQ(5u, block_store_locate(bs, 5));
+    block_store_destroy(bs);
+}
+
+TEST(block_store_stats, records_only_while_enabled)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    block_store_stats_t stats;
+    ASSERT_FALSE(block_store_get_stats(NULL, &stats));
+    ASSERT_FALSE(block_store_get_stats(bs, NULL));
+
+    // Nothing is timed until recording is switched on
+    uint8_t buffer[BLOCK_SIZE_BYTES] = {};
+    size_t id = block_store_allocate(bs);
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+    ASSERT_TRUE(block_store_get_stats(bs, &stats));
+    for (unsigned op = 0; op < BLOCK_STORE_STAT_COUNT; ++op) ASSERT_EQ(0u, stats.ops[op].count);
+
+    block_store_set_stats_enabled(true);
+    for (int i = 0; i < 3; ++i) ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_read(bs, id, buffer));
+    ASSERT_EQ(BLOCK_SIZE_BYTES, block_store_write(bs, id, buffer));
+    ASSERT_NE(SIZE_MAX, block_store_allocate(bs));
+    block_store_release(bs, id);
+    ASSERT_EQ(BLOCK_SIZE_BYTES * BLOCK_STORE_NUM_BLOCKS, block_store_serialize(bs, "test.bs"));
+    ASSERT_TRUE(block_store_get_stats(bs, &stats));
+    ASSERT_EQ(3u, stats.ops[BLOCK_STORE_STAT_READ].count);
+    ASSERT_EQ(1u, stats.ops[BLOCK_STORE_STAT_WRITE].count);
+    ASSERT_EQ(1u, stats.ops[BLOCK_STORE_STAT_ALLOCATE].count);
+    ASSERT_EQ(1u, stats.ops[BLOCK_STORE_STAT_RELEASE].count);
+    ASSERT_EQ(1u, stats.ops[BLOCK_STORE_STAT_SERIALIZE].count);
+    ASSERT_EQ(0u, stats.ops[BLOCK_STORE_STAT_REQUEST].count);
+    for (unsigned op = 0; op < BLOCK_STORE_STAT_COUNT; ++op) {
+        uint64_t bucketed = 0;
+        for (unsigned i = 0; i < BLOCK_STORE_STATS_BUCKETS; ++i) bucketed += stats.ops[op].buckets[i];
+        ASSERT_EQ(stats.ops[op].count, bucketed);
+        ASSERT_LE(stats.ops[op].max_ns, stats.ops[op].total_ns);
+    }
+
+    // Loads are counted on the store they produce
+    block_store_t *loaded = block_store_deserialize("test.bs");
+    ASSERT_NE(nullptr, loaded);
+    ASSERT_TRUE(block_store_get_stats(loaded, &stats));
+    ASSERT_EQ(1u, stats.ops[BLOCK_STORE_STAT_DESERIALIZE].count);
+    ASSERT_EQ(0u, stats.ops[BLOCK_STORE_STAT_READ].count);
+    block_store_destroy(loaded);
+
+    block_store_reset_stats(bs);
+    ASSERT_TRUE(block_store_get_stats(bs, &stats));
+    for (unsigned op = 0; op < BLOCK_STORE_STAT_COUNT; ++op) {
+        ASSERT_EQ(0u, stats.ops[op].count);
+        ASSERT_EQ(0u, stats.ops[op].max_ns);
+    }
+    block_store_set_stats_enabled(false);
+    block_store_destroy(bs);
+}
+
+TEST(block_store_free_space, describes_runs_of_free_blocks)
+{
+    block_store_t *bs = block_store_create();
+    ASSERT_NE(nullptr, bs);
+    block_store_free_space_t info;
+    ASSERT_FALSE(block_store_get_free_space_info(NULL, &info));
+    ASSERT_FALSE(block_store_get_free_space_info(bs, NULL));
+
+    // The reserved range splits a fresh store in two
+    ASSERT_TRUE(block_store_get_free_space_info(bs, &info));
+    ASSERT_EQ(block_store_get_free_blocks(bs), info.free_blocks);
+    ASSERT_EQ(2u, info.runs);
+    ASSERT_EQ(BLOCK_STORE_NUM_BLOCKS - BITMAP_START_BLOCK - 2, info.largest_run);
+
+    // Runs at the start, alone, across 64-block words and at the end
+    while (block_store_allocate(bs) != SIZE_MAX) {}
+    for (size_t id = 0; id < 10; ++id) block_store_release(bs, id);
+    block_store_release(bs, 20);
+    for (size_t id = 300; id < 364; ++id) block_store_release(bs, id);
+    for (size_t id = 500; id < BLOCK_STORE_NUM_BLOCKS; ++id) block_store_release(bs, id);
+    ASSERT_TRUE(block_store_get_free_space_info(bs, &info));
+    ASSERT_EQ(87u, info.free_blocks);
+    ASSERT_EQ(4u, info.runs);
+    ASSERT_EQ(64u, info.largest_run);
+    ASSERT_EQ(1u, info.runs_by_length[0]);
+    ASSERT_EQ(2u, info.runs_by_length[3]);
+    ASSERT_EQ(1u, info.runs_by_length[6]);
+    ASSERT_DOUBLE_EQ(1.0 - 64.0 / 87.0, info.fragmentation);
+
+    // A loaded store finds the same runs by scanning its bitmap
+    ASSERT_NE(0u, block_store_serialize_compressed(bs, "test.bsz"));
+    block_store_t *loaded = block_store_deserialize_compressed("test.bsz");
+    ASSERT_NE(nullptr, loaded);
+    block_store_free_space_t reloaded;
+    ASSERT_TRUE(block_store_get_free_space_info(loaded, &reloaded));
+    ASSERT_EQ(0, memcmp(&info, &reloaded, sizeof(info)));
+    block_store_destroy(loaded);
+
+    // Filling the holes leaves nothing to describe
+    while (block_store_allocate(bs) != SIZE_MAX) {}
+    ASSERT_TRUE(block_store_get_free_space_info(bs, &info));
+    ASSERT_EQ(0u, info.runs);
+    ASSERT_EQ(0u, info.largest_run);
+    ASSERT_EQ(0.0, info.fragmentation);
+    block_store_destroy(bs);
+}